@@ -0,0 +1,87 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+// Compares the per-value ply_cast path with the bulk endian_swap_buffer kernels
+// on big-endian columns of 16, 32 and 64 bit values. Columns default to the
+// 64 KiB blocks the record decoder works on, so they stay in cache.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "bench_util.h"
+#include "tinyply.h"
+
+namespace {
+
+using C3DV_bench::MeasureSeconds;
+
+// What read_property_binary does for every scalar of a big-endian file.
+template<typename T>
+void PerValue(std::vector<uint8_t>& dest, const std::vector<uint8_t>& src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (sizeof(T) == 4)
+            tinyply::ply_cast_float<float>(&dest[i * 4], reinterpret_cast<const char*>(&src[i * 4]), true);
+        else if (sizeof(T) == 8)
+            tinyply::ply_cast_double<double>(&dest[i * 8], reinterpret_cast<const char*>(&src[i * 8]), true);
+        else
+            tinyply::ply_cast<T>(&dest[i * sizeof(T)], reinterpret_cast<const char*>(&src[i * sizeof(T)]), true);
+    }
+}
+
+template<typename T>
+void Run(const char* name, size_t count, int iterations) {
+    std::vector<uint8_t> src(count * sizeof(T));
+    for (auto& b : src)
+        b = static_cast<uint8_t>(std::rand());
+    std::vector<uint8_t> per_value(src.size());
+    std::vector<uint8_t> scalar(src.size());
+    std::vector<uint8_t> bulk(src.size());
+
+    // The bulk paths copy the column first, as the record decoder does.
+    const double t_value = MeasureSeconds([&]() { PerValue<T>(per_value, src, count); }, iterations, 5);
+    const double t_scalar = MeasureSeconds([&]() {
+        std::memcpy(scalar.data(), src.data(), src.size());
+        tinyply::endian_swap_buffer_scalar(scalar.data(), count, sizeof(T));
+    }, iterations, 5);
+    const double t_bulk = MeasureSeconds([&]() {
+        std::memcpy(bulk.data(), src.data(), src.size());
+        tinyply::endian_swap_buffer(bulk.data(), count, sizeof(T));
+    }, iterations, 5);
+    const bool equal = (per_value == scalar) && (per_value == bulk);
+    const double mb = src.size() / 1e6;
+    std::cout << name << ": per value " << mb / t_value << " MB/s, bulk scalar " << mb / t_scalar
+              << " MB/s, bulk simd " << mb / t_bulk << " MB/s (" << t_value / t_bulk << "x per value)"
+              << (equal ? "" : "  MISMATCH") << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+    const size_t bytes = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : (size_t(1) << 16);
+    const int iterations = static_cast<int>(std::max<size_t>(1, (size_t(1) << 30) / bytes));
+#if defined(__AVX2__)
+    std::cout << "kernels: AVX2" << std::endl;
+#elif defined(__SSSE3__)
+    std::cout << "kernels: SSSE3" << std::endl;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    // endian_swap_buffer picks the SSSE3 kernel at runtime.
+    std::cout << "kernels: " << (__builtin_cpu_supports("ssse3") ? "SSSE3 (runtime)" : "SSE2") << std::endl;
+#elif defined(__SSE2__) || defined(_M_X64)
+    std::cout << "kernels: SSE2" << std::endl;
+#else
+    std::cout << "kernels: scalar" << std::endl;
+#endif
+    Run<uint16_t>("uint16", bytes / 2, iterations);
+    Run<float>("float ", bytes / 4, iterations);
+    Run<double>("double", bytes / 8, iterations);
+    return 0;
+}
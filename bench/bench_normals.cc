@@ -0,0 +1,118 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+// Compares ComputeNormals on one thread and on all cores with Assimp's
+// aiProcess_GenSmoothNormals on the same triangles. Pass a mesh file (its normals are
+// ignored), otherwise a grid of n x n vertices (default 1000) is written to a temporary file.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+#include <assimp/scene.h>
+
+#include "bench_util.h"
+#include "mesh_processing.h"
+
+namespace {
+
+using C3DV_bench::MeasureSeconds;
+using C3DV_bench::SecondsSince;
+
+// Triangulated with shared vertices and without normals, as ComputeNormals sees a mesh.
+const aiScene* Import(Assimp::Importer& importer, const std::string& path) {
+    return importer.ReadFile(path, aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_DropNormals);
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string path = (argc > 1) ? argv[1] : "";
+    const bool generated = path.empty();
+    if (generated) {
+        path = "bench_normals.tmp.obj";
+        C3DV_bench::WriteGrid(path, (argc > 2) ? std::atoi(argv[2]) : 1000, false);
+    }
+
+    // The mesh as one index and vertex buffer, like loadAssImp builds it.
+    Assimp::Importer importer;
+    const aiScene* scene = Import(importer, path);
+    if (!scene) {
+        std::cout << importer.GetErrorString() << std::endl;
+        return 1;
+    }
+    std::vector<unsigned int> indices;
+    std::vector<float> vertices;
+    for (unsigned int m = 0; m < scene->mNumMeshes; m++) {
+        const aiMesh* part = scene->mMeshes[m];
+        const unsigned int base = static_cast<unsigned int>(vertices.size() / 3);
+        for (unsigned int i = 0; i < part->mNumVertices; i++)
+            vertices.insert(vertices.end(), {part->mVertices[i].x, part->mVertices[i].y, part->mVertices[i].z});
+        for (unsigned int i = 0; i < part->mNumFaces; i++) {
+            if (part->mFaces[i].mNumIndices != 3)
+                continue;
+            for (int k = 0; k < 3; k++)
+                indices.push_back(base + part->mFaces[i].mIndices[k]);
+        }
+    }
+
+    // Assimp changes the scene in place, so every run imports it again and only the
+    // post-processing step is timed.
+    double t_assimp = 1e30;
+    std::vector<float> assimp_normals;
+    for (int r = 0; r < 3; r++) {
+        Assimp::Importer run_importer;
+        Import(run_importer, path);
+        const auto start = std::chrono::steady_clock::now();
+        const aiScene* smoothed = run_importer.ApplyPostProcessing(aiProcess_GenSmoothNormals);
+        t_assimp = std::min(t_assimp, SecondsSince(start));
+        assimp_normals.clear();
+        for (unsigned int m = 0; smoothed && m < smoothed->mNumMeshes; m++) {
+            const aiMesh* part = smoothed->mMeshes[m];
+            for (unsigned int i = 0; i < part->mNumVertices; i++) {
+                const aiVector3D n = part->mNormals ? part->mNormals[i] : aiVector3D(0, 0, 0);
+                assimp_normals.insert(assimp_normals.end(), {n.x, n.y, n.z});
+            }
+        }
+    }
+    std::vector<float> normals;
+    const double t_single = MeasureSeconds([&]() {
+        C3DV_graphics::ComputeNormals(indices, vertices, normals, 1);
+    });
+    const size_t threads = C3DV_graphics::WorkerCount();
+    const double t_parallel = MeasureSeconds([&]() {
+        C3DV_graphics::ComputeNormals(indices, vertices, normals, threads);
+    });
+
+    // Assimp averages unweighted face normals, so the results differ where face sizes do.
+    double angle_sum = 0.0;
+    size_t compared = 0;
+    for (size_t i = 0; i + 2 < std::min(normals.size(), assimp_normals.size()); i += 3) {
+        const double dot = normals[i] * assimp_normals[i] + normals[i + 1] * assimp_normals[i + 1] + normals[i + 2] * assimp_normals[i + 2];
+        angle_sum += std::acos(std::min(1.0, std::max(-1.0, dot)));
+        compared++;
+    }
+
+    std::cout << path << ": " << indices.size() / 3 << " triangles, " << vertices.size() / 3 << " vertices" << std::endl;
+    std::cout << "Assimp GenSmoothNormals : " << t_assimp * 1e3 << " ms" << std::endl;
+    std::cout << "ComputeNormals, 1 thread: " << t_single * 1e3 << " ms (" << t_assimp / t_single << "x Assimp)" << std::endl;
+    std::cout << "ComputeNormals, " << threads << " threads: " << t_parallel * 1e3 << " ms (" << t_assimp / t_parallel << "x Assimp)" << std::endl;
+    if (compared > 0)
+        std::cout << "mean angle to Assimp's normals: " << angle_sum / compared * 180.0 / M_PI << " degrees" << std::endl;
+    if (generated)
+        std::remove(path.c_str());
+    return 0;
+}
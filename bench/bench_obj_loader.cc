@@ -0,0 +1,80 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+// Compares LoadObj on one thread and on all cores with tinyobj::LoadObj and the Assimp
+// import the viewer used before. Pass an OBJ file, otherwise a textured grid of
+// n x n vertices (default 1000) is written to a temporary file first.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+#include <assimp/scene.h>
+
+#include "bench_util.h"
+#include "obj_loader.h"
+#include "tiny_obj_loader.h"
+
+namespace {
+
+using C3DV_bench::MeasureSeconds;
+
+void Report(const char* name, double seconds, size_t bytes, double baseline) {
+    std::cout << name << ": " << seconds * 1e3 << " ms, " << bytes / seconds / (1 << 20) << " MB/s ("
+              << baseline / seconds << "x Assimp)" << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string path = (argc > 1) ? argv[1] : "";
+    const bool generated = path.empty();
+    if (generated) {
+        path = "bench_obj_loader.tmp.obj";
+        C3DV_bench::WriteGrid(path, (argc > 2) ? std::atoi(argv[2]) : 1000, true);
+    }
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    const size_t bytes = static_cast<size_t>(file.tellg());
+
+    C3DV_graphics::Mesh mesh;
+    const double t_assimp = MeasureSeconds([&]() {
+        Assimp::Importer importer;
+        importer.ReadFile(path, aiProcess_Triangulate);
+    });
+    const double t_tinyobj = MeasureSeconds([&]() {
+        tinyobj::attrib_t attrib;
+        std::vector<tinyobj::shape_t> shapes;
+        std::vector<tinyobj::material_t> materials;
+        std::string error;
+        tinyobj::LoadObj(&attrib, &shapes, &materials, &error, path.c_str());
+    });
+    const double t_single = MeasureSeconds([&]() {
+        C3DV_graphics::LoadObj(path, mesh, 1);
+    });
+    const size_t threads = C3DV_graphics::WorkerCount();
+    const double t_parallel = MeasureSeconds([&]() {
+        C3DV_graphics::LoadObj(path, mesh, threads);
+    });
+
+    std::cout << path << ": " << bytes / (1 << 20) << " MB, " << mesh.indices.size() / 3 << " triangles, "
+              << mesh.vertices.size() / 3 << " vertices" << std::endl;
+    Report("Assimp            ", t_assimp, bytes, t_assimp);
+    Report("tinyobj::LoadObj  ", t_tinyobj, bytes, t_assimp);
+    Report("LoadObj, 1 thread ", t_single, bytes, t_assimp);
+    std::cout << "LoadObj, " << threads << " threads";
+    Report("", t_parallel, bytes, t_assimp);
+    if (generated)
+        std::remove(path.c_str());
+    return 0;
+}
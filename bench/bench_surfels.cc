@@ -0,0 +1,142 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+// Surfels/s of ExpandSurfels for 1, 2, 4, ... threads up to all cores, next to the scalar
+// per-surfel loop it replaces. Pass the number of random surfels (default 4M).
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "bench_util.h"
+#include "surfel_processing.h"
+
+namespace {
+
+using C3DV_bench::MeasureSeconds;
+using C3DV_bench::Random;
+using C3DV_graphics::SurfelVertex;
+
+void Cross(const float a[3], const float b[3], float c[3]) {
+    c[0] = a[1] * b[2] - a[2] * b[1];
+    c[1] = a[2] * b[0] - a[0] * b[2];
+    c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// One surfel at a time with the branchy tangent selection, as the viewer expanded them before.
+void ExpandScalar(const C3DV_graphics::SurfelColumns& columns, SurfelVertex* vertices) {
+    static const float kAxes[2][3] = {{1, 0, 0}, {0, 1, 0}};
+    static const int kCorners[6] = {0, 1, 2, 0, 2, 3};
+    for (size_t i = 0; i < columns.x.size(); i++) {
+        const float normal[3] = {columns.nx[i], columns.ny[i], columns.nz[i]};
+        const float radius = C3DV_graphics::kSurfelScale * columns.radius[i];
+        float u[3], v[3];
+        Cross(normal, kAxes[std::fabs(normal[0]) > std::fabs(normal[1]) ? 0 : 1], u);
+        const float length = std::sqrt(u[0] * u[0] + u[1] * u[1] + u[2] * u[2]);
+        for (int k = 0; k < 3; k++)
+            u[k] = (length > 0.0f) ? radius * u[k] / length : 0.0f;
+        Cross(normal, u, v);
+        const float point[3] = {columns.x[i], columns.y[i], columns.z[i]};
+        float corners[4][3];
+        for (int k = 0; k < 3; k++) {
+            corners[0][k] = point[k] - u[k];
+            corners[1][k] = point[k] - v[k];
+            corners[2][k] = point[k] + u[k];
+            corners[3][k] = point[k] + v[k];
+        }
+        for (int s = 0; s < 6; s++) {
+            SurfelVertex& vertex = vertices[6 * i + s];
+            for (int k = 0; k < 3; k++) {
+                vertex.position[k] = corners[kCorners[s]][k];
+                vertex.normal[k] = normal[k];
+            }
+            vertex.color[0] = columns.red[i];
+            vertex.color[1] = columns.green[i];
+            vertex.color[2] = columns.blue[i];
+            vertex.color[3] = 255;
+        }
+    }
+}
+
+}
+
+int main(int argc, char** argv) {
+    const size_t count = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : (4u << 20);
+
+    // Laid out like the vertex element of a surfel PLY file, the columns are strided views into it.
+    struct Surfel {
+        float x, y, z, nx, ny, nz, radius;
+        uint8_t red, green, blue;
+    };
+    std::vector<Surfel> surfels(count);
+    for (Surfel& surfel : surfels) {
+        surfel.x = Random(-5, 5);
+        surfel.y = Random(-5, 5);
+        surfel.z = Random(-5, 5);
+        const float nx = Random(-1, 1), ny = Random(-1, 1), nz = Random(-1, 1);
+        const float length = std::max(1e-6f, std::sqrt(nx * nx + ny * ny + nz * nz));
+        surfel.nx = nx / length;
+        surfel.ny = ny / length;
+        surfel.nz = nz / length;
+        surfel.radius = Random(1, 20);
+        surfel.red = static_cast<uint8_t>(std::rand());
+        surfel.green = static_cast<uint8_t>(std::rand());
+        surfel.blue = static_cast<uint8_t>(std::rand());
+    }
+    C3DV_graphics::SurfelColumns columns;
+    const auto view = [&](const void* first) {
+        return tinyply::StridedView<float>(first, sizeof(Surfel), count);
+    };
+    const auto view_byte = [&](const void* first) {
+        return tinyply::StridedView<uint8_t>(first, sizeof(Surfel), count);
+    };
+    columns.x = view(&surfels[0].x);
+    columns.y = view(&surfels[0].y);
+    columns.z = view(&surfels[0].z);
+    columns.nx = view(&surfels[0].nx);
+    columns.ny = view(&surfels[0].ny);
+    columns.nz = view(&surfels[0].nz);
+    columns.radius = view(&surfels[0].radius);
+    columns.red = view_byte(&surfels[0].red);
+    columns.green = view_byte(&surfels[0].green);
+    columns.blue = view_byte(&surfels[0].blue);
+
+    std::vector<SurfelVertex> reference(6 * count);
+    const double t_scalar = MeasureSeconds([&]() {
+        ExpandScalar(columns, reference.data());
+    });
+    std::cout << count << " surfels" << std::endl;
+    std::cout << "scalar loop       : " << count / t_scalar / 1e6 << " M surfels/s" << std::endl;
+
+    std::vector<SurfelVertex> vertices(6 * count);
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < C3DV_graphics::WorkerCount(); threads *= 2)
+        thread_counts.push_back(threads);
+    thread_counts.push_back(C3DV_graphics::WorkerCount());
+    double t_single = 0.0;
+    for (size_t threads : thread_counts) {
+        const double t = MeasureSeconds([&]() {
+            C3DV_graphics::ExpandSurfels(columns, vertices.data(), threads);
+        });
+        if (threads == 1)
+            t_single = t;
+        std::cout << "ExpandSurfels, " << threads << " thread(s): " << count / t / 1e6 << " M surfels/s ("
+                  << t_single / t << "x 1 thread, " << t_scalar / t << "x scalar)" << std::endl;
+    }
+
+    float max_difference = 0.0f;
+    for (size_t i = 0; i < vertices.size(); i++) {
+        for (int k = 0; k < 3; k++)
+            max_difference = std::max(max_difference, std::fabs(vertices[i].position[k] - reference[i].position[k]));
+    }
+    std::cout << "max position difference to the scalar loop: " << max_difference << std::endl;
+    return 0;
+}
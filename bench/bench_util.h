@@ -0,0 +1,73 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_BENCH_UTIL_
+#define _H_BENCH_UTIL_
+
+// Timing and fixtures shared by the benchmarks.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+namespace C3DV_bench {
+
+inline double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Best of `runs` runs of `iterations` calls, in seconds per call.
+template<typename F>
+double MeasureSeconds(F function, int iterations = 1, int runs = 3) {
+    double best = 1e30;
+    for (int r = 0; r < runs; r++) {
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+            function();
+        best = std::min(best, SecondsSince(start) / iterations);
+    }
+    return best;
+}
+
+inline float Random(float low, float high) {
+    return low + (high - low) * std::rand() / RAND_MAX;
+}
+
+// An OBJ grid of n x n vertices with random heights and (n - 1)^2 quads, with texture
+// coordinates and normals if `textured`.
+inline void WriteGrid(const std::string& path, int n, bool textured) {
+    std::ofstream out(path);
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < n; i++) {
+            out << "v " << i * 0.01f << " " << j * 0.01f << " " << Random(0.0f, 0.05f) << "\n";
+            if (textured) {
+                out << "vt " << static_cast<float>(i) / n << " " << static_cast<float>(j) / n << "\n";
+                out << "vn 0 0 1\n";
+            }
+        }
+    }
+    for (int j = 0; j + 1 < n; j++) {
+        for (int i = 0; i + 1 < n; i++) {
+            const int corners[4] = {j * n + i + 1, j * n + i + 2, (j + 1) * n + i + 2, (j + 1) * n + i + 1};
+            out << "f";
+            for (int c : corners) {
+                out << " " << c;
+                if (textured)
+                    out << "/" << c << "/" << c;
+            }
+            out << "\n";
+        }
+    }
+}
+
+};
+
+#endif  // _H_BENCH_UTIL_
@@ -0,0 +1,239 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#include "async_loader.h"
+
+#include <algorithm>
+#include <future>
+
+namespace C3DV_graphics {
+
+void LoadProgress::Reset(uint64_t bytes) {
+    bytes_total = bytes;
+    bytes_done = 0;
+    points_done = 0;
+    cancelled = false;
+    elapsed = 0;
+    running = true;
+    start = std::chrono::steady_clock::now();
+}
+
+void LoadProgress::Advance(uint64_t bytes, uint64_t points) {
+    bytes_done += bytes;
+    points_done += points;
+}
+
+void LoadProgress::Finish() {
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    running = false;
+}
+
+float LoadProgress::Fraction() const {
+    const uint64_t total = bytes_total;
+    return (total == 0) ? 0.0f : std::min(1.0f, static_cast<float>(bytes_done) / total);
+}
+
+double LoadProgress::Seconds() const {
+    if (!running)
+        return elapsed;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double LoadProgress::BytesPerSecond() const {
+    const double seconds = Seconds();
+    return (seconds > 0) ? bytes_done / seconds : 0;
+}
+
+double LoadProgress::PointsPerSecond() const {
+    const double seconds = Seconds();
+    return (seconds > 0) ? points_done / seconds : 0;
+}
+
+bool RenderTaskQueue::Push(std::function<void()> task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() { return closed_ || tasks_.size() < capacity_; });
+    if (closed_)
+        return false;
+    tasks_.push_back(std::move(task));
+    return true;
+}
+
+size_t RenderTaskQueue::Run(std::chrono::milliseconds budget) {
+    const auto deadline = std::chrono::steady_clock::now() + budget;
+    size_t done = 0;
+    while (std::chrono::steady_clock::now() < deadline) {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (tasks_.empty())
+                break;
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        not_full_.notify_one();
+        const auto start = std::chrono::steady_clock::now();
+        task();
+        busy_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        done++;
+    }
+    return done;
+}
+
+void RenderTaskQueue::Close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        tasks_.clear();
+    }
+    not_full_.notify_all();
+}
+
+void RenderTaskQueue::Open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = false;
+    busy_seconds_ = 0.0;
+}
+
+UploadStream::UploadStream(Shader& shader, RenderTaskQueue& queue, C3DV_cache::SceneCacheWriter* cache):
+    shader_(shader), queue_(queue), cache_(cache) {
+}
+
+bool UploadStream::Allocate(const std::string& buffer, size_t size) {
+    if (cache_)
+        cache_->AddBuffer(buffer, nullptr, size);
+    Shader* shader = &shader_;
+    return queue_.Push([shader, buffer, size]() {
+        shader->shader_.bind();
+        shader->UploadBuffer(buffer, nullptr, size);
+    });
+}
+
+bool UploadStream::Write(const std::string& buffer, size_t offset, const void* data, size_t size, std::shared_ptr<const void> owner) {
+    if (cache_)
+        cache_->WriteBuffer(buffer, offset, data, size);
+    Shader* shader = &shader_;
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t done = 0; done < size; done += kUploadChunk) {
+        const size_t chunk = std::min(kUploadChunk, size - done);
+        const uint8_t* source = bytes + done;
+        // Fault mapped pages in here instead of stalling the render thread.
+        volatile uint8_t touch = 0;
+        for (size_t page = 0; page < chunk; page += 4096)
+            touch ^= source[page];
+        if (!queue_.Push([shader, buffer, offset, done, source, chunk, owner]() {
+            shader->UpdateBuffer(buffer, offset + done, source, chunk);
+        }))
+            return false;
+    }
+    return true;
+}
+
+bool UploadStream::BindAttrib(const std::string& attrib, const std::string& buffer, int dim, GLenum type, bool normalized, size_t stride, size_t offset) {
+    if (cache_)
+        cache_->AddAttrib(attrib, buffer, dim, type, normalized, stride, offset);
+    Shader* shader = &shader_;
+    return queue_.Push([=]() {
+        shader->shader_.bind();
+        shader->BindAttrib(attrib, shader->UploadedBuffer(buffer), dim, type, normalized, stride, offset);
+    });
+}
+
+bool UploadStream::BindLayout(const std::string& buffer, const VertexLayout& layout) {
+    for (const auto& attrib : layout.attribs()) {
+        if (!BindAttrib(attrib.name, buffer, attrib.dim, attrib.type, attrib.normalized, layout.stride(), attrib.offset))
+            return false;
+    }
+    return true;
+}
+
+bool UploadStream::UploadIndices(std::shared_ptr<const std::vector<uint32_t>> indices) {
+    if (cache_)
+        cache_->AddBuffer("indices", indices->data(), indices->size() * sizeof(uint32_t));
+    Shader* shader = &shader_;
+    return queue_.Push([shader, indices]() {
+        shader->shader_.bind();
+        shader->UploadIndices(indices->data(), indices->size());
+    });
+}
+
+bool UploadStream::WritePixels(const std::string& buffer, size_t size, const std::function<void(uint8_t*)>& fill, std::function<void()> upload) {
+    // Only the task holds the promise: if Close() drops it, waiting on the future fails instead of blocking.
+    std::promise<void*> promise;
+    std::future<void*> mapped = promise.get_future();
+    auto map = std::make_shared<std::promise<void*>>(std::move(promise));
+    Shader* shader = &shader_;
+    if (!queue_.Push([shader, buffer, size, map]() { map->set_value(shader->MapPixelBuffer(buffer, size)); }))
+        return false;
+    uint8_t* pixels = nullptr;
+    try {
+        pixels = static_cast<uint8_t*>(mapped.get());
+    } catch (const std::future_error&) {
+        return false;
+    }
+    // A failed map or a buffer corrupted while mapped (e.g. by a mode switch) skips the upload.
+    if (!pixels)
+        return true;
+    fill(pixels);
+    return queue_.Push([shader, buffer, upload]() {
+        if (shader->UnmapPixelBuffer(buffer))
+            upload();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    });
+}
+
+bool UploadStream::Run(std::function<void()> task) {
+    return queue_.Push(std::move(task));
+}
+
+bool UploadStream::UploadCache(std::shared_ptr<const C3DV_cache::SceneCache> cache, LoadProgress& progress) {
+    const auto& buffers = cache->buffers();
+    // Buffers without an attribute (like mesh batches) are read by the caller, not uploaded.
+    std::vector<bool> uploaded(buffers.size(), false);
+    for (const auto& attrib : cache->attribs())
+        uploaded[attrib.buffer] = true;
+    uint64_t total = 0;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        uploaded[i] = uploaded[i] || std::string(buffers[i].name) == "indices";
+        if (uploaded[i])
+            total += buffers[i].size;
+    }
+    progress.bytes_total = total;
+    const uint64_t points = cache->header().vertex_count;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (!uploaded[i])
+            continue;
+        const std::string name = buffers[i].name;
+        const uint8_t* data = cache->BufferData(i);
+        if (name == "indices") {
+            auto indices = std::make_shared<std::vector<uint32_t>>(buffers[i].size / sizeof(uint32_t));
+            std::copy(data, data + indices->size() * sizeof(uint32_t), reinterpret_cast<uint8_t*>(indices->data()));
+            if (!UploadIndices(indices))
+                return false;
+            progress.Advance(buffers[i].size, 0);
+            continue;
+        }
+        if (!Allocate(name, buffers[i].size))
+            return false;
+        for (size_t done = 0; done < buffers[i].size; done += kUploadChunk) {
+            if (progress.cancelled)
+                return false;
+            const size_t chunk = std::min<size_t>(kUploadChunk, buffers[i].size - done);
+            if (!Write(name, done, data + done, chunk, cache))
+                return false;
+            progress.Advance(chunk, points * chunk / total);
+        }
+    }
+    for (const auto& attrib : cache->attribs()) {
+        if (!BindAttrib(attrib.name, buffers[attrib.buffer].name, attrib.dim, attrib.type, attrib.normalized != 0, attrib.stride, attrib.offset))
+            return false;
+    }
+    return true;
+}
+
+};
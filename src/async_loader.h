@@ -0,0 +1,111 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_ASYNC_LOADER_
+#define _H_ASYNC_LOADER_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "scene_cache.h"
+#include "shader.h"
+
+namespace C3DV_graphics {
+
+// Tasks waiting for the render thread, the loader blocks when the queue is full.
+constexpr size_t kRenderQueueCapacity = 8;
+// Time per frame spent on uploads while loading.
+constexpr std::chrono::milliseconds kUploadBudget{20};
+// Large buffers from a mapping are uploaded in pieces of this size.
+constexpr size_t kUploadChunk = 4 << 20;
+
+// Progress of a background load, written by the loader thread and read by the UI.
+struct LoadProgress {
+    std::atomic<uint64_t> bytes_total{0};
+    std::atomic<uint64_t> bytes_done{0};
+    std::atomic<uint64_t> points_done{0};
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> running{false};
+    std::atomic<double> elapsed{0};
+    std::chrono::steady_clock::time_point start;
+
+    void Reset(uint64_t bytes);
+    // Called by the loader after each batch, `bytes` of the input now hold `points` more points.
+    void Advance(uint64_t bytes, uint64_t points);
+    // Stops the clock, the rates stay at their final values.
+    void Finish();
+    float Fraction() const;
+    double Seconds() const;
+    double BytesPerSecond() const;
+    double PointsPerSecond() const;
+};
+
+// Bounded queue of tasks that have to run on the render thread (everything touching GL).
+class RenderTaskQueue {
+public:
+    explicit RenderTaskQueue(size_t capacity): capacity_(capacity) {}
+    // Blocks while the queue is full, false once it is closed.
+    bool Push(std::function<void()> task);
+    // Runs queued tasks on the calling thread until the queue is empty or the budget is used up.
+    size_t Run(std::chrono::milliseconds budget);
+    // Drops all queued tasks and rejects new ones until Open().
+    void Close();
+    void Open();
+    // Time spent running tasks since the last Open(), only valid on the render thread.
+    double BusySeconds() const { return busy_seconds_; }
+private:
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::deque<std::function<void()>> tasks_;
+    size_t capacity_;
+    bool closed_{false};
+    double busy_seconds_{0.0};
+};
+
+// Loader thread side of the GL uploads of one shader: every call becomes a render thread task
+// and is mirrored into the scene cache, if one is written.
+// The tasks only keep the shader, the stream itself may be gone before they run.
+// Without a cache writer a stream can be used by several loader threads at once.
+class UploadStream {
+public:
+    UploadStream(Shader& shader, RenderTaskQueue& queue, C3DV_cache::SceneCacheWriter* cache);
+    // Creates an uninitialized buffer that is filled with Write.
+    bool Allocate(const std::string& buffer, size_t size);
+    // `owner` keeps `data` alive until it has been uploaded, e.g. the mapping it points into.
+    bool Write(const std::string& buffer, size_t offset, const void* data, size_t size, std::shared_ptr<const void> owner);
+    bool BindAttrib(const std::string& attrib, const std::string& buffer, int dim, GLenum type, bool normalized, size_t stride, size_t offset);
+    // Binds every attribute of a layout to the buffer.
+    bool BindLayout(const std::string& buffer, const VertexLayout& layout);
+    bool UploadIndices(std::shared_ptr<const std::vector<uint32_t>> indices);
+    // Asynchronous texture upload through a pixel buffer object: the render thread maps `size`
+    // bytes of the named pixel buffer, `fill` writes the pixels into it on the calling thread and
+    // `upload` then runs on the render thread with the buffer bound to GL_PIXEL_UNPACK_BUFFER, so
+    // that glTex(Sub)Image reads from offset 0 and the transfer does not stall the frame. Blocks
+    // until the buffer is mapped, false if cancelled. Concurrent transfers need their own buffers.
+    bool WritePixels(const std::string& buffer, size_t size, const std::function<void(uint8_t*)>& fill, std::function<void()> upload);
+    // Any other render thread work, e.g. publishing the number of uploaded vertices.
+    bool Run(std::function<void()> task);
+    // Streams all buffers and attributes of a cache, false if cancelled.
+    bool UploadCache(std::shared_ptr<const C3DV_cache::SceneCache> cache, LoadProgress& progress);
+private:
+    Shader& shader_;
+    RenderTaskQueue& queue_;
+    C3DV_cache::SceneCacheWriter* cache_;
+};
+
+};
+
+#endif  // _H_ASYNC_LOADER_
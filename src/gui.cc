@@ -7,6 +7,13 @@
  * http://www.gnu.org/licenses/lgpl-3.0.html
  ********************************************************/
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cfloat>
+#include <cstddef>
+#include <cstring>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
@@ -14,27 +21,35 @@
 #include <fstream>
 
 #include <dirent.h>
+#include <sys/stat.h>
 #include <nanogui/combobox.h>
 #include <nanogui/entypo.h>
 #include <nanogui/glutil.h>
 #include <nanogui/label.h>
 #include <nanogui/layout.h>
 #include <nanogui/messagedialog.h>
+#include <nanogui/progressbar.h>
 #include <nanogui/screen.h>
+#include <nanogui/slider.h>
 #include <nanogui/toolbutton.h>
 #include <nanogui/window.h>
 
 #include "gui.h"
+#include "mesh_processing.h"
+#include "obj_loader.h"
+#include "parallel.h"
+#include "scene_cache.h"
+#include "texture_compression.h"
 #include "tinyply.h"
 #include "util.h"
 
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
 namespace C3DV_graphics {
 
-bool loadAssImp(const char* path,
-                std::vector<unsigned int>& indices,
-                std::vector<float>& vertices,
-                std::vector<float>& uvs,
-                std::vector<float>& normals) {
+bool loadAssImp(const char* path, Mesh& mesh) {
     Assimp::Importer importer;
     
     std::ifstream f(path);
@@ -47,71 +62,288 @@ bool loadAssImp(const char* path,
         getchar();
         return false;
     }
-    const aiMesh* mesh = scene->mMeshes[0];
+    mesh = Mesh();
     
-    // Fill vertices positions
-    vertices.reserve(mesh->mNumVertices*3);
-    for (unsigned int i = 0; i < mesh->mNumVertices; i++){
-        aiVector3D pos = mesh->mVertices[i];
-        vertices.push_back(pos.x);
-        vertices.push_back(pos.y);
-        vertices.push_back(pos.z);
+    // Materials, texture paths are relative to the model (embedded textures are not supported).
+    const std::string file(path);
+    const size_t slash = file.find_last_of('/');
+    const std::string directory = (slash == std::string::npos) ? "" : file.substr(0, slash + 1);
+    for (unsigned int m = 0; m < scene->mNumMaterials; m++) {
+        Material material;
+        aiString texture;
+        if (scene->mMaterials[m]->GetTexture(aiTextureType_DIFFUSE, 0, &texture) == AI_SUCCESS &&
+            texture.length > 0 && texture.C_Str()[0] != '*')
+            material.texture = (texture.C_Str()[0] == '/') ? texture.C_Str() : directory + texture.C_Str();
+        aiColor3D diffuse(1.0f, 1.0f, 1.0f);
+        scene->mMaterials[m]->Get(AI_MATKEY_COLOR_DIFFUSE, diffuse);
+        material.diffuse[0] = diffuse.r;
+        material.diffuse[1] = diffuse.g;
+        material.diffuse[2] = diffuse.b;
+        mesh.materials.push_back(material);
     }
     
-    // Fill vertices texture coordinates
-    uvs.reserve(mesh->mNumVertices);
-    if (mesh->mTextureCoords[0] != nullptr) {
-        for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
-            aiVector3D UVW = mesh->mTextureCoords[0][i]; // Assume only 1 set of UV coords; AssImp supports 8 UV sets.
-            uvs.push_back(UVW.x);
-            uvs.push_back(UVW.y);
+    // All meshes go into the same buffers, parts without uvs or normals get zeros.
+    bool has_uvs = false;
+    bool has_normals = false;
+    for (unsigned int m = 0; m < scene->mNumMeshes; m++) {
+        has_uvs |= (scene->mMeshes[m]->mTextureCoords[0] != nullptr);
+        has_normals |= (scene->mMeshes[m]->mNormals != nullptr);
+    }
+    for (unsigned int m = 0; m < scene->mNumMeshes; m++) {
+        const aiMesh* part = scene->mMeshes[m];
+        const unsigned int base = static_cast<unsigned int>(mesh.vertices.size() / 3);
+        
+        // Fill vertices positions
+        for (unsigned int i = 0; i < part->mNumVertices; i++) {
+            aiVector3D pos = part->mVertices[i];
+            mesh.vertices.insert(mesh.vertices.end(), { pos.x, pos.y, pos.z });
+        }
+        
+        // Fill vertices texture coordinates
+        if (has_uvs) {
+            for (unsigned int i = 0; i < part->mNumVertices; i++) {
+                // Assume only 1 set of UV coords; AssImp supports 8 UV sets.
+                const aiVector3D UVW = part->mTextureCoords[0] ? part->mTextureCoords[0][i] : aiVector3D(0, 0, 0);
+                mesh.uvs.insert(mesh.uvs.end(), { UVW.x, UVW.y });
+            }
+        }
+        
+        // Fill vertices normals
+        if (has_normals) {
+            for (unsigned int i = 0; i < part->mNumVertices; i++) {
+                const aiVector3D n = part->mNormals ? part->mNormals[i] : aiVector3D(0, 0, 0);
+                mesh.normals.insert(mesh.normals.end(), { n.x, n.y, n.z });
+            }
         }
+        
+        // Fill face indices, points and lines are skipped.
+        SubMesh submesh{mesh.indices.size(), 0, part->mMaterialIndex};
+        for (unsigned int i = 0; i < part->mNumFaces; i++) {
+            if (part->mFaces[i].mNumIndices != 3)
+                continue;
+            mesh.indices.push_back(base + part->mFaces[i].mIndices[0]);
+            mesh.indices.push_back(base + part->mFaces[i].mIndices[1]);
+            mesh.indices.push_back(base + part->mFaces[i].mIndices[2]);
+        }
+        submesh.count = mesh.indices.size() - submesh.first;
+        if (submesh.count > 0)
+            mesh.submeshes.push_back(submesh);
     }
-    
-    // Fill vertices normals
-    normals.reserve(mesh->mNumVertices);
-    for (unsigned int i=0; i < mesh->mNumVertices; i++){
-        aiVector3D n = mesh->mNormals[i];
-        normals.push_back(n.x);
-        normals.push_back(n.y);
-        normals.push_back(n.z);
+    return !mesh.indices.empty();
+}
+
+// Whether the element has every one of the properties. request_properties_from_element skips
+// missing keys and still returns the element size, e.g. 2 bytes per vertex for red and green.
+bool HasProperties(tinyply::PlyFile& file, const std::string& element, const std::vector<std::string>& keys) {
+    for (const auto& candidate : file.get_elements()) {
+        if (candidate.name != element)
+            continue;
+        for (const std::string& key : keys) {
+            const auto has_key = [&key](const tinyply::PlyProperty& property) { return property.name == key; };
+            if (std::none_of(candidate.properties.begin(), candidate.properties.end(), has_key))
+                return false;
+        }
+        return true;
     }
-    
-    // Fill face indices
-    indices.reserve(3*mesh->mNumFaces);
-    for (unsigned int i = 0; i < mesh->mNumFaces; i++){
-        // Assume the model has only triangles.
-        indices.push_back(mesh->mFaces[i].mIndices[0]);
-        indices.push_back(mesh->mFaces[i].mIndices[1]);
-        indices.push_back(mesh->mFaces[i].mIndices[2]);
+    return false;
+}
+
+template<typename T>
+bool FindAdjacentProperties(tinyply::PlyFile& file, const std::string& element, const std::vector<std::string>& keys, size_t& offset) {
+    const tinyply::ElementView view = file.get_element_view(element);
+    if (view.empty())
+        return false;
+    try {
+        for (size_t i = 0; i < keys.size(); i++) {
+            const tinyply::StridedView<T> property = file.request_view_from_element<T>(element, keys[i]);
+            if (property.empty())
+                return false;
+            const size_t property_offset = property.data - view.data;
+            if (i == 0)
+                offset = property_offset;
+            else if (property_offset != offset + i * sizeof(T))
+                return false;
+        }
+    } catch (const std::exception& e) {
+        // Stored with a different type, can't be used in place.
+        return false;
     }
     return true;
 }
 
-bool BindCVMat2GLTexture(const cv::Mat& image, GLuint& imageTexture, bool conv) {
-    if (!image.empty()) {
-        glDeleteTextures(1, &imageTexture);
-        glGenTextures(1, &imageTexture);
-        glBindTexture(GL_TEXTURE_2D, imageTexture);
-        
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        // glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        
-        glTexImage2D(GL_TEXTURE_2D,
-                     0,                   // Pyramid level (for mip-mapping) - 0 is the top level
-                     GL_RGB,              // Internal colour format to convert to
-                     image.cols,
-                     image.rows,
-                     0,                   // Border width in pixels (can either be 1 or 0)
-                     GL_BGR,              // Input image format (i.e. GL_RGB, GL_RGBA, GL_BGR etc.)
-                     GL_UNSIGNED_BYTE,    // Image data type
-                     image.ptr());        // The actual image data itself
-        return true;
-    } else return false;
+uint64_t FileSize(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+    return static_cast<uint64_t>(st.st_size);
+}
+
+bool IsDirectory(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+std::vector<std::string> ListPlyFiles(const std::string& directory) {
+    std::vector<std::string> files;
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return files;
+    while (dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".ply") == 0)
+            files.push_back(directory + "/" + name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+std::map<std::string, TexturePage> ReadTexturePages(const std::vector<std::string>& files, MeshTextures textures) {
+    std::vector<TexturePage> pages(files.size());
+    ParallelFor(files.size(), [&](size_t i) {
+        if (textures == MeshTextures::Virtual) {
+            auto pyramid = std::make_shared<TilePyramid>();
+            if (pyramid->Open(files[i]))
+                pages[i].pyramid = pyramid;
+            return;
+        }
+        if (textures == MeshTextures::BC1 && LoadCompressedTexture(files[i], pages[i].blocks))
+            return;
+        pages[i].image = cv::imread(files[i], cv::IMREAD_COLOR);
+        if (pages[i].image.empty())
+            std::cout << "could not read texture " << files[i] << std::endl;
+    });
+    std::map<std::string, TexturePage> result;
+    for (size_t i = 0; i < files.size(); i++)
+        result[files[i]] = std::move(pages[i]);
+    return result;
 }
 
 };
 
+namespace {
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Draw batches of a mesh and their materials, kept in the cache as a buffer that is not uploaded.
+const char* const kMeshBatchesBuffer = "batches";
+
+struct CachedBatch {
+    uint64_t first;
+    uint64_t count;
+    float diffuse[3];
+    uint32_t texture_length;    // the texture path follows
+};
+
+void WriteMeshBatches(C3DV_cache::SceneCacheWriter& cache,
+                      const std::vector<C3DV_graphics::SubMesh>& batches,
+                      const std::vector<C3DV_graphics::Material>& materials) {
+    std::vector<uint8_t> data;
+    for (const auto& batch : batches) {
+        const C3DV_graphics::Material& material = materials[batch.material];
+        const CachedBatch cached{batch.first, batch.count, {material.diffuse[0], material.diffuse[1], material.diffuse[2]},
+                                 static_cast<uint32_t>(material.texture.size())};
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&cached);
+        data.insert(data.end(), bytes, bytes + sizeof(cached));
+        data.insert(data.end(), material.texture.begin(), material.texture.end());
+    }
+    cache.AddBuffer(kMeshBatchesBuffer, data.data(), data.size());
+}
+
+// Every batch gets its own material, false if the cache has no batches.
+bool ReadMeshBatches(const C3DV_cache::SceneCache& cache,
+                     std::vector<C3DV_graphics::SubMesh>& batches,
+                     std::vector<C3DV_graphics::Material>& materials) {
+    const int index = cache.FindBuffer(kMeshBatchesBuffer);
+    if (index < 0)
+        return false;
+    const uint8_t* data = cache.BufferData(index);
+    const uint8_t* end = data + cache.buffers()[index].size;
+    while (data < end) {
+        CachedBatch cached;
+        if (static_cast<size_t>(end - data) < sizeof(cached))
+            return false;
+        std::memcpy(&cached, data, sizeof(cached));
+        data += sizeof(cached);
+        if (static_cast<size_t>(end - data) < cached.texture_length)
+            return false;
+        C3DV_graphics::Material material;
+        material.texture.assign(reinterpret_cast<const char*>(data), cached.texture_length);
+        data += cached.texture_length;
+        std::copy_n(cached.diffuse, 3, material.diffuse);
+        batches.push_back(C3DV_graphics::SubMesh{cached.first, cached.count, materials.size()});
+        materials.push_back(material);
+    }
+    return true;
+}
+
+// Whether the GL context has an extension, e.g. GL_EXT_texture_compression_s3tc for BC1 textures.
+bool HasExtension(const char* name) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++) {
+        const char* extension = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+        if (extension != nullptr && std::strcmp(extension, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// The material table of a mesh, columns x rows RGBA32F texels.
+void UploadMaterialTexels(GLuint& texture, const std::vector<float>& texels, int columns, int rows) {
+    if (texture == 0)
+        glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, columns, rows, 0,
+                 GL_RGBA, GL_FLOAT, texels.data());
+}
+
+// Bounds of the surfel attributes, kept in the cache as a buffer that is not uploaded.
+const char* const kSurfelRangeBuffer = "range";
+
+// The surfel buffer of the records (GPU discs and splats) or of the expanded discs.
+const char* SurfelBuffer(bool records) {
+    return records ? "surfels" : "discs";
+}
+
+VertexLayout SurfelLayout(bool records) {
+    VertexLayout layout;
+    if (records) {
+        layout.AddAt("position", 3, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelRecord, position))
+              .AddAt("normal", 3, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelRecord, normal))
+              .AddAt("radius", 1, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelRecord, radius))
+              .AddAt("quality", 1, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelRecord, quality))
+              .AddAt("curvature", 1, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelRecord, curvature))
+              .AddAt("color", 4, GL_UNSIGNED_BYTE, true, offsetof(C3DV_graphics::SurfelRecord, color))
+              .SetStride(sizeof(C3DV_graphics::SurfelRecord));
+        return layout;
+    }
+    layout.AddAt("position", 3, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelVertex, position))
+          .AddAt("normal", 3, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelVertex, normal))
+          .AddAt("color", 3, GL_UNSIGNED_BYTE, true, offsetof(C3DV_graphics::SurfelVertex, color))
+          .AddAt("radius", 1, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelVertex, radius))
+          .AddAt("quality", 1, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelVertex, quality))
+          .AddAt("curvature", 1, GL_FLOAT, false, offsetof(C3DV_graphics::SurfelVertex, curvature))
+          .SetStride(sizeof(C3DV_graphics::SurfelVertex));
+    return layout;
+}
+
+// Thresholds at a slider position within [range[0], range[1]]. The open end of the slider lets
+// everything through, also values the rounding of the interpolation would cut off.
+float LowerThreshold(const float range[2], float position) {
+    return (position <= 0.0f) ? -FLT_MAX : range[0] + position * (range[1] - range[0]);
+}
+
+float UpperThreshold(const float range[2], float position) {
+    return (position >= 1.0f) ? FLT_MAX : range[0] + position * (range[1] - range[0]);
+}
+
+}  // namespace
+
 void GUIApplication::InitMainGUI(nanogui::Window* window) {
     window->setPosition(nanogui::Vector2i(15, 15));
     window->setLayout(new nanogui::GroupLayout());
@@ -123,6 +355,18 @@ void GUIApplication::InitMainGUI(nanogui::Window* window) {
         Init3DCloud();
     });
 
+    // Loads every .ply next to the selected one, like dropping the directory on the window.
+    b = new nanogui::Button(window, "Point Cloud Tiles");
+    b->setCallback([this](void) {
+        const std::string tile = nanogui::file_dialog({ {"ply", "PLY File"} }, false);
+        const size_t slash = tile.find_last_of('/');
+        if (slash == std::string::npos)
+            return;
+        file_point_cloud_ = tile.substr(0, slash);
+        render_type_ = RenderType::PointCloud;
+        Init3DCloud();
+    });
+
     b = new nanogui::Button(window, "Surfel Map");
     b->setCallback([this](void) {
         render_type_ = RenderType::SurfelMap;
@@ -130,15 +374,128 @@ void GUIApplication::InitMainGUI(nanogui::Window* window) {
         Init3DSurfels();
     });
 
+    nanogui::ComboBox* surfel_mode = new nanogui::ComboBox(window, { "CPU Surfel Discs", "GPU Surfel Discs", "Surfel Point Splats" });
+    surfel_mode->setSelectedIndex(static_cast<int>(surfel_mode_));
+    surfel_mode->setCallback([this](int index) {
+        surfel_mode_ = static_cast<SurfelMode>(index);
+        if (render_type_ == RenderType::SurfelMap)
+            Init3DSurfels();
+    });
+
+    // The filter is applied by the shaders, moving a slider neither reloads nor uploads anything.
+    const auto add_filter_slider = [this, window](const std::string& caption, float& position) {
+        new nanogui::Label(window, caption);
+        nanogui::Slider* slider = new nanogui::Slider(window);
+        slider->setValue(position);
+        slider->setCallback([this, &position](float value) {
+            position = value;
+            surfels_counted_ = -1;
+        });
+    };
+    add_filter_slider("Min Surfel Radius", surfel_filter_.min_radius);
+    add_filter_slider("Max Surfel Radius", surfel_filter_.max_radius);
+    add_filter_slider("Min Surfel Quality", surfel_filter_.min_quality);
+    add_filter_slider("Max Surfel Curvature", surfel_filter_.max_curvature);
+
     b = new nanogui::Button(window, "3D Mesh");
     b->setCallback([this](void) {
         render_type_ = RenderType::Mesh3D;
         file_3D_mesh_ = nanogui::file_dialog({ {"obj", "OBJ File"} }, false);
-        std::string texture_file = nanogui::file_dialog({ {"png", "PNG File"}, {"jpg", "JPG File"} }, false);
-        cv::Mat texture_mat = cv::imread(texture_file);
-        C3DV_graphics::BindCVMat2GLTexture(texture_mat, texture3D_mesh_, true);
+        file_3D_texture_ = nanogui::file_dialog({ {"png", "PNG File"}, {"jpg", "JPG File"} }, false);
         Init3DMesh();
     });
+
+    nanogui::CheckBox* optimize = new nanogui::CheckBox(window, "Optimize Mesh");
+    optimize->setChecked(optimize_mesh_);
+    optimize->setCallback([this](bool checked) {
+        optimize_mesh_ = checked;
+        if (render_type_ == RenderType::Mesh3D)
+            Init3DMesh();
+    });
+
+    nanogui::CheckBox* compress = new nanogui::CheckBox(window, "Compress Textures");
+    compress->setChecked(compress_textures_);
+    compress->setCallback([this](bool checked) {
+        compress_textures_ = checked;
+        if (render_type_ == RenderType::Mesh3D)
+            Init3DMesh();
+    });
+
+    nanogui::CheckBox* virtual_textures = new nanogui::CheckBox(window, "Virtual Textures");
+    virtual_textures->setChecked(virtual_textures_);
+    virtual_textures->setCallback([this](bool checked) {
+        virtual_textures_ = checked;
+        if (render_type_ == RenderType::Mesh3D)
+            Init3DMesh();
+    });
+
+    // Loads run in the background, progress is updated in draw().
+    load_label_ = new nanogui::Label(window, "");
+    load_bar_ = new nanogui::ProgressBar(window);
+    cancel_button_ = new nanogui::Button(window, "Cancel");
+    cancel_button_->setCallback([this](void) {
+        CancelLoad();
+    });
+    cancel_button_->setEnabled(false);
+    render_label_ = new nanogui::Label(window, "");
+}
+
+void GUIApplication::StartLoad(const std::string& file, const std::function<void(C3DV_graphics::LoadProgress&)>& load) {
+    StopLoad();
+    load_progress_.Reset(C3DV_graphics::FileSize(file));
+    first_frame_pending_ = false;
+    first_frame_seconds_ = 0.0;
+    render_tasks_.Open();
+    load_thread_ = std::thread([this, load]() {
+        try {
+            load(load_progress_);
+        } catch (const std::exception& e) {
+            std::cout << e.what() << std::endl;
+        }
+        load_progress_.Finish();
+    });
+}
+
+void GUIApplication::CancelLoad() {
+    if (load_progress_.running)
+        load_progress_.cancelled = true;
+    render_tasks_.Close();
+}
+
+void GUIApplication::StopLoad() {
+    CancelLoad();
+    if (load_thread_.joinable())
+        load_thread_.join();
+}
+
+void GUIApplication::UpdateLoadStatus() {
+    const bool running = load_progress_.running;
+    std::ostringstream status;
+    status << std::fixed << std::setprecision(1);
+    if (load_progress_.cancelled)
+        status << "Cancelled";
+    else if (running || load_progress_.points_done > 0)
+        status << (running ? "Loading " : "Loaded in ") << load_progress_.Seconds() << " s, "
+               << load_progress_.BytesPerSecond() / (1 << 20) << " MB/s, "
+               << load_progress_.PointsPerSecond() / 1e6 << " M points/s";
+    if (first_frame_seconds_ > 0.0)
+        status << ", first frame after " << first_frame_seconds_ << " s";
+    load_label_->setCaption(status.str());
+    load_bar_->setValue(load_progress_.Fraction());
+    cancel_button_->setEnabled(running);
+
+    std::ostringstream render_status;
+    render_status << std::fixed << std::setprecision(1) << draw_calls_ << " draw calls, GPU upload "
+                  << render_tasks_.BusySeconds() * 1e3 << " ms";
+    if (render_type_ == RenderType::SurfelMap) {
+        const int surfels = indices_3D_surfels_ / ((surfel_mode_ == SurfelMode::CPUDiscs) ? 6 : 1);
+        render_status << ", surfels " << std::setprecision(2) << surfel_timer_.Milliseconds() << " ms GPU, "
+                      << surfel_survivors_.Result() << " of " << surfels << " kept by the filter";
+    }
+    if (virtual_texture_3D_mesh_.Active())
+        render_status << ", " << virtual_texture_3D_mesh_.ResidentTiles() << " tiles resident, "
+                      << virtual_texture_3D_mesh_.Uploads() << " uploaded";
+    render_label_->setCaption(render_status.str());
 }
 
 void GUIApplication::InitShaders() {
@@ -200,118 +557,230 @@ void GUIApplication::InitCoordinateSystem() {
         indices_grid.col(indices_coordinate_system_++) << index_positions-2, index_positions-1;
     }
 
+    VertexLayout layout;
+    layout.Add("position", 3, GL_FLOAT).Add("color", 3, GL_FLOAT);
+    std::vector<uint8_t> vertices(line_size * layout.stride());
+    layout.Interleave("position", positions_grid.data(), line_size, vertices.data());
+    layout.Interleave("color", color_grid.data(), line_size, vertices.data());
+
     shader_coordinate_system_.Init("shader_coordinate_system");
     shader_coordinate_system_.shader_.bind();
     shader_coordinate_system_.shader_.uploadIndices(indices_grid);
-    shader_coordinate_system_.shader_.uploadAttrib("position", positions_grid);
-    shader_coordinate_system_.shader_.uploadAttrib("color", color_grid);
+    shader_coordinate_system_.UploadVertices("grid", layout, vertices.data(), line_size);
 }
 
 void GUIApplication::Init3DCloud() {
-    Eigen::Vector3f color;
-    std::vector<Eigen::Vector3f> reference_points_color_;
-    std::ifstream ss(file_point_cloud_, std::ios::binary);
-    tinyply::PlyFile input_file(ss);
-    std::vector<float> vertices;
-    std::vector<float> raw_normals;
-    std::vector<uint8_t> raw_colors;
-    uint32_t vertex_count = input_file.request_properties_from_element("vertex", { "x", "y", "z" }, vertices);
-    input_file.request_properties_from_element("vertex", { "nx", "ny", "nz" }, raw_normals);
-    input_file.request_properties_from_element("vertex", { "red", "green", "blue", "alpha" }, raw_colors);
-    input_file.read(ss);
-    for (int i = 0; i < vertex_count; i++) {
-        color[0] = raw_colors[4*i] / 255.0f;
-        color[1] = raw_colors[4*i+1] / 255.0f;
-        color[2] = raw_colors[4*i+2] / 255.0f;
-        // Instead of pushing it to a vector we should use the vector directly (different data formats).
-        reference_points_color_.push_back(color);
-    }
-    indices_3D_cloud_ = vertex_count;
-    Eigen::Map<nanogui::MatrixXf> positions_cs(&vertices[0], 3, indices_3D_cloud_);
-    Eigen::Map<nanogui::MatrixXf> color_surfel(&reference_points_color_[0][0], 3, indices_3D_cloud_);
+    StopLoad();
     shader_3D_cloud_.Init("shader_cloud3D");
     shader_3D_cloud_.shader_.bind();
-    shader_3D_cloud_.shader_.uploadAttrib("position", positions_cs);
-    shader_3D_cloud_.shader_.uploadAttrib("color", color_surfel);
+    indices_3D_cloud_ = 0;
+    tiles_3D_cloud_.clear();
+    if (file_point_cloud_.empty())
+        return;
+    const std::string file = file_point_cloud_;
+    if (C3DV_graphics::IsDirectory(file)) {
+        StartLoad(file, [this, file](C3DV_graphics::LoadProgress& progress) {
+            Load3DCloudTiles(file, progress);
+        });
+        return;
+    }
+    StartLoad(file, [this, file](C3DV_graphics::LoadProgress& progress) {
+        Load3DCloud(file, progress);
+    });
 }
 
-void GUIApplication::Init3DSurfels() {
-    Eigen::Vector3f color;
-    std::ifstream ss(file_surfel_map_, std::ios::binary);
-    tinyply::PlyFile input_file(ss);
-    std::vector<float> vertices;
-    std::vector<float> normals;
-    std::vector<float> radius;
-    std::vector<float> curvatures;
-    std::vector<float> qualities;
-    std::vector<uint8_t> colors;
-    uint32_t vertex_count = input_file.request_properties_from_element("vertex", { "x", "y", "z" }, vertices);
-    input_file.request_properties_from_element("vertex", { "nx", "ny", "nz" }, normals);
-    input_file.request_properties_from_element("vertex", { "curvature" }, curvatures);
-    input_file.request_properties_from_element("vertex", { "red", "green", "blue", "alpha" }, colors);
-    input_file.request_properties_from_element("vertex", { "quality" }, qualities);
-    input_file.request_properties_from_element("vertex", { "radius" }, radius);
-    input_file.read(ss);
-    
-    nanogui::MatrixXf positions_discs(3, vertex_count*6);
-    nanogui::MatrixXf normal_discs(3, vertex_count*6);
-    nanogui::MatrixXf color_surfel_discs(3, vertex_count*6);
-    nanogui::MatrixXf texture_discs(2, vertex_count*6);
+void GUIApplication::Load3DCloud(const std::string& file, C3DV_graphics::LoadProgress& progress) {
+    const std::string cache_path = C3DV_cache::CachePath(file, "cloud");
+    auto cache = std::make_shared<C3DV_cache::SceneCache>();
+    if (cache->Open(cache_path, file)) {
+        C3DV_graphics::UploadStream stream(shader_3D_cloud_, render_tasks_, nullptr);
+        const size_t vertex_count = cache->header().vertex_count;
+        if (stream.UploadCache(cache, progress))
+            stream.Run([this, vertex_count]() { indices_3D_cloud_ = vertex_count; });
+        return;
+    }
+
+    auto mapping = std::make_shared<tinyply::MappedFile>(file);
+    tinyply::PlyFile input_file(mapping);
+    // Everything uploaded below is also written to the cache for the next load.
+    C3DV_cache::SceneCacheWriter cache_writer(cache_path, file);
+    C3DV_graphics::UploadStream stream(shader_3D_cloud_, render_tasks_, &cache_writer);
+    // Points are drawn as soon as their batch has been uploaded.
+    const auto publish = [&](size_t uploaded) {
+        return stream.Run([this, uploaded]() { indices_3D_cloud_ = uploaded; });
+    };
     
-    for (int i = 0; i < vertex_count; i++) {
-        const Eigen::Vector3f point(vertices[3*i], vertices[3*i+1], vertices[3*i+2]);
-        const Eigen::Vector3f normal(normals[3*i], normals[3*i+1], normals[3*i+2]);
-        const Eigen::Vector3f color(colors[4*i] / 255.0f, colors[4*i+1] / 255.0f, colors[4*i+2] / 255.0f);
-
-        for (int s = 0; s <= 5; s++) {
-            color_surfel_discs.col(6*i+s) << color;
-            normal_discs.col(6*i+s) << normal;
+    // Binary little-endian files are uploaded straight from the mapping, the attributes point into the records.
+    const tinyply::ElementView element = input_file.get_element_view("vertex");
+    size_t position_offset = 0;
+    size_t color_offset = 0;
+    size_t vertex_count = 0;
+    if (C3DV_graphics::FindAdjacentProperties<float>(input_file, "vertex", { "x", "y", "z" }, position_offset) &&
+        C3DV_graphics::FindAdjacentProperties<uint8_t>(input_file, "vertex", { "red", "green", "blue" }, color_offset)) {
+        vertex_count = element.count;
+        VertexLayout layout;
+        layout.AddAt("position", 3, GL_FLOAT, false, position_offset)
+              .AddAt("color", 3, GL_UNSIGNED_BYTE, true, color_offset)
+              .SetStride(element.stride);
+        stream.Allocate("vertex", element.size_bytes());
+        stream.BindLayout("vertex", layout);
+        for (size_t first = 0; first < vertex_count; first += C3DV_graphics::kLoadBatchSize) {
+            const size_t count = std::min(C3DV_graphics::kLoadBatchSize, vertex_count - first);
+            const uint8_t* records = element.data + first * element.stride;
+            if (progress.cancelled || !stream.Write("vertex", first * element.stride, records, count * element.stride, mapping) ||
+                !publish(first + count))
+                return;
+            cache_writer.ExtendBounds(records + position_offset, element.stride, count);
+            progress.Advance(count * element.stride, count);
         }
-        const float surfel_radius = kSqrt2 * radius[i]/1000.0f;
-        
-        Eigen::Vector3f u;
-        if (std::abs(normal.dot(Eigen::Vector3f::UnitX())) >
-            std::abs(normal.dot(Eigen::Vector3f::UnitY()))) {
-            u = surfel_radius * normal.cross(Eigen::Vector3f::UnitX()).normalized();
-        } else {
-            u = surfel_radius * normal.cross(Eigen::Vector3f::UnitY()).normalized();
+    } else {
+        // Everything else is decoded in batches and uploaded as the batches arrive. tinyply converts
+        // to the GL types while decoding, e.g. double positions or float/ushort colors.
+        std::vector<float> positions;
+        std::vector<uint8_t> colors;
+        if (!C3DV_graphics::HasProperties(input_file, "vertex", { "x", "y", "z" }))
+            return;
+        vertex_count = input_file.request_properties_from_element("vertex", { "x", "y", "z" }, positions);
+        const size_t color_count = C3DV_graphics::HasProperties(input_file, "vertex", { "red", "green", "blue" }) ?
+                                   input_file.request_properties_from_element("vertex", { "red", "green", "blue" }, colors, 1, true) : 0;
+        if (vertex_count == 0)
+            return;
+        // Points without colors are white, as in Load3DCloudTiles.
+        VertexLayout layout;
+        layout.Add("position", 3, GL_FLOAT).Add("color", 3, GL_UNSIGNED_BYTE, true);
+        stream.Allocate("vertex", vertex_count * layout.stride());
+        stream.BindLayout("vertex", layout);
+        input_file.read_batches("vertex", C3DV_graphics::kLoadBatchSize, [&](size_t first, size_t count) {
+            // The decode vectors are reused for the next batch, the upload gets its own interleaved copy.
+            auto batch = std::make_shared<std::vector<uint8_t>>(count * layout.stride());
+            layout.Interleave("position", positions.data(), count, batch->data());
+            if (color_count > 0) {
+                layout.Interleave("color", colors.data(), count, batch->data());
+            } else {
+                const std::vector<uint8_t> white(3 * count, 255);
+                layout.Interleave("color", white.data(), count, batch->data());
+            }
+            if (progress.cancelled || !stream.Write("vertex", first * layout.stride(), batch->data(), batch->size(), batch))
+                return false;
+            cache_writer.ExtendBounds(batch->data(), layout.stride(), count);
+            progress.Advance(mapping->size() * count / vertex_count, count);
+            return publish(first + count);
+        });
+        if (progress.cancelled)
+            return;
+    }
+    cache_writer.SetCounts(vertex_count, 0);
+    cache_writer.Finish();
+}
+
+void GUIApplication::Load3DCloudTiles(const std::string& directory, C3DV_graphics::LoadProgress& progress) {
+    const std::vector<std::string> files = C3DV_graphics::ListPlyFiles(directory);
+    if (files.empty()) {
+        std::cout << "no .ply files in " << directory << std::endl;
+        return;
+    }
+
+    // The headers are read first to lay the tiles out one after another in the merged buffers.
+    std::vector<std::shared_ptr<tinyply::MappedFile>> mappings(files.size());
+    std::vector<C3DV_graphics::DrawRange> tiles(files.size(), C3DV_graphics::DrawRange{0, 0});
+    C3DV_graphics::ParallelFor(files.size(), [&](size_t i) {
+        try {
+            mappings[i] = std::make_shared<tinyply::MappedFile>(files[i]);
+            tinyply::PlyFile header(mappings[i]);
+            for (const auto& element : header.get_elements()) {
+                if (element.name == "vertex")
+                    tiles[i].count = element.size;
+            }
+        } catch (const std::exception& e) {
+            std::cout << files[i] << ": " << e.what() << std::endl;
         }
-        const Eigen::Vector3f v = normal.cross(u);
-        
-        const Eigen::Vector3f p0 = point - u;
-        const Eigen::Vector3f p1 = point - v;
-        const Eigen::Vector3f p2 = point + u;
-        const Eigen::Vector3f p3 = point + v;
-        
-        positions_discs.col(6*i)   << p0;
-        positions_discs.col(6*i+1) << p1;
-        positions_discs.col(6*i+2) << p2;
-        positions_discs.col(6*i+3) << p0;
-        positions_discs.col(6*i+4) << p2;
-        positions_discs.col(6*i+5) << p3;
-        
-        texture_discs.col(6*i) << 0, 0;
-        texture_discs.col(6*i+1) << 1, 0;
-        texture_discs.col(6*i+2) << 1, 1;
-        texture_discs.col(6*i+3) << 0, 0;
-        texture_discs.col(6*i+4) << 1, 1;
-        texture_discs.col(6*i+5) << 0, 1;
+    });
+    size_t vertex_count = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        tiles[i].first = vertex_count;
+        vertex_count += tiles[i].count;
+        bytes += mappings[i] ? mappings[i]->size() : 0;
     }
-    indices_3D_surfels_ = vertex_count*6;
+    progress.bytes_total = bytes;
+    if (vertex_count == 0)
+        return;
+
+    // Tiles are not cached, the stream has no cache writer and can be shared by the workers.
+    C3DV_graphics::UploadStream stream(shader_3D_cloud_, render_tasks_, nullptr);
+    VertexLayout layout;
+    layout.Add("position", 3, GL_FLOAT).Add("color", 3, GL_UNSIGNED_BYTE, true);
+    stream.Allocate("vertex", vertex_count * layout.stride());
+    stream.BindLayout("vertex", layout);
+    // Every tile is drawn up to its last uploaded batch.
+    std::vector<C3DV_graphics::DrawRange> empty_tiles = tiles;
+    for (auto& tile : empty_tiles)
+        tile.count = 0;
+    stream.Run([this, empty_tiles]() { tiles_3D_cloud_ = empty_tiles; });
+
+    // One tile per worker at a time, each decodes its tile in batches like a single file.
+    C3DV_graphics::ParallelFor(files.size(), [&](size_t i) {
+        const size_t tile_count = tiles[i].count;
+        if (tile_count == 0 || progress.cancelled)
+            return;
+        try {
+            tinyply::PlyFile input_file(mappings[i]);
+            std::vector<float> positions;
+            std::vector<uint8_t> colors;
+            if (!C3DV_graphics::HasProperties(input_file, "vertex", { "x", "y", "z" }) ||
+                input_file.request_properties_from_element("vertex", { "x", "y", "z" }, positions) != tile_count)
+                return;
+            const bool has_color = C3DV_graphics::HasProperties(input_file, "vertex", { "red", "green", "blue" }) &&
+                                   input_file.request_properties_from_element("vertex", { "red", "green", "blue" }, colors, 1, true) == tile_count;
+            input_file.read_batches("vertex", C3DV_graphics::kLoadBatchSize, [&](size_t first, size_t count) {
+                const size_t vertex_offset = tiles[i].first + first;
+                auto batch = std::make_shared<std::vector<uint8_t>>(count * layout.stride());
+                layout.Interleave("position", positions.data(), count, batch->data());
+                if (has_color) {
+                    layout.Interleave("color", colors.data(), count, batch->data());
+                } else {
+                    const std::vector<uint8_t> white(3 * count, 255);
+                    layout.Interleave("color", white.data(), count, batch->data());
+                }
+                if (progress.cancelled || !stream.Write("vertex", vertex_offset * layout.stride(), batch->data(), batch->size(), batch))
+                    return false;
+                progress.Advance(mappings[i]->size() * count / tile_count, count);
+                const size_t uploaded = first + count;
+                return stream.Run([this, i, uploaded]() { tiles_3D_cloud_[i].count = uploaded; });
+            });
+        } catch (const std::exception& e) {
+            std::cout << files[i] << ": " << e.what() << std::endl;
+        }
+    });
+}
 
-    const std::string vertex_shader_surfels{"#version 330\n"
+void GUIApplication::Init3DSurfels() {
+    // The filter every surfel shader applies, see SetSurfelFilter.
+    const std::string surfel_filter{
+        "uniform vec2 radius_range;\n"
+        "uniform float min_quality;\n"
+        "uniform float max_curvature;\n"
+        "bool KeepSurfel(float radius, float quality, float curvature) {\n"
+        "    return radius >= radius_range.x && radius <= radius_range.y && quality >= min_quality && curvature <= max_curvature;\n"
+        "}\n"};
+    
+    // Culled discs are moved behind the far plane.
+    const std::string vertex_shader_surfels = "#version 330\n" + surfel_filter +
         "uniform mat4 modelView;\n"
         "uniform mat4 u_projection;\n"
         "layout(location = 0) in vec3 position;\n"
         "layout(location = 1) in vec3 color;\n"
-        "layout(location = 2) in vec3 texture;\n"
         "layout(location = 3) in vec3 normal;\n"
+        "layout(location = 4) in float radius;\n"
+        "layout(location = 5) in float quality;\n"
+        "layout(location = 6) in float curvature;\n"
         "out vec2 v_surfel_coord;\n"
         "out vec3 colorV;\n"
         "out vec4 normalV;\n"
         "out vec4 positionV;\n"
+        "const vec2 corners[6] = vec2[6](vec2(0, 0), vec2(1, 0), vec2(1, 1), vec2(0, 0), vec2(1, 1), vec2(0, 1));\n"
         "void main() {\n"
-        "    v_surfel_coord = vec2(2.0 * texture - 1.0)\n;"
+        "    v_surfel_coord = 2.0 * corners[gl_VertexID % 6] - 1.0;\n"
         "    vec4 normalV = modelView * vec4(normal, 0);"
         "    vec3 test = vec3(0.5, 0.5, 1);"
         "    float diffuse = abs(dot(normalV.xyz, normalize(test)));"
@@ -320,6 +789,120 @@ void GUIApplication::Init3DSurfels() {
         "    vec4 positionV = modelView * vec4(position, 1);"
         "    gl_Position = u_projection * positionV;"
         "    colorV = color2;\n"
+        "    if (!KeepSurfel(radius, quality, curvature))\n"
+        "        gl_Position = vec4(0, 0, 2, 1);\n"
+        "}";
+    
+    // One point per surfel, the geometry shader builds the same two triangles as ExpandSurfels
+    // (p0 p1 p2 and p0 p2 p3) as one strip, with the same lighting. Culled surfels emit nothing.
+    const std::string vertex_shader_surfel_records{"#version 330\n"
+        "layout(location = 0) in vec3 position;\n"
+        "layout(location = 1) in vec3 normal;\n"
+        "layout(location = 2) in float radius;\n"
+        "layout(location = 3) in vec4 color;\n"
+        "layout(location = 4) in float quality;\n"
+        "layout(location = 5) in float curvature;\n"
+        "out vec3 normalG;\n"
+        "out float radiusG;\n"
+        "out vec3 colorG;\n"
+        "out float qualityG;\n"
+        "out float curvatureG;\n"
+        "void main() {\n"
+        "    gl_Position = vec4(position, 1.0);\n"
+        "    normalG = normal;\n"
+        "    radiusG = radius;\n"
+        "    colorG = color.rgb;\n"
+        "    qualityG = quality;\n"
+        "    curvatureG = curvature;\n"
+        "}"};
+    
+    const std::string geometry_shader_surfel_records = "#version 330\n" + surfel_filter +
+        "layout(points) in;\n"
+        "layout(triangle_strip, max_vertices = 4) out;\n"
+        "uniform mat4 modelView;\n"
+        "uniform mat4 u_projection;\n"
+        "in vec3 normalG[];\n"
+        "in float radiusG[];\n"
+        "in vec3 colorG[];\n"
+        "in float qualityG[];\n"
+        "in float curvatureG[];\n"
+        "out vec2 v_surfel_coord;\n"
+        "out vec3 colorV;\n"
+        "void EmitCorner(vec3 position, vec2 texture, vec3 color) {\n"
+        "    v_surfel_coord = 2.0 * texture - 1.0;\n"
+        "    colorV = color;\n"
+        "    gl_Position = u_projection * (modelView * vec4(position, 1));\n"
+        "    EmitVertex();\n"
+        "}\n"
+        "void main() {\n"
+        "    if (!KeepSurfel(radiusG[0], qualityG[0], curvatureG[0]))\n"
+        "        return;\n"
+        "    vec3 center = gl_in[0].gl_Position.xyz;\n"
+        "    vec3 normal = normalG[0];\n"
+        "    vec3 axis = (abs(normal.x) > abs(normal.y)) ? vec3(1, 0, 0) : vec3(0, 1, 0);\n"
+        "    vec3 u = radiusG[0] * normalize(cross(normal, axis));\n"
+        "    vec3 v = cross(normal, u);\n"
+        "    float diffuse = abs(dot((modelView * vec4(normal, 0)).xyz, normalize(vec3(0.5, 0.5, 1))));\n"
+        "    vec3 color = colorG[0] * diffuse;\n"
+        "    EmitCorner(center - v, vec2(1, 0), color);\n"
+        "    EmitCorner(center + u, vec2(1, 1), color);\n"
+        "    EmitCorner(center - u, vec2(0, 0), color);\n"
+        "    EmitCorner(center + v, vec2(0, 1), color);\n"
+        "    EndPrimitive();\n"
+        "}";
+    
+    // One point sprite per surfel, big enough for the disc seen face on. Every pixel intersects
+    // its view ray with the plane of the disc, which clips the (perspective) ellipse the disc
+    // projects to and gives the depth of the disc at that pixel. Culled sprites are moved behind
+    // the far plane.
+    const std::string vertex_shader_surfel_splats = "#version 330\n" + surfel_filter +
+        "uniform mat4 modelView;\n"
+        "uniform mat4 u_projection;\n"
+        "uniform vec2 focal;\n"
+        "layout(location = 0) in vec3 position;\n"
+        "layout(location = 1) in vec3 normal;\n"
+        "layout(location = 2) in float radius;\n"
+        "layout(location = 3) in vec4 color;\n"
+        "layout(location = 4) in float quality;\n"
+        "layout(location = 5) in float curvature;\n"
+        "flat out vec3 centerV;\n"
+        "flat out vec3 normalV;\n"
+        "flat out float radiusV;\n"
+        "flat out vec3 colorV;\n"
+        "void main() {\n"
+        "    vec4 center = modelView * vec4(position, 1);\n"
+        "    vec3 normal_view = (modelView * vec4(normal, 0)).xyz;\n"
+        "    float diffuse = abs(dot(normal_view, normalize(vec3(0.5, 0.5, 1))));\n"
+        "    centerV = center.xyz;\n"
+        "    normalV = normal_view;\n"
+        // The inscribed circle of the quad the discs modes draw.
+        "    radiusV = radius / 1.414214;\n"
+        "    colorV = color.rgb * diffuse;\n"
+        "    gl_Position = u_projection * center;\n"
+        "    gl_PointSize = (center.z < 0.0) ? 2.0 * radiusV * max(focal.x, focal.y) / -center.z + 2.0 : 0.0;\n"
+        "    if (!KeepSurfel(radius, quality, curvature))\n"
+        "        gl_Position = vec4(0, 0, 2, 1);\n"
+        "}";
+    
+    const std::string fragment_shader_surfel_splats{"#version 330\n"
+        "uniform mat4 u_projection;\n"
+        "uniform vec2 viewport;\n"
+        "flat in vec3 centerV;\n"
+        "flat in vec3 normalV;\n"
+        "flat in float radiusV;\n"
+        "flat in vec3 colorV;\n"
+        "out vec4 color;\n"
+        "void main() {\n"
+        "    vec2 ndc = 2.0 * gl_FragCoord.xy / viewport - 1.0;\n"
+        "    vec3 ray = vec3(ndc.x / u_projection[0][0], ndc.y / u_projection[1][1], -1.0);\n"
+        "    float facing = dot(ray, normalV);\n"
+        "    if (abs(facing) < 1e-6) discard;\n"
+        "    vec3 hit = ray * (dot(centerV, normalV) / facing);\n"
+        "    vec3 offset = hit - centerV;\n"
+        "    if (dot(offset, offset) > radiusV * radiusV) discard;\n"
+        "    vec4 clip = u_projection * vec4(hit, 1);\n"
+        "    gl_FragDepth = 0.5 * clip.z / clip.w + 0.5;\n"
+        "    color = vec4(colorV, 1.0);\n"
         "}"};
     
     const std::string fragment_shader_surfels{"#version 330\n"
@@ -333,35 +916,526 @@ void GUIApplication::Init3DSurfels() {
         "    color = vec4(colorV, 1.0);\n"
         "}"};
     
-    shader_3D_surfels_.Init("shader_surfels3D", vertex_shader_surfels, fragment_shader_surfels);
-    shader_3D_surfels_.shader_.bind();
-    shader_3D_surfels_.shader_.bind();
-    shader_3D_surfels_.shader_.uploadAttrib("normal", normal_discs);
-    shader_3D_surfels_.shader_.uploadAttrib("position", positions_discs);
-    shader_3D_surfels_.shader_.uploadAttrib("color", color_surfel_discs);
-    shader_3D_surfels_.shader_.uploadAttrib("texture", texture_discs);
+    // Emits a point for every surfel the filter keeps (the first of its vertices), which are
+    // counted with rasterization turned off.
+    const std::string vertex_shader_surfel_count = "#version 330\n" + surfel_filter +
+        "uniform int vertices_per_surfel;\n"
+        "in float radius;\n"
+        "in float quality;\n"
+        "in float curvature;\n"
+        "flat out int keep;\n"
+        "void main() {\n"
+        "    keep = (gl_VertexID % vertices_per_surfel == 0 && KeepSurfel(radius, quality, curvature)) ? 1 : 0;\n"
+        "    gl_Position = vec4(0, 0, 0, 1);\n"
+        "}";
+    
+    const std::string geometry_shader_surfel_count{"#version 330\n"
+        "layout(points) in;\n"
+        "layout(points, max_vertices = 1) out;\n"
+        "flat in int keep[];\n"
+        "void main() {\n"
+        "    if (keep[0] == 0)\n"
+        "        return;\n"
+        "    gl_Position = gl_in[0].gl_Position;\n"
+        "    EmitVertex();\n"
+        "    EndPrimitive();\n"
+        "}"};
+    
+    const std::string fragment_shader_surfel_count{"#version 330\n"
+        "out vec4 color;\n"
+        "void main() {\n"
+        "    color = vec4(1.0);\n"
+        "}"};
+    
+    StopLoad();
+    // Only the shader of the current mode keeps its buffers.
+    for (SurfelMode mode : {SurfelMode::CPUDiscs, SurfelMode::GPUDiscs, SurfelMode::PointSplats}) {
+        if (mode != surfel_mode_)
+            SurfelShader(mode).Free();
+    }
+    if (surfel_mode_ == SurfelMode::GPUDiscs)
+        shader_3D_surfel_records_.Init("shader_surfel_records3D", vertex_shader_surfel_records, fragment_shader_surfels, geometry_shader_surfel_records);
+    else if (surfel_mode_ == SurfelMode::PointSplats)
+        shader_3D_surfel_splats_.Init("shader_surfel_splats3D", vertex_shader_surfel_splats, fragment_shader_surfel_splats);
+    else
+        shader_3D_surfels_.Init("shader_surfels3D", vertex_shader_surfels, fragment_shader_surfels);
+    shader_3D_surfel_count_.Init("shader_surfel_count3D", vertex_shader_surfel_count, fragment_shader_surfel_count, geometry_shader_surfel_count);
+    SurfelShader(surfel_mode_).shader_.bind();
+    indices_3D_surfels_ = 0;
+    surfel_range_ = C3DV_graphics::SurfelRange();
+    surfel_survivors_.Free();
+    surfels_counted_ = -1;
+    if (file_surfel_map_.empty())
+        return;
+    const std::string file = file_surfel_map_;
+    const SurfelMode mode = surfel_mode_;
+    StartLoad(file, [this, file, mode](C3DV_graphics::LoadProgress& progress) {
+        Load3DSurfels(file, mode, progress);
+    });
+}
+
+Shader& GUIApplication::SurfelShader(SurfelMode mode) {
+    switch (mode) {
+        case SurfelMode::GPUDiscs: return shader_3D_surfel_records_;
+        case SurfelMode::PointSplats: return shader_3D_surfel_splats_;
+        default: return shader_3D_surfels_;
+    }
+}
+
+void GUIApplication::Load3DSurfels(const std::string& file, SurfelMode mode, C3DV_graphics::LoadProgress& progress) {
+    // The expanded discs (or the records) are cached, later loads skip decoding and expansion.
+    const bool records = (mode != SurfelMode::CPUDiscs);
+    Shader& shader = SurfelShader(mode);
+    const size_t vertices_per_surfel = records ? 1 : 6;
+    const std::string cache_path = C3DV_cache::CachePath(file, records ? "surfel_records" : "surfels");
+    auto cache = std::make_shared<C3DV_cache::SceneCache>();
+    const int range_index = cache->Open(cache_path, file) ? cache->FindBuffer(kSurfelRangeBuffer) : -1;
+    if (range_index >= 0 && cache->buffers()[range_index].size == sizeof(C3DV_graphics::SurfelRange)) {
+        C3DV_graphics::SurfelRange range;
+        std::memcpy(&range, cache->BufferData(range_index), sizeof(range));
+        C3DV_graphics::UploadStream stream(shader, render_tasks_, nullptr);
+        const size_t vertex_count = cache->header().vertex_count;
+        if (stream.UploadCache(cache, progress))
+            stream.Run([this, vertex_count, range]() {
+                indices_3D_surfels_ = vertex_count;
+                surfel_range_ = range;
+            });
+        return;
+    }
+
+    auto mapping = std::make_shared<tinyply::MappedFile>(file);
+    tinyply::PlyFile input_file(mapping);
+    C3DV_cache::SceneCacheWriter cache_writer(cache_path, file);
+    C3DV_graphics::UploadStream stream(shader, render_tasks_, &cache_writer);
+    
+    // Six vertices or one record per surfel, the buffers are filled batch by batch. The range of
+    // the filter sliders grows with them.
+    size_t surfel_count = 0;
+    C3DV_graphics::SurfelRange range;
+    const auto upload_batch = [&](const C3DV_graphics::SurfelColumns& columns, size_t first) {
+        range.Extend(columns);
+        if (records) {
+            auto packed = std::make_shared<std::vector<C3DV_graphics::SurfelRecord>>();
+            C3DV_graphics::PackSurfels(columns, *packed);
+            cache_writer.ExtendBounds(packed->data(), sizeof(C3DV_graphics::SurfelRecord), packed->size());
+            progress.Advance(mapping->size() * columns.x.size() / surfel_count, columns.x.size());
+            const size_t uploaded = first + columns.x.size();
+            return !progress.cancelled &&
+                stream.Write("surfels", first * sizeof(C3DV_graphics::SurfelRecord), packed->data(), packed->size() * sizeof(C3DV_graphics::SurfelRecord), packed) &&
+                stream.Run([this, uploaded, range]() {
+                    indices_3D_surfels_ = uploaded;
+                    surfel_range_ = range;
+                });
+        }
+        auto discs = std::make_shared<std::vector<C3DV_graphics::SurfelVertex>>(6 * columns.x.size());
+        C3DV_graphics::ExpandSurfels(columns, discs->data());
+        cache_writer.ExtendBounds(discs->data(), sizeof(C3DV_graphics::SurfelVertex), discs->size());
+        progress.Advance(mapping->size() * columns.x.size() / surfel_count, columns.x.size());
+        const size_t uploaded = 6 * (first + columns.x.size());
+        return !progress.cancelled &&
+            stream.Write("discs", 6 * first * sizeof(C3DV_graphics::SurfelVertex), discs->data(), discs->size() * sizeof(C3DV_graphics::SurfelVertex), discs) &&
+            stream.Run([this, uploaded, range]() {
+                indices_3D_surfels_ = uploaded;
+                surfel_range_ = range;
+            });
+    };
+    const auto allocate = [&]() {
+        const VertexLayout layout = SurfelLayout(records);
+        stream.Allocate(SurfelBuffer(records), vertices_per_surfel * surfel_count * layout.stride());
+        stream.BindLayout(SurfelBuffer(records), layout);
+    };
+    
+    C3DV_graphics::SurfelColumns columns;
+    if (input_file.has_fixed_layout("vertex") && C3DV_graphics::ViewSurfelColumns(input_file, columns)) {
+        // Expanded straight from the mapping.
+        surfel_count = columns.x.size();
+        allocate();
+        for (size_t first = 0; first < surfel_count; first += C3DV_graphics::kLoadBatchSize) {
+            const size_t count = std::min(C3DV_graphics::kLoadBatchSize, surfel_count - first);
+            if (!upload_batch(columns.Subset(first, count), first))
+                return;
+        }
+    } else {
+        // Decoded batch by batch, only one batch is in memory at a time. Other file types are
+        // converted while decoding.
+        std::vector<float> vertices;
+        std::vector<float> normals;
+        std::vector<float> radius;
+        std::vector<float> qualities;
+        std::vector<float> curvatures;
+        std::vector<uint8_t> colors;
+        if (!C3DV_graphics::HasProperties(input_file, "vertex", { "x", "y", "z", "nx", "ny", "nz", "red", "green", "blue", "radius" }))
+            return;
+        surfel_count = input_file.request_properties_from_element("vertex", { "x", "y", "z" }, vertices);
+        const size_t normal_count = input_file.request_properties_from_element("vertex", { "nx", "ny", "nz" }, normals);
+        const size_t color_count = input_file.request_properties_from_element("vertex", { "red", "green", "blue" }, colors, 1, true);
+        const size_t radius_count = input_file.request_properties_from_element("vertex", { "radius" }, radius);
+        if (surfel_count == 0 || normal_count != surfel_count || color_count != surfel_count || radius_count != surfel_count)
+            return;
+        // Optional, surfels without them pass their thresholds.
+        const bool has_quality = input_file.request_properties_from_element("vertex", { "quality" }, qualities) == surfel_count;
+        const bool has_curvature = input_file.request_properties_from_element("vertex", { "curvature" }, curvatures) == surfel_count;
+        allocate();
+        input_file.read_batches("vertex", C3DV_graphics::kLoadBatchSize, [&](size_t first, size_t count) {
+            C3DV_graphics::SurfelColumns batch;
+            batch.x = tinyply::StridedView<float>(&vertices[0], 3 * sizeof(float), count);
+            batch.y = tinyply::StridedView<float>(&vertices[1], 3 * sizeof(float), count);
+            batch.z = tinyply::StridedView<float>(&vertices[2], 3 * sizeof(float), count);
+            batch.nx = tinyply::StridedView<float>(&normals[0], 3 * sizeof(float), count);
+            batch.ny = tinyply::StridedView<float>(&normals[1], 3 * sizeof(float), count);
+            batch.nz = tinyply::StridedView<float>(&normals[2], 3 * sizeof(float), count);
+            batch.radius = tinyply::StridedView<float>(&radius[0], sizeof(float), count);
+            if (has_quality)
+                batch.quality = tinyply::StridedView<float>(&qualities[0], sizeof(float), count);
+            if (has_curvature)
+                batch.curvature = tinyply::StridedView<float>(&curvatures[0], sizeof(float), count);
+            batch.red = tinyply::StridedView<uint8_t>(&colors[0], 3, count);
+            batch.green = tinyply::StridedView<uint8_t>(&colors[1], 3, count);
+            batch.blue = tinyply::StridedView<uint8_t>(&colors[2], 3, count);
+            return upload_batch(batch, first);
+        });
+        if (progress.cancelled)
+            return;
+    }
+    cache_writer.AddBuffer(kSurfelRangeBuffer, &range, sizeof(range));
+    cache_writer.SetCounts(vertices_per_surfel * surfel_count, 0);
+    cache_writer.Finish();
 }
 
 void GUIApplication::Init3DMesh() {
-    std::vector<unsigned int> indices;
-    std::vector<float> vertices;
-    std::vector<float> uvs;
-    std::vector<float> normals;
+    StopLoad();
+    shader_3D_mesh_.Init("shader_mesh3D");
+    shader_3D_mesh_.shader_.bind();
+    indices_3D_mesh_ = 0;
+    virtual_texture_3D_mesh_.Free();
+    // The textures stay for the next mesh, which reuses them if the sizes match.
+    if (file_3D_mesh_.empty()) {
+        glDeleteTextures(1, &texture_array_3D_mesh_);
+        glDeleteTextures(1, &materials_3D_mesh_);
+        texture_array_3D_mesh_ = 0;
+        materials_3D_mesh_ = 0;
+        return;
+    }
+    const std::string file = file_3D_mesh_;
+    const std::string texture_file = file_3D_texture_;
+    const bool optimize = optimize_mesh_;
+    // Without S3TC support the pages are uploaded as RGB8.
+    const bool compress = compress_textures_ && HasExtension("GL_EXT_texture_compression_s3tc");
+    if (compress_textures_ && !compress)
+        std::cout << "BC1 textures are not supported, textures are not compressed" << std::endl;
+    const C3DV_graphics::MeshTextures textures = virtual_textures_ ? C3DV_graphics::MeshTextures::Virtual :
+                                                 (compress ? C3DV_graphics::MeshTextures::BC1 : C3DV_graphics::MeshTextures::RGB);
+    StartLoad(file, [this, file, texture_file, optimize, textures](C3DV_graphics::LoadProgress& progress) {
+        Load3DMesh(file, texture_file, optimize, textures, progress);
+    });
+}
+
+void GUIApplication::Load3DMesh(const std::string& file, const std::string& texture_file, bool optimize, C3DV_graphics::MeshTextures textures, C3DV_graphics::LoadProgress& progress) {
+    const std::string cache_path = C3DV_cache::CachePath(file, optimize ? "mesh_optimized" : "mesh");
+    auto cache = std::make_shared<C3DV_cache::SceneCache>();
+    std::vector<C3DV_graphics::SubMesh> batches;
+    std::vector<C3DV_graphics::Material> materials;
+    // The textures known before the mesh is read (the one picked in the UI, those of the cached
+    // materials or of the MTL files of an OBJ) are read by a second task while the mesh is
+    // imported or streamed from the cache. The textures go to the GPU once both are done.
+    const auto start = std::chrono::steady_clock::now();
+    double texture_seconds = 0.0;
+    const auto read_textures = [&texture_seconds, textures](std::vector<std::string> files) {
+        const auto texture_start = std::chrono::steady_clock::now();
+        std::map<std::string, C3DV_graphics::TexturePage> pages = C3DV_graphics::ReadTexturePages(files, textures);
+        texture_seconds = SecondsSince(texture_start);
+        return pages;
+    };
+    std::vector<std::string> texture_files;
+    if (!texture_file.empty())
+        texture_files.push_back(texture_file);
     
-    C3DV_graphics::loadAssImp(file_3D_mesh_.c_str(), indices, vertices, uvs, normals);
+    if (cache->Open(cache_path, file) && ReadMeshBatches(*cache, batches, materials)) {
+        for (const auto& material : materials) {
+            if (!material.texture.empty())
+                texture_files.push_back(material.texture);
+        }
+        auto read = std::async(std::launch::async, read_textures, texture_files);
+        C3DV_graphics::UploadStream stream(shader_3D_mesh_, render_tasks_, nullptr);
+        if (!stream.UploadCache(cache, progress))
+            return;
+        const double mesh_seconds = SecondsSince(start);
+        auto pages = read.get();
+        std::cout << file << ": cached mesh " << mesh_seconds << " s, textures " << texture_seconds
+                  << " s, both done after " << SecondsSince(start) << " s" << std::endl;
+        Publish3DMeshBatches(stream, batches, materials, texture_file, textures, std::move(pages));
+        return;
+    }
+
+    const bool obj = C3DV_graphics::IsObjFile(file);
+    auto read = std::async(std::launch::async, [read_textures, texture_files, obj, file]() {
+        std::vector<std::string> files = texture_files;
+        if (obj) {
+            const std::vector<std::string> material_textures = C3DV_graphics::ObjTextureFiles(file);
+            files.insert(files.end(), material_textures.begin(), material_textures.end());
+        }
+        return read_textures(files);
+    });
+    auto mesh = std::make_shared<C3DV_graphics::Mesh>();
     
-    indices_3D_mesh_ = indices.size() / 3;
+    // OBJ files are parsed in parallel without Assimp, which stays the fallback for everything
+    // else. Neither reports progress, the whole file counts once it is parsed.
+    bool loaded = false;
+    if (obj)
+        loaded = C3DV_graphics::LoadObj(file, *mesh);
+    if (!loaded)
+        loaded = C3DV_graphics::loadAssImp(file.c_str(), *mesh);
+    if (!loaded || progress.cancelled)
+        return;
+    // Assimp keeps one vertex per face corner, equal corners are merged before the upload.
+    std::cout << file << ": welded " << C3DV_graphics::WeldVertices(mesh->indices, mesh->vertices, mesh->uvs, mesh->normals).ToString() << std::endl;
+    // Meshes without normals get smooth ones (Assimp is not asked to generate them, which is slower).
+    if (mesh->normals.empty()) {
+        const auto normals_start = std::chrono::steady_clock::now();
+        C3DV_graphics::ComputeNormals(mesh->indices, mesh->vertices, mesh->normals);
+        std::cout << file << ": computed normals in " << SecondsSince(normals_start) * 1e3 << " ms" << std::endl;
+    }
+    // Parts with the same material are merged into one batch per material.
+    C3DV_graphics::SortByMaterial(*mesh);
+    if (optimize) {
+        // Triangles in post-transform cache order, then vertices in the order they are fetched.
+        const C3DV_graphics::VertexCacheStats before = C3DV_graphics::AnalyzeVertexCache(mesh->indices, mesh->vertices.size() / 3);
+        C3DV_graphics::OptimizeVertexCache(*mesh);
+        C3DV_graphics::OptimizeVertexFetch(mesh->indices, mesh->vertices, mesh->uvs, mesh->normals);
+        const C3DV_graphics::VertexCacheStats after = C3DV_graphics::AnalyzeVertexCache(mesh->indices, mesh->vertices.size() / 3);
+        std::cout << file << ": vertex cache " << before.ToString() << " -> " << after.ToString() << std::endl;
+    }
+    batches = C3DV_graphics::MaterialBatches(*mesh);
+    auto batch_ids = std::make_shared<std::vector<float>>(C3DV_graphics::VertexBatchIds(*mesh, batches));
+    std::cout << file << ": " << mesh->submeshes.size() << " parts, " << mesh->materials.size() << " materials, "
+              << batches.size() << " batches" << std::endl;
+    progress.Advance(progress.bytes_total, mesh->vertices.size() / 3);
     
-    Eigen::Map<nanogui::MatrixXf> eigen_vertices(vertices.data(), 3, (vertices.size() / 3));
-    Eigen::Map<nanogui::MatrixXf> eigen_normals(normals.data(), 3, (normals.size() / 3));
-    Eigen::Map<nanogui::MatrixXf> eigen_uv(uvs.data(), 2, (uvs.size() / 2));
-    Eigen::Map<nanogui::MatrixXu> eigen_indices(indices.data(), 3, (indices.size() / 3));
+    C3DV_cache::SceneCacheWriter cache_writer(cache_path, file);
+    C3DV_graphics::UploadStream stream(shader_3D_mesh_, render_tasks_, &cache_writer);
+    stream.UploadIndices(std::shared_ptr<const std::vector<uint32_t>>(mesh, &mesh->indices));
+    // All attributes interleaved in one buffer, meshes without texture coordinates leave them out.
+    const size_t vertex_count = mesh->vertices.size() / 3;
+    VertexLayout layout;
+    layout.Add("position", 3, GL_FLOAT).Add("normal", 3, GL_FLOAT);
+    if (!mesh->uvs.empty())
+        layout.Add("vertexUV", 2, GL_FLOAT);
+    layout.Add("material", 1, GL_FLOAT);
+    auto vertices = std::make_shared<std::vector<uint8_t>>(vertex_count * layout.stride());
+    layout.Interleave("position", mesh->vertices.data(), vertex_count, vertices->data());
+    layout.Interleave("normal", mesh->normals.data(), vertex_count, vertices->data());
+    if (!mesh->uvs.empty())
+        layout.Interleave("vertexUV", mesh->uvs.data(), vertex_count, vertices->data());
+    layout.Interleave("material", batch_ids->data(), vertex_count, vertices->data());
+    stream.Allocate("vertex", vertices->size());
+    stream.Write("vertex", 0, vertices->data(), vertices->size(), vertices);
+    stream.BindLayout("vertex", layout);
+    const double mesh_seconds = SecondsSince(start);
+    auto pages = read.get();
+    std::cout << file << ": mesh " << mesh_seconds << " s, textures " << texture_seconds
+              << " s, both done after " << SecondsSince(start) << " s" << std::endl;
+    if (!Publish3DMeshBatches(stream, batches, mesh->materials, texture_file, textures, std::move(pages)))
+        return;
+    WriteMeshBatches(cache_writer, batches, mesh->materials);
+    cache_writer.ExtendBounds(mesh->vertices.data(), 3 * sizeof(float), vertex_count);
+    cache_writer.SetCounts(vertex_count, mesh->indices.size());
+    cache_writer.Finish();
+}
+
+bool GUIApplication::Publish3DMeshBatches(C3DV_graphics::UploadStream& stream,
+                                          const std::vector<C3DV_graphics::SubMesh>& batches,
+                                          const std::vector<C3DV_graphics::Material>& materials,
+                                          const std::string& texture_file,
+                                          C3DV_graphics::MeshTextures textures,
+                                          std::map<std::string, C3DV_graphics::TexturePage> pages) {
+    // Materials without a texture of their own use the one picked in the UI, if any. Every
+    // texture file becomes one layer.
+    std::vector<std::string> texture_files;
+    std::vector<int> layers;
+    int index_count = 0;
+    for (const auto& batch : batches) {
+        const C3DV_graphics::Material& material = materials[batch.material];
+        const std::string& texture = material.texture.empty() ? texture_file : material.texture;
+        int layer = -1;
+        if (!texture.empty()) {
+            layer = static_cast<int>(std::find(texture_files.begin(), texture_files.end(), texture) - texture_files.begin());
+            if (layer == static_cast<int>(texture_files.size()))
+                texture_files.push_back(texture);
+        }
+        layers.push_back(layer);
+        index_count = std::max(index_count, static_cast<int>(batch.first + batch.count));
+    }
+    if (texture_files.size() > C3DV_graphics::kMaxMeshTextureLayers) {
+        std::cout << texture_files.size() << " textures, only the first " << C3DV_graphics::kMaxMeshTextureLayers
+                  << " are used" << std::endl;
+        texture_files.resize(C3DV_graphics::kMaxMeshTextureLayers);
+    }
+    // With compression a page comes from its block cache if there is one, and is only decoded
+    // (and then encoded and cached) otherwise.
+    std::vector<std::string> unread;
+    for (const std::string& texture : texture_files) {
+        if (pages.find(texture) == pages.end())
+            unread.push_back(texture);
+    }
+    for (auto& page : C3DV_graphics::ReadTexturePages(unread, textures))
+        pages[page.first] = std::move(page.second);
+    if (textures == C3DV_graphics::MeshTextures::Virtual) {
+        // Every pyramid is a layer of the virtual texture. The second row of the material table
+        // has the size and the number of levels of each layer.
+        std::vector<std::shared_ptr<const C3DV_graphics::TilePyramid>> pyramids;
+        std::vector<int> pyramid_layers(texture_files.size(), -1);
+        size_t tile_bytes = 0;
+        for (size_t i = 0; i < texture_files.size(); i++) {
+            const auto& pyramid = pages[texture_files[i]].pyramid;
+            if (!pyramid)
+                continue;
+            pyramid_layers[i] = static_cast<int>(pyramids.size());
+            pyramids.push_back(pyramid);
+            for (int level = 0; level < pyramid->levels(); level++)
+                tile_bytes += static_cast<size_t>(pyramid->TilesX(level)) * pyramid->TilesY(level) * C3DV_graphics::kVirtualTileBytes;
+        }
+        const int columns = static_cast<int>(std::max<size_t>(1, std::max(batches.size(), pyramids.size())));
+        auto material_texels = std::make_shared<std::vector<float>>(static_cast<size_t>(columns) * 2 * 4, 0.0f);
+        for (size_t b = 0; b < batches.size(); b++) {
+            const C3DV_graphics::Material& material = materials[batches[b].material];
+            const int layer = (layers[b] >= 0 && layers[b] < static_cast<int>(pyramid_layers.size())) ? pyramid_layers[layers[b]] : -1;
+            std::copy_n(material.diffuse, 3, material_texels->begin() + 4 * b);
+            (*material_texels)[4 * b + 3] = static_cast<float>(layer);
+        }
+        for (size_t i = 0; i < pyramids.size(); i++) {
+            float* texel = material_texels->data() + 4 * (columns + i);
+            texel[0] = static_cast<float>(pyramids[i]->width());
+            texel[1] = static_cast<float>(pyramids[i]->height());
+            texel[2] = static_cast<float>(pyramids[i]->levels());
+        }
+        if (!pyramids.empty())
+            std::cout << pyramids.size() << " virtual textures, " << tile_bytes / (1 << 20) << " MB of tiles on disk" << std::endl;
+        return stream.Run([this, material_texels, columns, pyramids, index_count]() {
+            UploadMaterialTexels(materials_3D_mesh_, *material_texels, columns, 2);
+            virtual_texture_3D_mesh_.Init(pyramids);
+            indices_3D_mesh_ = index_count / 3;
+            first_frame_pending_ = true;
+        });
+    }
+    const bool compress = (textures == C3DV_graphics::MeshTextures::BC1);
+    std::vector<cv::Mat> images(texture_files.size());
+    std::vector<C3DV_graphics::CompressedTexture> blocks(texture_files.size());
+    int width = 0;
+    int height = 0;
+    for (size_t i = 0; i < texture_files.size(); i++) {
+        images[i] = pages[texture_files[i]].image;
+        blocks[i] = pages[texture_files[i]].blocks;
+        width = std::max(width, std::max(images[i].cols, blocks[i].source_width));
+        height = std::max(height, std::max(images[i].rows, blocks[i].source_height));
+    }
+    // All layers of an array have the same size, smaller pages are scaled up. The cache holds a
+    // page at the size of its last array, other sizes are encoded again and replace it.
+    for (size_t i = 0; i < texture_files.size(); i++) {
+        if (blocks[i].blocks && (blocks[i].width != width || blocks[i].height != height)) {
+            blocks[i] = C3DV_graphics::CompressedTexture();
+            images[i] = cv::imread(texture_files[i], cv::IMREAD_COLOR);
+        }
+        if (images[i].empty())
+            continue;
+        const cv::Size source = images[i].size();
+        if (source.width != width || source.height != height)
+            cv::resize(images[i], images[i], cv::Size(width, height));
+        if (compress) {
+            blocks[i] = C3DV_graphics::CompressTexture(images[i]);
+            blocks[i].source_width = source.width;
+            blocks[i].source_height = source.height;
+            images[i].release();
+            C3DV_graphics::SaveCompressedTexture(texture_files[i], blocks[i]);
+        }
+    }
     
-    shader_3D_mesh_.Init("shader_mesh3D");
-    shader_3D_mesh_.shader_.bind();
-    shader_3D_mesh_.shader_.uploadIndices(eigen_indices);
-    shader_3D_mesh_.shader_.uploadAttrib("position", eigen_vertices);
-    shader_3D_mesh_.shader_.uploadAttrib("vertexUV", eigen_uv);
+    // One RGBA texel per batch: the diffuse color and the texture layer (-1 for none).
+    auto material_texels = std::make_shared<std::vector<float>>();
+    for (size_t b = 0; b < batches.size(); b++) {
+        const C3DV_graphics::Material& material = materials[batches[b].material];
+        const bool textured = (layers[b] >= 0 && layers[b] < static_cast<int>(images.size()) &&
+                               (!images[layers[b]].empty() || blocks[layers[b]].blocks));
+        material_texels->insert(material_texels->end(), {material.diffuse[0], material.diffuse[1], material.diffuse[2],
+                                                         textured ? static_cast<float>(layers[b]) : -1.0f});
+    }
+    const int layer_count = static_cast<int>(images.size());
+    // Size of the mip chain of one page, uncompressed pages get their mipmaps on the GPU.
+    C3DV_graphics::CompressedTexture page;
+    page.width = width;
+    page.height = height;
+    const GLint internal_format = compress ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_RGB8;
+    if (layer_count > 0 && width > 0) {
+        // RGB8 is padded to four bytes per texel, mipmaps add a third.
+        const size_t page_size = compress ? page.LevelOffset(page.Levels()) : static_cast<size_t>(width) * height * 4 * 4 / 3;
+        std::cout << layer_count << " texture pages of " << width << "x" << height << ", "
+                  << layer_count * page_size / (1 << 20) << " MB" << (compress ? " (BC1)" : "") << std::endl;
+    }
+    bool published = stream.Run([this, material_texels, page, internal_format, layer_count]() {
+        UploadMaterialTexels(materials_3D_mesh_, *material_texels, static_cast<int>(material_texels->size() / 4), 1);
+        if (layer_count == 0 || page.width == 0)
+            return;
+        // The array of the previous mesh is kept if it has the same number, size and format of pages.
+        GLint current[4] = {0, 0, 0, 0};
+        if (texture_array_3D_mesh_ == 0)
+            glGenTextures(1, &texture_array_3D_mesh_);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture_array_3D_mesh_);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_WIDTH, &current[0]);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_HEIGHT, &current[1]);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_DEPTH, &current[2]);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_INTERNAL_FORMAT, &current[3]);
+        if (current[0] == page.width && current[1] == page.height && current[2] == layer_count && current[3] == internal_format)
+            return;
+        if (internal_format == GL_RGB8) {
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB8, page.width, page.height, layer_count, 0, GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+            return;
+        }
+        for (int level = 0; level < page.Levels(); level++) {
+            glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, internal_format, page.LevelWidth(level), page.LevelHeight(level),
+                                   layer_count, 0, static_cast<GLsizei>(page.LevelSize(level) * layer_count), nullptr);
+        }
+    });
+    // Every page goes through a pixel buffer: this thread writes the rows (or blocks) into the
+    // mapped buffer and the render thread only starts the transfer, one page per task.
+    const size_t row_size = static_cast<size_t>(width) * 3;
+    for (int layer = 0; layer < layer_count && published; layer++) {
+        const cv::Mat& image = images[layer];
+        const C3DV_graphics::CompressedTexture& compressed = blocks[layer];
+        if (compressed.blocks) {
+            published = stream.WritePixels("pixels", compressed.size, [&compressed](uint8_t* pixels) {
+                std::memcpy(pixels, compressed.blocks, compressed.size);
+            }, [this, layer, page, internal_format]() {
+                glBindTexture(GL_TEXTURE_2D_ARRAY, texture_array_3D_mesh_);
+                for (int level = 0; level < page.Levels(); level++) {
+                    glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, page.LevelWidth(level), page.LevelHeight(level), 1,
+                                              internal_format, static_cast<GLsizei>(page.LevelSize(level)),
+                                              reinterpret_cast<const void*>(page.LevelOffset(level)));
+                }
+            });
+        } else if (!image.empty()) {
+            published = stream.WritePixels("pixels", row_size * height, [&image, row_size](uint8_t* pixels) {
+                for (int row = 0; row < image.rows; row++)
+                    std::memcpy(pixels + row * row_size, image.ptr(row), row_size);
+            }, [this, layer, width, height]() {
+                glBindTexture(GL_TEXTURE_2D_ARRAY, texture_array_3D_mesh_);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            });
+        }
+        images[layer].release();
+        blocks[layer] = C3DV_graphics::CompressedTexture();
+    }
+    return published && stream.Run([this, layer_count, width, compress, index_count]() {
+        if (layer_count > 0 && width > 0) {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, texture_array_3D_mesh_);
+            if (!compress)
+                glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        }
+        indices_3D_mesh_ = index_count / 3;
+        first_frame_pending_ = true;
+    });
 }
 
 void GUIApplication::Render2DTexture() {
@@ -378,26 +1452,108 @@ void GUIApplication::RenderCoordinateSystem() {
     shader_coordinate_system_.shader_.bind();
     shader_coordinate_system_.shader_.setUniform("model_view_projection", model_view_projection_);
     shader_coordinate_system_.shader_.drawIndexed(GL_LINES, 0, indices_coordinate_system_);
+    draw_calls_++;
 }
 
 void GUIApplication::Render3DCloud() {
     shader_3D_cloud_.shader_.bind();
     shader_3D_cloud_.shader_.setUniform("model_view_projection", model_view_projection_);
-    shader_3D_cloud_.shader_.drawArray(GL_POINTS, 0, indices_3D_cloud_);
+    if (tiles_3D_cloud_.empty()) {
+        shader_3D_cloud_.shader_.drawArray(GL_POINTS, 0, indices_3D_cloud_);
+        draw_calls_++;
+        return;
+    }
+    for (const auto& tile : tiles_3D_cloud_) {
+        if (tile.count > 0) {
+            shader_3D_cloud_.shader_.drawArray(GL_POINTS, tile.first, tile.count);
+            draw_calls_++;
+        }
+    }
+}
+
+void GUIApplication::SetSurfelFilter(nanogui::GLShader& shader) {
+    shader.setUniform("radius_range", Eigen::Vector2f(LowerThreshold(surfel_range_.radius, surfel_filter_.min_radius),
+                                                      UpperThreshold(surfel_range_.radius, surfel_filter_.max_radius)));
+    shader.setUniform("min_quality", LowerThreshold(surfel_range_.quality, surfel_filter_.min_quality));
+    shader.setUniform("max_curvature", UpperThreshold(surfel_range_.curvature, surfel_filter_.max_curvature));
 }
 
 void GUIApplication::Render3DSurfels() {
-    shader_3D_surfels_.shader_.bind();
-    shader_3D_surfels_.shader_.setUniform("modelView", model_view_);
-    shader_3D_surfels_.shader_.setUniform("u_projection", projection_);
-    shader_3D_surfels_.shader_.drawArray(GL_TRIANGLES, 0, indices_3D_surfels_);
+    // The surfels the filter keeps are counted again after it or the uploaded surfels changed,
+    // in a pass over the buffer of the current mode that only runs the vertex and geometry shader.
+    const bool records = (surfel_mode_ != SurfelMode::CPUDiscs);
+    const GLuint buffer = SurfelShader(surfel_mode_).UploadedBuffer(SurfelBuffer(records));
+    surfel_survivors_.Collect();
+    if (surfels_counted_ != indices_3D_surfels_ && buffer != 0) {
+        nanogui::GLShader& counter = shader_3D_surfel_count_.shader_;
+        counter.bind();
+        shader_3D_surfel_count_.BindLayout(buffer, SurfelLayout(records));
+        SetSurfelFilter(counter);
+        counter.setUniform("vertices_per_surfel", records ? 1 : 6);
+        glEnable(GL_RASTERIZER_DISCARD);
+        if (surfel_survivors_.Begin()) {
+            counter.drawArray(GL_POINTS, 0, indices_3D_surfels_);
+            surfel_survivors_.End();
+            surfels_counted_ = indices_3D_surfels_;
+            draw_calls_++;
+        }
+        glDisable(GL_RASTERIZER_DISCARD);
+    }
+
+    nanogui::GLShader& shader = SurfelShader(surfel_mode_).shader_;
+    shader.bind();
+    SetSurfelFilter(shader);
+    shader.setUniform("modelView", model_view_);
+    shader.setUniform("u_projection", projection_);
+    surfel_timer_.Begin();
+    if (surfel_mode_ == SurfelMode::PointSplats) {
+        // The intrinsics are in window pixels, the sprites in framebuffer pixels.
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        const float scale = viewport[2] / window_width_;
+        shader.setUniform("focal", Eigen::Vector2f(f_x_ * scale, f_y_ * scale));
+        shader.setUniform("viewport", Eigen::Vector2f(viewport[2], viewport[3]));
+        glEnable(GL_PROGRAM_POINT_SIZE);
+        shader.drawArray(GL_POINTS, 0, indices_3D_surfels_);
+        glDisable(GL_PROGRAM_POINT_SIZE);
+    } else {
+        shader.drawArray((surfel_mode_ == SurfelMode::GPUDiscs) ? GL_POINTS : GL_TRIANGLES, 0, indices_3D_surfels_);
+    }
+    surfel_timer_.End();
+    draw_calls_++;
 }
 
 void GUIApplication::Render3DMesh() {
-    glBindTexture(GL_TEXTURE_2D, texture3D_mesh_);
+    if (indices_3D_mesh_ == 0)
+        return;
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, materials_3D_mesh_);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_array_3D_mesh_);
     shader_3D_mesh_.shader_.bind();
     shader_3D_mesh_.shader_.setUniform("model_view_projection", model_view_projection_);
+    shader_3D_mesh_.shader_.setUniform("model_view", model_view_);
+    shader_3D_mesh_.shader_.setUniform("myTextureSampler", 0);
+    shader_3D_mesh_.shader_.setUniform("materials", 1);
+    shader_3D_mesh_.shader_.setUniform("page_table", 2);
+    shader_3D_mesh_.shader_.setUniform("tile_cache", 3);
+    const bool virtual_textures = virtual_texture_3D_mesh_.Active();
+    if (virtual_textures) {
+        // Tiles asked for by the last frames, then the feedback of this frame at a lower
+        // resolution (the bias keeps the levels of the full resolution).
+        virtual_texture_3D_mesh_.Update();
+        virtual_texture_3D_mesh_.Bind(2, 3);
+        virtual_texture_3D_mesh_.BeginFeedback();
+        shader_3D_mesh_.shader_.setUniform("virtual_texture", 2);
+        shader_3D_mesh_.shader_.setUniform("lod_bias", -std::log2(static_cast<float>(C3DV_graphics::kVirtualFeedbackScale)));
+        shader_3D_mesh_.shader_.drawIndexed(GL_TRIANGLES, 0, indices_3D_mesh_);
+        draw_calls_++;
+        virtual_texture_3D_mesh_.EndFeedback();
+    }
+    shader_3D_mesh_.shader_.setUniform("virtual_texture", virtual_textures ? 1 : 0);
+    shader_3D_mesh_.shader_.setUniform("lod_bias", 0.0f);
     shader_3D_mesh_.shader_.drawIndexed(GL_TRIANGLES, 0, indices_3D_mesh_);
+    draw_calls_++;
 }
 
 void GUIApplication::UpdatePose() {
@@ -421,19 +1577,32 @@ GUIApplication::GUIApplication(): nanogui::Screen(Eigen::Vector2i(100, 100), "Cl
 }
 
 GUIApplication::~GUIApplication() {
-    shader_texture_.shader_.free();
-    shader_coordinate_system_.shader_.free();
-    shader_3D_cloud_.shader_.free();
-    shader_3D_surfels_.shader_.free();
-    shader_3D_mesh_.shader_.free();
+    StopLoad();
+    virtual_texture_3D_mesh_.Free();
+    glDeleteTextures(1, &texture_array_3D_mesh_);
+    glDeleteTextures(1, &materials_3D_mesh_);
+    shader_texture_.Free();
+    shader_coordinate_system_.Free();
+    shader_3D_cloud_.Free();
+    shader_3D_surfels_.Free();
+    shader_3D_surfel_records_.Free();
+    shader_3D_surfel_splats_.Free();
+    shader_3D_surfel_count_.Free();
+    surfel_timer_.Free();
+    surfel_survivors_.Free();
+    shader_3D_mesh_.Free();
 }
 
 void GUIApplication::draw(NVGcontext *ctx) {
+    UpdateLoadStatus();
     /* Draw the user interface */
     Screen::draw(ctx);
 }
 
 void GUIApplication::drawContents() {
+    // Uploads of a background load, the rest stays queued for the next frames.
+    render_tasks_.Run(C3DV_graphics::kUploadBudget);
+    draw_calls_ = 0;
     glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
     RenderCoordinateSystem();
@@ -444,6 +1613,11 @@ void GUIApplication::drawContents() {
         Render3DSurfels();
     else if (render_type_ == RenderType::Mesh3D)
         Render3DMesh();
+    if (first_frame_pending_) {
+        first_frame_pending_ = false;
+        first_frame_seconds_ = SecondsSince(load_progress_.start);
+        std::cout << "first frame after " << first_frame_seconds_ << " s" << std::endl;
+    }
     glDisable(GL_CULL_FACE);
     glDisable(GL_DEPTH_TEST);
     
@@ -527,5 +1701,11 @@ bool GUIApplication::charCallbackEvent(unsigned int codepoint) {
 bool GUIApplication::dropCallbackEvent(int count, const char **filenames) {
     // is called if function is declared virtual in nanogui
     nanogui::Screen::dropCallbackEvent(count, filenames);
+    // A dropped directory is loaded as point cloud tiles.
+    if (count > 0 && C3DV_graphics::IsDirectory(filenames[0])) {
+        file_point_cloud_ = filenames[0];
+        render_type_ = RenderType::PointCloud;
+        Init3DCloud();
+    }
     return true;
 }
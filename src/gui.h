@@ -11,28 +11,72 @@
 #define _H_GUI_
 
 #include <array>
+#include <functional>
+#include <map>
 #include <set>
+#include <thread>
 
 #include <nanogui/button.h>
 #include <nanogui/checkbox.h>
 #include <nanogui/glutil.h>
+#include <nanogui/label.h>
 #include <nanogui/layout.h>
 #include <nanogui/opengl.h>
+#include <nanogui/progressbar.h>
 #include <nanogui/screen.h>
 #include <nanogui/textbox.h>
 #include <nanogui/toolbutton.h>
 #include <nanogui/window.h>
 #include <opencv2/opencv.hpp>
 
+#include "async_loader.h"
+#include "mesh_processing.h"
 #include "mouse_controls.h"
 #include "shader.h"
-
-constexpr float kSqrt2 = 1.414214f;
+#include "surfel_processing.h"
+#include "texture_compression.h"
+#include "tinyply.h"
+#include "virtual_texture.h"
 
 namespace C3DV_graphics {
 
-bool loadAssImp(const char* path, std::vector<unsigned int>& indices, std::vector<float>& vertices, std::vector<float>& uvs, std::vector<float>& normals);
-bool BindCVMat2GLTexture(const cv::Mat& image, GLuint& imageTexture, bool conv);
+// Number of vertices decoded and uploaded at once when streaming a PLY file.
+constexpr size_t kLoadBatchSize = 1 << 16;
+
+// Consecutive vertices of one tile in the merged buffers.
+struct DrawRange {
+    size_t first;
+    size_t count;
+};
+
+// Texture pages of a mesh above this count are drawn with their diffuse color (the smallest
+// GL_MAX_ARRAY_TEXTURE_LAYERS of OpenGL 3.3).
+constexpr size_t kMaxMeshTextureLayers = 256;
+
+// How mesh textures get to the GPU: as they are, BC1 compressed, or as virtual textures whose
+// tiles are streamed from a pyramid on disk once they are visible.
+enum class MeshTextures {
+    RGB, BC1, Virtual
+};
+
+// A mesh texture read from disk: the decoded image, its cached BC1 blocks or its tile pyramid.
+struct TexturePage {
+    cv::Mat image;
+    CompressedTexture blocks;
+    std::shared_ptr<const TilePyramid> pyramid;
+};
+// Reads texture files in parallel, from the BC1 cache if there is one for MeshTextures::BC1;
+// virtual textures only map their pyramids (built first where they are missing).
+std::map<std::string, TexturePage> ReadTexturePages(const std::vector<std::string>& files, MeshTextures textures);
+
+// Size of a regular file, 0 for anything else.
+uint64_t FileSize(const std::string& path);
+bool IsDirectory(const std::string& path);
+// The .ply files in a directory, sorted by name.
+std::vector<std::string> ListPlyFiles(const std::string& directory);
+
+// Reads every mesh and material of a scene.
+bool loadAssImp(const char* path, Mesh& mesh);
 
 };
 
@@ -43,12 +87,43 @@ private:
        None = 0, PointCloud, SurfelMap, Mesh3D
     };
     RenderType render_type_{RenderType::SurfelMap};
+    // Surfel discs are built on the CPU (six vertices each), by a geometry shader from one
+    // record per surfel, or drawn as point sprites that clip the disc per pixel.
+    enum class SurfelMode {
+        CPUDiscs = 0, GPUDiscs, PointSplats
+    };
+    SurfelMode surfel_mode_{SurfelMode::GPUDiscs};
+    // Surfels outside these thresholds are culled by the shaders. The values are slider positions
+    // within surfel_range_ of the loaded map, 0 and 1 keep everything.
+    struct SurfelFilter {
+        float min_radius{0.0f};
+        float max_radius{1.0f};
+        float min_quality{0.0f};
+        float max_curvature{1.0f};
+    };
+    SurfelFilter surfel_filter_;
+    C3DV_graphics::SurfelRange surfel_range_;
     
     // This file is set with nanogui.
-    std::string file_point_cloud_{""};
+    std::string file_point_cloud_{""};      // a .ply file or a directory of .ply tiles
     std::string file_surfel_map_{""};
     std::string file_3D_mesh_{""};
-    GLuint texture3D_mesh_;
+    std::string file_3D_texture_{""};
+    // Reorders meshes for the post-transform cache and vertex fetch after loading.
+    bool optimize_mesh_{true};
+    // Mesh textures are uploaded as BC1 blocks, cached next to the texture files.
+    bool compress_textures_{false};
+    // Mesh textures are virtual textures, for textures that do not fit into GPU memory.
+    bool virtual_textures_{false};
+    
+    // Files are loaded on load_thread_, its GL work runs in drawContents().
+    std::thread load_thread_;
+    C3DV_graphics::LoadProgress load_progress_;
+    C3DV_graphics::RenderTaskQueue render_tasks_{C3DV_graphics::kRenderQueueCapacity};
+    nanogui::Label* load_label_{nullptr};
+    nanogui::ProgressBar* load_bar_{nullptr};
+    nanogui::Button* cancel_button_{nullptr};
+    nanogui::Label* render_label_{nullptr};
     
     // camera intrinsics (used for projection matrix)
     float f_x_ = 574;
@@ -73,13 +148,34 @@ private:
     // For rendering the indices of the coordinate system.
     int indices_coordinate_system_{0};
     int indices_3D_cloud_{0};
+    std::vector<C3DV_graphics::DrawRange> tiles_3D_cloud_;
     int indices_3D_surfels_{0};
+    // The whole mesh is one draw: every vertex carries the index of its material, whose texel in
+    // materials_3D_mesh_ holds the diffuse color and the layer in texture_array_3D_mesh_.
     int indices_3D_mesh_{0};
+    GLuint texture_array_3D_mesh_{0};
+    GLuint materials_3D_mesh_{0};
+    // Used instead of the texture array with MeshTextures::Virtual.
+    C3DV_graphics::VirtualTexture virtual_texture_3D_mesh_;
+    // Draw calls of the last frame.
+    int draw_calls_{0};
+    // Time from the start of a load to the first frame that shows the result.
+    bool first_frame_pending_{false};
+    double first_frame_seconds_{0.0};
 
     // Shaders for rendering.
     Shader3DColored shader_coordinate_system_;
     Shader3DColored shader_3D_cloud_;
     Shader shader_3D_surfels_;
+    Shader shader_3D_surfel_records_;
+    Shader shader_3D_surfel_splats_;
+    // GPU time of the surfel draw, shown in the main window to compare the modes.
+    GpuTimer surfel_timer_;
+    // Counts the surfels the filter keeps, without drawing them, whenever the filter or the
+    // number of uploaded surfels changes.
+    Shader shader_3D_surfel_count_;
+    GpuCounter surfel_survivors_;
+    int surfels_counted_{-1};
     Shader3DTextured shader_3D_mesh_;
     Shader2D shader_texture_;
 
@@ -93,8 +189,31 @@ private:
     void Init3DCloud();
     // Init Shader for drawing a 3D surfels.
     void Init3DSurfels();
+    // The shader that holds the surfel buffers in a mode.
+    Shader& SurfelShader(SurfelMode mode);
     // Init Shader for drawing a 3D mesh.
     void Init3DMesh();
+    // Loader thread side of Init3DCloud, Init3DSurfels and Init3DMesh.
+    void Load3DCloud(const std::string& file, C3DV_graphics::LoadProgress& progress);
+    void Load3DCloudTiles(const std::string& directory, C3DV_graphics::LoadProgress& progress);
+    void Load3DSurfels(const std::string& file, SurfelMode mode, C3DV_graphics::LoadProgress& progress);
+    void Load3DMesh(const std::string& file, const std::string& texture_file, bool optimize, C3DV_graphics::MeshTextures textures, C3DV_graphics::LoadProgress& progress);
+    // Puts the textures of the batches into the layers of one texture array (or of the virtual
+    // texture) and hands them to the render thread together with the material table. `pages`
+    // are the textures read ahead, the others are read here.
+    bool Publish3DMeshBatches(C3DV_graphics::UploadStream& stream,
+                              const std::vector<C3DV_graphics::SubMesh>& batches,
+                              const std::vector<C3DV_graphics::Material>& materials,
+                              const std::string& texture_file,
+                              C3DV_graphics::MeshTextures textures,
+                              std::map<std::string, C3DV_graphics::TexturePage> pages);
+    // Runs `load` on the loader thread, a running load is stopped first.
+    void StartLoad(const std::string& file, const std::function<void(C3DV_graphics::LoadProgress&)>& load);
+    void CancelLoad();
+    // Cancels and waits for the loader thread.
+    void StopLoad();
+    // Shows the progress of the current load.
+    void UpdateLoadStatus();
     // Renders 2D texture.
     void Render2DTexture();
     // Renders Coordinate System.
@@ -103,6 +222,8 @@ private:
     void Render3DCloud();
     // Render 3D surfel map.
     void Render3DSurfels();
+    // Sets the thresholds of the surfel filter on a bound surfel shader.
+    void SetSurfelFilter(nanogui::GLShader& shader);
     // Render 3D mesh.
     void Render3DMesh();
     // Computes current poses for rendering.
@@ -0,0 +1,594 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#include "mesh_processing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace C3DV_graphics {
+
+namespace {
+
+constexpr uint32_t kEmptySlot = 0xFFFFFFFFu;
+constexpr size_t kBlockSize = 1 << 14;
+
+// The attribute arrays of a mesh, vertices are compared and hashed by their bit patterns.
+class VertexAttributes {
+public:
+    VertexAttributes(const std::vector<float>& vertices, const std::vector<float>& uvs, const std::vector<float>& normals) {
+        Add(vertices, 3);
+        Add(uvs, 2);
+        Add(normals, 3);
+    }
+    uint64_t Hash(size_t i) const {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (int a = 0; a < count_; a++) {
+            for (int c = 0; c < dims_[a]; c++) {
+                uint32_t bits;
+                std::memcpy(&bits, &data_[a][dims_[a] * i + c], sizeof(bits));
+                hash = (hash ^ bits) * 0x100000001b3ull;
+            }
+        }
+        return hash ^ (hash >> 32);
+    }
+    bool Equal(size_t i, size_t j) const {
+        for (int a = 0; a < count_; a++) {
+            if (std::memcmp(&data_[a][dims_[a] * i], &data_[a][dims_[a] * j], dims_[a] * sizeof(float)) != 0)
+                return false;
+        }
+        return true;
+    }
+    size_t VertexBytes() const {
+        size_t bytes = 0;
+        for (int a = 0; a < count_; a++)
+            bytes += dims_[a] * sizeof(float);
+        return bytes;
+    }
+private:
+    const float* data_[3];
+    int dims_[3];
+    int count_{0};
+    void Add(const std::vector<float>& data, int dim) {
+        if (data.empty())
+            return;
+        data_[count_] = data.data();
+        dims_[count_] = dim;
+        count_++;
+    }
+};
+
+// Keeps, per slot, the smallest index of all vertices equal to the one stored there.
+class WeldTable {
+public:
+    WeldTable(const VertexAttributes& attributes, size_t count, size_t threads): attributes_(attributes) {
+        size_t capacity = 16;
+        while (capacity < 2 * count)
+            capacity *= 2;
+        mask_ = capacity - 1;
+        slots_.reset(new std::atomic<uint32_t>[capacity]);
+        ParallelForBlocks(capacity, kBlockSize, [&](size_t first, size_t last) {
+            for (size_t s = first; s < last; s++)
+                slots_[s].store(kEmptySlot, std::memory_order_relaxed);
+        }, threads);
+    }
+    void Insert(uint32_t i) {
+        for (size_t s = attributes_.Hash(i) & mask_;; s = (s + 1) & mask_) {
+            uint32_t current = slots_[s].load(std::memory_order_relaxed);
+            if (current == kEmptySlot) {
+                if (slots_[s].compare_exchange_strong(current, i, std::memory_order_relaxed))
+                    return;
+            }
+            // `current` is the slot's vertex now, even if another thread filled it just before us.
+            if (attributes_.Equal(current, i)) {
+                while (i < current && !slots_[s].compare_exchange_weak(current, i, std::memory_order_relaxed)) {}
+                return;
+            }
+        }
+    }
+    // The first vertex equal to i, once all vertices are inserted.
+    uint32_t Find(uint32_t i) const {
+        for (size_t s = attributes_.Hash(i) & mask_;; s = (s + 1) & mask_) {
+            const uint32_t current = slots_[s].load(std::memory_order_relaxed);
+            if (attributes_.Equal(current, i))
+                return current;
+        }
+    }
+private:
+    const VertexAttributes& attributes_;
+    std::unique_ptr<std::atomic<uint32_t>[]> slots_;
+    size_t mask_;
+};
+
+// Vertex scores of the Forsyth optimizer: recently used vertices and vertices with few triangles
+// left score high, so triangles reuse cached vertices and finish off nearly done vertices.
+constexpr float kCacheDecayPower = 1.5f;
+constexpr float kLastTriangleScore = 0.75f;
+constexpr float kValenceBoostScale = 2.0f;
+constexpr float kValenceBoostPower = 0.5f;
+
+constexpr uint32_t kMaxTabulatedValence = 32;
+
+// The scores are looked up, the optimizer evaluates them for every cached vertex per triangle.
+struct VertexScoreTable {
+    float cache[kVertexCacheSize];
+    float valence[kMaxTabulatedValence];
+    VertexScoreTable() {
+        for (size_t i = 0; i < kVertexCacheSize; i++) {
+            // The vertices of the last triangle get a fixed score, otherwise it would be emitted again.
+            cache[i] = (i < 3) ? kLastTriangleScore : std::pow(1.0f - (i - 3) / float(kVertexCacheSize - 3), kCacheDecayPower);
+        }
+        for (uint32_t i = 0; i < kMaxTabulatedValence; i++)
+            valence[i] = kValenceBoostScale * std::pow(float(i), -kValenceBoostPower);
+    }
+};
+
+float VertexScore(int cache_position, uint32_t remaining) {
+    static const VertexScoreTable table;
+    if (remaining == 0)
+        return -1.0f;
+    const float score = (cache_position >= 0) ? table.cache[cache_position] : 0.0f;
+    return score + ((remaining < kMaxTabulatedValence) ? table.valence[remaining] :
+                    kValenceBoostScale * std::pow(float(remaining), -kValenceBoostPower));
+}
+
+// Vertices normalized at once by ComputeNormals, as separate x, y and z arrays.
+constexpr size_t kNormalBlockSize = 1024;
+
+// Scales `count` vectors to unit length, four at a time with SSE. Zero vectors stay zero.
+void NormalizeVectors(float* x, float* y, float* z, size_t count) {
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (; i + 4 <= count; i += 4) {
+        const __m128 vx = _mm_loadu_ps(x + i);
+        const __m128 vy = _mm_loadu_ps(y + i);
+        const __m128 vz = _mm_loadu_ps(z + i);
+        const __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+        // 1 / sqrt(0) is infinite, the mask turns it into 0.
+        const __m128 scale = _mm_and_ps(_mm_cmpgt_ps(length2, zero), _mm_div_ps(one, _mm_sqrt_ps(length2)));
+        _mm_storeu_ps(x + i, _mm_mul_ps(vx, scale));
+        _mm_storeu_ps(y + i, _mm_mul_ps(vy, scale));
+        _mm_storeu_ps(z + i, _mm_mul_ps(vz, scale));
+    }
+#endif
+    for (; i < count; i++) {
+        const float length2 = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+        const float scale = (length2 > 0.0f) ? 1.0f / std::sqrt(length2) : 0.0f;
+        x[i] *= scale;
+        y[i] *= scale;
+        z[i] *= scale;
+    }
+}
+
+}  // namespace
+
+std::string MeshStats::ToString() const {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << vertices_before << " -> " << vertices_after << " vertices, "
+        << bytes_before / double(1 << 20) << " -> " << bytes_after / double(1 << 20) << " MB";
+    return out.str();
+}
+
+std::string VertexCacheStats::ToString() const {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3) << "ACMR " << acmr << ", ATVR " << atvr;
+    return out.str();
+}
+
+MeshStats WeldVertices(std::vector<unsigned int>& indices,
+                       std::vector<float>& vertices,
+                       std::vector<float>& uvs,
+                       std::vector<float>& normals,
+                       size_t threads) {
+    const size_t count = vertices.size() / 3;
+    const VertexAttributes attributes(vertices, uvs, normals);
+    MeshStats stats;
+    stats.vertices_before = count;
+    stats.bytes_before = count * attributes.VertexBytes() + indices.size() * sizeof(unsigned int);
+    stats.vertices_after = count;
+    stats.bytes_after = stats.bytes_before;
+    if (count == 0 || count >= kEmptySlot || (!uvs.empty() && uvs.size() != 2 * count) ||
+        (!normals.empty() && normals.size() != 3 * count))
+        return stats;
+
+    WeldTable table(attributes, count, threads);
+    ParallelForBlocks(count, kBlockSize, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++)
+            table.Insert(static_cast<uint32_t>(i));
+    }, threads);
+
+    // Vertices that are the first of their kind keep their order, the others point to that one.
+    std::vector<uint32_t> first_equal(count);
+    std::vector<size_t> block_unique((count + kBlockSize - 1) / kBlockSize);
+    ParallelForBlocks(count, kBlockSize, [&](size_t first, size_t last) {
+        size_t unique = 0;
+        for (size_t i = first; i < last; i++) {
+            first_equal[i] = table.Find(static_cast<uint32_t>(i));
+            unique += (first_equal[i] == i);
+        }
+        block_unique[first / kBlockSize] = unique;
+    }, threads);
+    size_t unique_count = 0;
+    for (auto& unique : block_unique) {
+        const size_t block_first = unique_count;
+        unique_count += unique;
+        unique = block_first;
+    }
+    if (unique_count == count)
+        return stats;
+
+    std::vector<uint32_t> remap(count);
+    ParallelForBlocks(count, kBlockSize, [&](size_t first, size_t last) {
+        uint32_t next = static_cast<uint32_t>(block_unique[first / kBlockSize]);
+        for (size_t i = first; i < last; i++) {
+            if (first_equal[i] == i)
+                remap[i] = next++;
+        }
+    }, threads);
+    ParallelForBlocks(count, kBlockSize, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            if (first_equal[i] != i)
+                remap[i] = remap[first_equal[i]];
+        }
+    }, threads);
+
+    std::vector<float> welded_vertices(3 * unique_count);
+    std::vector<float> welded_uvs(uvs.empty() ? 0 : 2 * unique_count);
+    std::vector<float> welded_normals(normals.empty() ? 0 : 3 * unique_count);
+    ParallelForBlocks(count, kBlockSize, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            if (first_equal[i] != i)
+                continue;
+            std::copy_n(&vertices[3 * i], 3, &welded_vertices[3 * remap[i]]);
+            if (!uvs.empty())
+                std::copy_n(&uvs[2 * i], 2, &welded_uvs[2 * remap[i]]);
+            if (!normals.empty())
+                std::copy_n(&normals[3 * i], 3, &welded_normals[3 * remap[i]]);
+        }
+    }, threads);
+    ParallelForBlocks(indices.size(), kBlockSize, [&](size_t first, size_t last) {
+        for (size_t k = first; k < last; k++)
+            indices[k] = remap[indices[k]];
+    }, threads);
+    vertices.swap(welded_vertices);
+    uvs.swap(welded_uvs);
+    normals.swap(welded_normals);
+
+    stats.vertices_after = unique_count;
+    stats.bytes_after = unique_count * attributes.VertexBytes() + indices.size() * sizeof(unsigned int);
+    return stats;
+}
+
+void ComputeNormals(const std::vector<unsigned int>& indices,
+                    const std::vector<float>& vertices,
+                    std::vector<float>& normals,
+                    size_t threads) {
+    const size_t vertex_count = vertices.size() / 3;
+    const size_t triangle_count = indices.size() / 3;
+    normals.assign(3 * vertex_count, 0.0f);
+    if (vertex_count == 0 || triangle_count == 0)
+        return;
+
+    // Every chunk of triangles sums its face normals into a buffer of its own that only spans
+    // the vertices the chunk uses. Welded or fetch optimized meshes number their vertices in the
+    // order the triangles use them, so the spans of the chunks barely overlap.
+    struct Partial {
+        size_t first{0};
+        size_t last{0};
+        std::vector<float> sums;
+    };
+    const size_t chunk_count = std::max<size_t>(1, std::min(threads, triangle_count / kBlockSize));
+    std::vector<Partial> partials(chunk_count);
+    ParallelFor(chunk_count, [&](size_t chunk) {
+        const size_t begin = 3 * (triangle_count * chunk / chunk_count);
+        const size_t end = 3 * (triangle_count * (chunk + 1) / chunk_count);
+        size_t first = vertex_count, last = 0;
+        for (size_t k = begin; k < end; k++) {
+            if (indices[k] < vertex_count) {
+                first = std::min(first, static_cast<size_t>(indices[k]));
+                last = std::max(last, static_cast<size_t>(indices[k]) + 1);
+            }
+        }
+        if (first >= last)
+            return;
+        Partial& partial = partials[chunk];
+        partial.first = first;
+        partial.last = last;
+        partial.sums.assign(3 * (last - first), 0.0f);
+        for (size_t k = begin; k < end; k += 3) {
+            const unsigned int a = indices[k], b = indices[k + 1], c = indices[k + 2];
+            if (a >= vertex_count || b >= vertex_count || c >= vertex_count)
+                continue;
+            const float* p0 = &vertices[3 * a];
+            const float* p1 = &vertices[3 * b];
+            const float* p2 = &vertices[3 * c];
+            const float e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+            const float e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+            // The cross product is twice the area of the face, larger faces weigh more.
+            const float n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+            for (const unsigned int v : {a, b, c}) {
+                float* sum = &partial.sums[3 * (v - first)];
+                sum[0] += n[0];
+                sum[1] += n[1];
+                sum[2] += n[2];
+            }
+        }
+    }, threads);
+
+    // The chunks are added up in order, so the result only depends on the number of threads.
+    ParallelForBlocks(vertex_count, kNormalBlockSize, [&](size_t first, size_t last) {
+        float x[kNormalBlockSize], y[kNormalBlockSize], z[kNormalBlockSize];
+        const size_t count = last - first;
+        std::fill_n(x, count, 0.0f);
+        std::fill_n(y, count, 0.0f);
+        std::fill_n(z, count, 0.0f);
+        for (const Partial& partial : partials) {
+            const size_t begin = std::max(first, partial.first);
+            const size_t end = std::min(last, partial.last);
+            for (size_t v = begin; v < end; v++) {
+                const float* sum = &partial.sums[3 * (v - partial.first)];
+                x[v - first] += sum[0];
+                y[v - first] += sum[1];
+                z[v - first] += sum[2];
+            }
+        }
+        NormalizeVectors(x, y, z, count);
+        for (size_t i = 0; i < count; i++) {
+            float* normal = &normals[3 * (first + i)];
+            normal[0] = x[i];
+            normal[1] = y[i];
+            normal[2] = z[i];
+        }
+    }, threads);
+}
+
+VertexCacheStats AnalyzeVertexCache(const std::vector<unsigned int>& indices, size_t vertex_count, size_t cache_size) {
+    VertexCacheStats stats;
+    if (indices.empty())
+        return stats;
+    // A vertex is cached if fewer than cache_size misses happened since its own.
+    std::vector<size_t> miss_time(vertex_count, 0);
+    std::vector<bool> used(vertex_count, false);
+    size_t time = cache_size + 1;
+    size_t misses = 0;
+    size_t used_count = 0;
+    for (unsigned int v : indices) {
+        if (time - miss_time[v] > cache_size) {
+            miss_time[v] = time++;
+            misses++;
+        }
+        if (!used[v]) {
+            used[v] = true;
+            used_count++;
+        }
+    }
+    stats.acmr = double(misses) / (indices.size() / 3);
+    stats.atvr = double(misses) / used_count;
+    return stats;
+}
+
+void OptimizeVertexCache(std::vector<unsigned int>& indices, size_t vertex_count) {
+    const size_t triangle_count = indices.size() / 3;
+    if (triangle_count == 0)
+        return;
+
+    // The triangles of every vertex, the first `remaining` of each list are not emitted yet.
+    std::vector<uint32_t> offsets(vertex_count + 1, 0);
+    for (unsigned int v : indices)
+        offsets[v + 1]++;
+    for (size_t v = 0; v < vertex_count; v++)
+        offsets[v + 1] += offsets[v];
+    std::vector<uint32_t> triangles(indices.size());
+    std::vector<uint32_t> remaining(vertex_count, 0);
+    for (size_t t = 0; t < triangle_count; t++) {
+        for (int k = 0; k < 3; k++) {
+            const unsigned int v = indices[3 * t + k];
+            triangles[offsets[v] + remaining[v]++] = static_cast<uint32_t>(t);
+        }
+    }
+
+    std::vector<int> cache_position(vertex_count, -1);
+    std::vector<float> vertex_score(vertex_count);
+    for (size_t v = 0; v < vertex_count; v++)
+        vertex_score[v] = VertexScore(-1, remaining[v]);
+    const auto triangle_score = [&](size_t t) {
+        return vertex_score[indices[3 * t]] + vertex_score[indices[3 * t + 1]] + vertex_score[indices[3 * t + 2]];
+    };
+    int64_t best = 0;
+    for (size_t t = 1; t < triangle_count; t++) {
+        if (triangle_score(t) > triangle_score(best))
+            best = t;
+    }
+
+    std::vector<bool> emitted(triangle_count, false);
+    std::vector<unsigned int> output;
+    output.reserve(indices.size());
+    std::vector<unsigned int> cache, next_cache;
+    size_t cursor = 0;
+    while (output.size() < indices.size()) {
+        // No cached vertex has triangles left, continue with the next one in file order.
+        if (best < 0) {
+            while (emitted[cursor])
+                cursor++;
+            best = cursor;
+        }
+        emitted[best] = true;
+        next_cache.clear();
+        for (int k = 0; k < 3; k++) {
+            const unsigned int v = indices[3 * best + k];
+            output.push_back(v);
+            uint32_t* list = &triangles[offsets[v]];
+            std::swap(*std::find(list, list + remaining[v], static_cast<uint32_t>(best)), list[remaining[v] - 1]);
+            remaining[v]--;
+            if (std::find(next_cache.begin(), next_cache.end(), v) == next_cache.end())
+                next_cache.push_back(v);
+        }
+        // The triangle's vertices move to the front of the LRU cache and push the oldest out.
+        const size_t fresh = next_cache.size();
+        for (unsigned int v : cache) {
+            if (std::find(next_cache.begin(), next_cache.begin() + fresh, v) == next_cache.begin() + fresh)
+                next_cache.push_back(v);
+        }
+        for (size_t i = 0; i < next_cache.size(); i++) {
+            const unsigned int v = next_cache[i];
+            cache_position[v] = (i < kVertexCacheSize) ? static_cast<int>(i) : -1;
+            vertex_score[v] = VertexScore(cache_position[v], remaining[v]);
+        }
+        // Only triangles of vertices whose score changed can be the best one now.
+        best = -1;
+        float best_score = -1.0f;
+        for (unsigned int v : next_cache) {
+            for (uint32_t i = 0; i < remaining[v]; i++) {
+                const uint32_t t = triangles[offsets[v] + i];
+                const float score = triangle_score(t);
+                if (score > best_score) {
+                    best_score = score;
+                    best = t;
+                }
+            }
+        }
+        next_cache.resize(std::min(next_cache.size(), kVertexCacheSize));
+        cache.swap(next_cache);
+    }
+    indices.swap(output);
+}
+
+void OptimizeVertexCache(Mesh& mesh) {
+    // Every part is optimized on its own vertices, numbered from 0, so that the work of a part
+    // does not grow with the vertices of the whole mesh. `local` is reset after each part.
+    std::vector<unsigned int> local(mesh.vertices.size() / 3, std::numeric_limits<unsigned int>::max());
+    std::vector<unsigned int> global;
+    std::vector<unsigned int> part;
+    for (const SubMesh& submesh : mesh.submeshes) {
+        global.clear();
+        part.resize(submesh.count);
+        for (size_t i = 0; i < submesh.count; i++) {
+            const unsigned int v = mesh.indices[submesh.first + i];
+            if (local[v] == std::numeric_limits<unsigned int>::max()) {
+                local[v] = static_cast<unsigned int>(global.size());
+                global.push_back(v);
+            }
+            part[i] = local[v];
+        }
+        OptimizeVertexCache(part, global.size());
+        for (size_t i = 0; i < submesh.count; i++)
+            mesh.indices[submesh.first + i] = global[part[i]];
+        for (unsigned int v : global)
+            local[v] = std::numeric_limits<unsigned int>::max();
+    }
+}
+
+void OptimizeVertexFetch(std::vector<unsigned int>& indices,
+                         std::vector<float>& vertices,
+                         std::vector<float>& uvs,
+                         std::vector<float>& normals) {
+    const size_t count = vertices.size() / 3;
+    std::vector<uint32_t> remap(count, kEmptySlot);
+    uint32_t next = 0;
+    for (auto& v : indices) {
+        if (remap[v] == kEmptySlot)
+            remap[v] = next++;
+        v = remap[v];
+    }
+    std::vector<float> fetch_vertices(3 * next);
+    std::vector<float> fetch_uvs(uvs.size() == 2 * count ? 2 * next : 0);
+    std::vector<float> fetch_normals(normals.size() == 3 * count ? 3 * next : 0);
+    for (size_t v = 0; v < count; v++) {
+        if (remap[v] == kEmptySlot)
+            continue;
+        std::copy_n(&vertices[3 * v], 3, &fetch_vertices[3 * remap[v]]);
+        if (!fetch_uvs.empty())
+            std::copy_n(&uvs[2 * v], 2, &fetch_uvs[2 * remap[v]]);
+        if (!fetch_normals.empty())
+            std::copy_n(&normals[3 * v], 3, &fetch_normals[3 * remap[v]]);
+    }
+    vertices.swap(fetch_vertices);
+    uvs.swap(fetch_uvs);
+    normals.swap(fetch_normals);
+}
+
+void SortByMaterial(Mesh& mesh) {
+    std::vector<SubMesh> sorted = mesh.submeshes;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const SubMesh& a, const SubMesh& b) {
+        return a.material < b.material;
+    });
+    std::vector<unsigned int> indices;
+    indices.reserve(mesh.indices.size());
+    for (SubMesh& submesh : sorted) {
+        const size_t first = indices.size();
+        indices.insert(indices.end(), mesh.indices.begin() + submesh.first, mesh.indices.begin() + submesh.first + submesh.count);
+        submesh.first = first;
+    }
+    mesh.indices.swap(indices);
+    mesh.submeshes.swap(sorted);
+}
+
+std::vector<SubMesh> MaterialBatches(const Mesh& mesh) {
+    std::vector<SubMesh> batches;
+    for (const SubMesh& submesh : mesh.submeshes) {
+        if (submesh.count == 0)
+            continue;
+        if (!batches.empty() && batches.back().material == submesh.material &&
+            batches.back().first + batches.back().count == submesh.first)
+            batches.back().count += submesh.count;
+        else
+            batches.push_back(submesh);
+    }
+    return batches;
+}
+
+std::vector<float> VertexBatchIds(Mesh& mesh, const std::vector<SubMesh>& batches) {
+    std::vector<float> ids(mesh.vertices.size() / 3, -1.0f);
+    for (size_t b = 0; b < batches.size(); b++) {
+        const float id = static_cast<float>(b);
+        // Copies of vertices already claimed by an earlier batch.
+        std::unordered_map<unsigned int, unsigned int> copies;
+        for (size_t i = batches[b].first; i < batches[b].first + batches[b].count; i++) {
+            unsigned int& index = mesh.indices[i];
+            if (ids[index] < 0.0f) {
+                ids[index] = id;
+                continue;
+            }
+            if (ids[index] == id)
+                continue;
+            auto copy = copies.find(index);
+            if (copy == copies.end()) {
+                const unsigned int vertex = index;
+                for (int k = 0; k < 3; k++)
+                    mesh.vertices.push_back(mesh.vertices[3 * vertex + k]);
+                for (int k = 0; k < 2 && !mesh.uvs.empty(); k++)
+                    mesh.uvs.push_back(mesh.uvs[2 * vertex + k]);
+                for (int k = 0; k < 3 && !mesh.normals.empty(); k++)
+                    mesh.normals.push_back(mesh.normals[3 * vertex + k]);
+                copy = copies.emplace(vertex, static_cast<unsigned int>(ids.size())).first;
+                ids.push_back(id);
+            }
+            index = copy->second;
+        }
+    }
+    // Vertices no triangle uses.
+    std::replace(ids.begin(), ids.end(), -1.0f, 0.0f);
+    return ids;
+}
+
+};
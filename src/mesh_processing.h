@@ -0,0 +1,107 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_MESH_PROCESSING_
+#define _H_MESH_PROCESSING_
+
+#include <string>
+#include <vector>
+
+#include "parallel.h"
+
+namespace C3DV_graphics {
+
+struct Material {
+    std::string texture;            // diffuse texture file, empty if there is none
+    float diffuse[3]{1.0f, 1.0f, 1.0f};
+};
+
+// Consecutive indices of a mesh part that are drawn with one material.
+struct SubMesh {
+    size_t first;
+    size_t count;
+    size_t material;
+};
+
+// Indexed triangles of a whole scene, all parts share the vertex and index buffers.
+struct Mesh {
+    std::vector<unsigned int> indices;
+    std::vector<float> vertices;
+    std::vector<float> uvs;         // empty if no part has texture coordinates
+    std::vector<float> normals;     // empty if no part has normals
+    std::vector<SubMesh> submeshes;
+    std::vector<Material> materials;
+};
+
+// Vertex count and GPU memory (vertex attributes and indices) before and after a pass.
+struct MeshStats {
+    size_t vertices_before{0};
+    size_t vertices_after{0};
+    size_t bytes_before{0};
+    size_t bytes_after{0};
+    std::string ToString() const;
+};
+
+// Transformed vertices per triangle (ACMR, 0.5 at best, 3 at worst) and per vertex (ATVR, 1 at
+// best) of a simulated FIFO post-transform cache.
+struct VertexCacheStats {
+    double acmr{0};
+    double atvr{0};
+    std::string ToString() const;
+};
+
+// Size of the simulated post-transform cache, also what OptimizeVertexCache optimizes for.
+constexpr size_t kVertexCacheSize = 32;
+
+// Merges vertices whose position, uv and normal are bitwise equal and remaps the indices.
+// uvs and normals may be empty. Runs on `threads` threads with a shared open-addressing table;
+// the unique vertices keep the order of their first occurrence, so the result is the same for
+// any number of threads.
+MeshStats WeldVertices(std::vector<unsigned int>& indices,
+                       std::vector<float>& vertices,
+                       std::vector<float>& uvs,
+                       std::vector<float>& normals,
+                       size_t threads = WorkerCount());
+
+// Smooth normals of an indexed mesh: the face normals around every vertex weighted by the area
+// of the faces, normalized. Vertices no face uses get zero normals. The faces are split over
+// `threads` threads that sum into buffers of their own, no atomics.
+void ComputeNormals(const std::vector<unsigned int>& indices,
+                    const std::vector<float>& vertices,
+                    std::vector<float>& normals,
+                    size_t threads = WorkerCount());
+
+VertexCacheStats AnalyzeVertexCache(const std::vector<unsigned int>& indices, size_t vertex_count, size_t cache_size = kVertexCacheSize);
+
+// Reorders the triangles for post-transform cache hits (Tom Forsyth, "Linear-Speed Vertex Cache
+// Optimisation"): the next triangle is the best scored one among those using cached vertices.
+void OptimizeVertexCache(std::vector<unsigned int>& indices, size_t vertex_count);
+
+// Runs OptimizeVertexCache on every part, triangles never move between parts.
+void OptimizeVertexCache(Mesh& mesh);
+
+// Renumbers the vertices in the order the triangles first use them, so vertex fetches run through
+// the buffers front to back. Vertices no triangle uses are dropped.
+void OptimizeVertexFetch(std::vector<unsigned int>& indices,
+                         std::vector<float>& vertices,
+                         std::vector<float>& uvs,
+                         std::vector<float>& normals);
+
+// Moves the parts of each material next to each other in the index buffer (stable, parts keep
+// their order within a material).
+void SortByMaterial(Mesh& mesh);
+// Merges consecutive parts with the same material, one draw call and texture bind each.
+std::vector<SubMesh> MaterialBatches(const Mesh& mesh);
+// Batch index of every vertex, so that all batches can be drawn in one call. Vertices used by
+// several batches are copied to the end of the buffers for all but the first batch.
+std::vector<float> VertexBatchIds(Mesh& mesh, const std::vector<SubMesh>& batches);
+
+};
+
+#endif  // _H_MESH_PROCESSING_
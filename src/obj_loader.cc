@@ -0,0 +1,503 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#include "obj_loader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+#include "tinyply.h"
+
+namespace C3DV_graphics {
+
+namespace {
+
+// Smaller files are parsed as one chunk, splitting them costs more than it saves.
+constexpr size_t kMinChunkSize = 1 << 20;
+// Vertices and indices are written in blocks of this many entries.
+constexpr size_t kBlockSize = 1 << 16;
+
+// One face corner, 0-based indices and -1 for a missing vt or vn.
+struct Corner {
+    int v;
+    int vt;
+    int vn;
+    bool operator==(const Corner& other) const {
+        return v == other.v && vt == other.vt && vn == other.vn;
+    }
+};
+
+struct CornerHash {
+    size_t operator()(const Corner& corner) const {
+        const uint64_t key = static_cast<uint64_t>(static_cast<uint32_t>(corner.v)) * 0x9E3779B97F4A7C15ull ^
+                             static_cast<uint64_t>(static_cast<uint32_t>(corner.vt)) << 32 ^
+                             static_cast<uint32_t>(corner.vn);
+        return std::hash<uint64_t>()(key);
+    }
+};
+
+typedef std::unordered_map<Corner, uint32_t, CornerHash> CornerMap;
+
+// vt and vn of a corner in one word, for checking whether every position has only one pair.
+constexpr uint64_t kNoAttributes = ~uint64_t(0) - 1;
+
+inline uint64_t PackAttributes(const Corner& corner) {
+    return static_cast<uint64_t>(static_cast<uint32_t>(corner.vt)) << 32 | static_cast<uint32_t>(corner.vn);
+}
+
+// Everything one chunk of lines contributes. Negative indices count back from the line they are
+// on, they can only be resolved once the number of vertices in the earlier chunks is known.
+struct ObjChunk {
+    std::vector<float> positions;
+    std::vector<float> texcoords;
+    std::vector<float> normals;
+    std::vector<Corner> corners;        // three per triangle
+    std::vector<size_t> relative;       // 3 * corner + component of every negative index
+    std::vector<std::pair<size_t, std::string>> materials;  // usemtl and the corner it starts at
+    std::vector<std::string> material_files;
+    bool has_texcoords{false};
+    bool has_normals{false};
+    bool valid{true};
+    // Distinct corners of the chunk and the index of every corner into them.
+    std::vector<Corner> unique;
+    std::vector<uint32_t> local_indices;
+};
+
+inline bool IsSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+inline const char* SkipSpace(const char* p, const char* end) {
+    while (p < end && IsSpace(*p))
+        p++;
+    return p;
+}
+
+// The rest of a line without surrounding white space.
+std::string ParseName(const char* p, const char* end) {
+    p = SkipSpace(p, end);
+    while (end > p && (IsSpace(end[-1]) || end[-1] == '\r'))
+        end--;
+    return std::string(p, end);
+}
+
+// Appends `count` numbers, missing ones are 0.
+void ParseReals(const char* p, const char* end, size_t count, std::vector<float>& out) {
+    for (size_t i = 0; i < count; i++) {
+        p = SkipSpace(p, end);
+        const char* token_end = p;
+        while (token_end < end && !IsSpace(*token_end) && *token_end != '\r')
+            token_end++;
+        double value = 0.0;
+        tinyobj::tryParseDouble(p, token_end, &value);
+        out.push_back(static_cast<float>(value));
+        p = token_end;
+    }
+}
+
+inline bool ParseInt(const char*& p, const char* end, int& value) {
+    const bool negative = (p < end && *p == '-');
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+    if (p >= end || !std::isdigit(static_cast<unsigned char>(*p)))
+        return false;
+    int result = 0;
+    while (p < end && std::isdigit(static_cast<unsigned char>(*p)))
+        result = 10 * result + (*p++ - '0');
+    value = negative ? -result : result;
+    return true;
+}
+
+// Makes a 1-based or negative OBJ index 0-based, negative ones relative to the chunk.
+inline bool ResolveIndex(int index, size_t count, int& out, bool& relative) {
+    if (index == 0)
+        return false;
+    relative = (index < 0);
+    out = relative ? static_cast<int>(count) + index : index - 1;
+    return true;
+}
+
+// Parses the corners of one "f" line ("v", "v/vt", "v//vn" or "v/vt/vn") and adds the fan.
+bool ParseFace(const char* p, const char* end, ObjChunk& chunk, std::vector<Corner>& polygon, std::vector<uint8_t>& masks) {
+    polygon.clear();
+    masks.clear();
+    const size_t counts[3] = { chunk.positions.size() / 3, chunk.texcoords.size() / 2, chunk.normals.size() / 3 };
+    while ((p = SkipSpace(p, end)) < end && *p != '\r') {
+        Corner corner{-1, -1, -1};
+        int* components[3] = { &corner.v, &corner.vt, &corner.vn };
+        uint8_t mask = 0;
+        for (int k = 0; k < 3; k++) {
+            if (k > 0) {
+                if (p >= end || *p != '/')
+                    break;
+                p++;
+                // "v//vn" has no texture coordinate.
+                if (k == 1 && p < end && *p == '/')
+                    continue;
+            }
+            int index = 0;
+            bool relative = false;
+            if (!ParseInt(p, end, index) || !ResolveIndex(index, counts[k], *components[k], relative))
+                return false;
+            mask |= relative ? (1 << k) : 0;
+        }
+        if (p < end && !IsSpace(*p) && *p != '\r')
+            return false;
+        chunk.has_texcoords |= (corner.vt >= 0 || (mask & 2));
+        chunk.has_normals |= (corner.vn >= 0 || (mask & 4));
+        polygon.push_back(corner);
+        masks.push_back(mask);
+    }
+    for (size_t i = 1; i + 1 < polygon.size(); i++) {
+        for (size_t j : { size_t(0), i, i + 1 }) {
+            for (int k = 0; k < 3; k++) {
+                if (masks[j] & (1 << k))
+                    chunk.relative.push_back(3 * chunk.corners.size() + k);
+            }
+            chunk.corners.push_back(polygon[j]);
+        }
+    }
+    return true;
+}
+
+void ParseChunk(const char* begin, const char* end, ObjChunk& chunk) {
+    std::vector<Corner> polygon;
+    std::vector<uint8_t> masks;
+    for (const char* line = begin; line < end;) {
+        const char* line_end = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (line_end == nullptr)
+            line_end = end;
+        const char* p = SkipSpace(line, line_end);
+        const size_t length = line_end - p;
+        if (length >= 2 && p[0] == 'v' && IsSpace(p[1]))
+            ParseReals(p + 2, line_end, 3, chunk.positions);
+        else if (length >= 3 && p[0] == 'v' && p[1] == 't' && IsSpace(p[2]))
+            ParseReals(p + 3, line_end, 2, chunk.texcoords);
+        else if (length >= 3 && p[0] == 'v' && p[1] == 'n' && IsSpace(p[2]))
+            ParseReals(p + 3, line_end, 3, chunk.normals);
+        else if (length >= 2 && p[0] == 'f' && IsSpace(p[1]) && !ParseFace(p + 2, line_end, chunk, polygon, masks))
+            chunk.valid = false;
+        else if (length >= 7 && std::strncmp(p, "usemtl", 6) == 0 && IsSpace(p[6]))
+            chunk.materials.emplace_back(chunk.corners.size(), ParseName(p + 7, line_end));
+        else if (length >= 7 && std::strncmp(p, "mtllib", 6) == 0 && IsSpace(p[6])) {
+            std::istringstream files(ParseName(p + 7, line_end));
+            std::string file;
+            while (files >> file)
+                chunk.material_files.push_back(file);
+        }
+        line = line_end + 1;
+    }
+}
+
+std::string Directory(const std::string& path) {
+    const size_t slash = path.find_last_of("/\\");
+    return (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+}
+
+// Reads the mtllib files of an OBJ (relative to it) with tinyobj, textures become relative to the OBJ too.
+void LoadMaterialLibraries(const std::string& path, const std::vector<std::string>& files,
+                           std::map<std::string, int>& material_ids, std::vector<Material>& converted) {
+    const std::string directory = Directory(path);
+    std::vector<tinyobj::material_t> materials;
+    for (const std::string& file : files) {
+        std::ifstream stream(directory + file);
+        std::string warning;
+        if (stream.good())
+            tinyobj::LoadMtl(&material_ids, &materials, &stream, &warning);
+        else
+            std::cout << path << ": material file " << file << " not found" << std::endl;
+    }
+    converted.clear();
+    for (const tinyobj::material_t& material : materials) {
+        Material result;
+        if (!material.diffuse_texname.empty())
+            result.texture = directory + material.diffuse_texname;
+        std::copy_n(material.diffuse, 3, result.diffuse);
+        converted.push_back(result);
+    }
+}
+
+// Splits the faces into parts at every usemtl and reads the materials they name.
+void BuildSubMeshes(const std::string& path, const std::vector<ObjChunk>& chunks, const std::vector<size_t>& corner_base,
+                    size_t corner_count, Mesh& mesh) {
+    std::vector<std::string> files;
+    for (const ObjChunk& chunk : chunks)
+        files.insert(files.end(), chunk.material_files.begin(), chunk.material_files.end());
+    std::map<std::string, int> material_ids;
+    LoadMaterialLibraries(path, files, material_ids, mesh.materials);
+    // Faces before the first usemtl and with unknown materials get a default one.
+    const auto material_index = [&](const std::string& name) {
+        const auto found = material_ids.find(name);
+        if (found != material_ids.end())
+            return static_cast<size_t>(found->second);
+        material_ids[name] = static_cast<int>(mesh.materials.size());
+        mesh.materials.push_back(Material());
+        return mesh.materials.size() - 1;
+    };
+
+    mesh.submeshes.clear();
+    size_t first = 0;
+    size_t material = material_index("");
+    for (size_t c = 0; c < chunks.size(); c++) {
+        for (const auto& use : chunks[c].materials) {
+            const size_t corner = corner_base[c] + use.first;
+            if (corner > first)
+                mesh.submeshes.push_back(SubMesh{first, corner - first, material});
+            first = corner;
+            material = material_index(use.second);
+        }
+    }
+    if (corner_count > first)
+        mesh.submeshes.push_back(SubMesh{first, corner_count - first, material});
+}
+
+}  // namespace
+
+bool IsObjFile(const std::string& path) {
+    if (path.size() < 4)
+        return false;
+    std::string extension = path.substr(path.size() - 4);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".obj";
+}
+
+std::vector<std::string> ObjTextureFiles(const std::string& path) {
+    std::unique_ptr<tinyply::MappedFile> mapping;
+    try {
+        mapping.reset(new tinyply::MappedFile(path));
+    } catch (const std::exception& e) {
+        return {};
+    }
+    const char* data = reinterpret_cast<const char*>(mapping->data());
+    const char* end = data + mapping->size();
+    // Only lines starting with "mtllib" are looked at, 'm' is rare in the rest of an OBJ.
+    std::vector<std::string> files;
+    for (const char* p = data; p < end; p++) {
+        p = static_cast<const char*>(std::memchr(p, 'm', end - p));
+        if (p == nullptr)
+            break;
+        if ((p == data || p[-1] == '\n') && end - p > 7 && std::strncmp(p, "mtllib", 6) == 0 && IsSpace(p[6])) {
+            const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            std::istringstream names(ParseName(p + 7, line_end ? line_end : end));
+            std::string file;
+            while (names >> file)
+                files.push_back(file);
+        }
+    }
+    std::map<std::string, int> material_ids;
+    std::vector<Material> materials;
+    LoadMaterialLibraries(path, files, material_ids, materials);
+    std::vector<std::string> textures;
+    for (const Material& material : materials) {
+        if (!material.texture.empty() && std::find(textures.begin(), textures.end(), material.texture) == textures.end())
+            textures.push_back(material.texture);
+    }
+    return textures;
+}
+
+bool LoadObj(const std::string& path, Mesh& mesh, size_t threads) {
+    std::unique_ptr<tinyply::MappedFile> mapping;
+    try {
+        mapping.reset(new tinyply::MappedFile(path));
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl;
+        return false;
+    }
+    const char* data = reinterpret_cast<const char*>(mapping->data());
+    const size_t size = mapping->size();
+
+    // Chunk boundaries are moved forward to the next line start.
+    const size_t chunk_count = std::max<size_t>(1, std::min(size / kMinChunkSize, 4 * threads));
+    std::vector<size_t> bounds(chunk_count + 1, size);
+    bounds[0] = 0;
+    for (size_t c = 1; c < chunk_count; c++) {
+        const size_t start = std::max(size / chunk_count * c, bounds[c - 1]);
+        const void* newline = std::memchr(data + start, '\n', size - start);
+        bounds[c] = (newline == nullptr) ? size : static_cast<const char*>(newline) - data + 1;
+    }
+    std::vector<ObjChunk> chunks(chunk_count);
+    ParallelFor(chunk_count, [&](size_t c) {
+        ParseChunk(data + bounds[c], data + bounds[c + 1], chunks[c]);
+    }, threads);
+
+    // Where every chunk starts in the merged arrays.
+    std::vector<size_t> v_base(chunk_count), vt_base(chunk_count), vn_base(chunk_count), corner_base(chunk_count);
+    size_t v_count = 0, vt_count = 0, vn_count = 0, corner_count = 0;
+    bool has_texcoords = false;
+    bool has_normals = false;
+    for (size_t c = 0; c < chunk_count; c++) {
+        if (!chunks[c].valid) {
+            std::cout << path << ": invalid face" << std::endl;
+            return false;
+        }
+        v_base[c] = v_count;
+        vt_base[c] = vt_count;
+        vn_base[c] = vn_count;
+        corner_base[c] = corner_count;
+        v_count += chunks[c].positions.size() / 3;
+        vt_count += chunks[c].texcoords.size() / 2;
+        vn_count += chunks[c].normals.size() / 3;
+        corner_count += chunks[c].corners.size();
+        has_texcoords |= chunks[c].has_texcoords;
+        has_normals |= chunks[c].has_normals;
+    }
+    if (corner_count == 0) {
+        std::cout << path << ": no faces" << std::endl;
+        return false;
+    }
+
+    std::atomic<bool> valid{true};
+    std::vector<float> positions(3 * v_count), texcoords(2 * vt_count), vertex_normals(3 * vn_count);
+    ParallelFor(chunk_count, [&](size_t c) {
+        ObjChunk& chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + 3 * v_base[c]);
+        std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), texcoords.begin() + 2 * vt_base[c]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), vertex_normals.begin() + 3 * vn_base[c]);
+        const size_t bases[3] = { v_base[c], vt_base[c], vn_base[c] };
+        for (size_t r : chunk.relative) {
+            Corner& corner = chunk.corners[r / 3];
+            int* components[3] = { &corner.v, &corner.vt, &corner.vn };
+            *components[r % 3] += static_cast<int>(bases[r % 3]);
+            if (*components[r % 3] < 0)
+                valid = false;
+        }
+        for (const Corner& corner : chunk.corners) {
+            if (corner.v < 0 || corner.v >= static_cast<int>(v_count) ||
+                corner.vt >= static_cast<int>(vt_count) || corner.vn >= static_cast<int>(vn_count))
+                valid = false;
+        }
+    }, threads);
+    if (!valid) {
+        std::cout << path << ": face index out of range" << std::endl;
+        return false;
+    }
+
+    BuildSubMeshes(path, chunks, corner_base, corner_count, mesh);
+    std::vector<unsigned int>& indices = mesh.indices;
+    std::vector<float>& vertices = mesh.vertices;
+    std::vector<float>& uvs = mesh.uvs;
+    std::vector<float>& normals = mesh.normals;
+    indices.resize(corner_count);
+    uvs.clear();
+    normals.clear();
+    // Faces with positions only index the vertices directly.
+    if (!has_texcoords && !has_normals) {
+        ParallelFor(chunk_count, [&](size_t c) {
+            for (size_t k = 0; k < chunks[c].corners.size(); k++)
+                indices[corner_base[c] + k] = static_cast<unsigned int>(chunks[c].corners[k].v);
+        }, threads);
+        vertices.swap(positions);
+        return true;
+    }
+
+    // Exporters often pair every position with one texture coordinate and normal (e.g. "f 1/1/1"),
+    // then the positions are the vertices and no corners have to be merged.
+    std::unique_ptr<std::atomic<uint64_t>[]> attributes(new std::atomic<uint64_t>[v_count]);
+    ParallelForBlocks(v_count, kBlockSize, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++)
+            attributes[i].store(kNoAttributes, std::memory_order_relaxed);
+    }, threads);
+    std::atomic<bool> shared_positions{true};
+    ParallelFor(chunk_count, [&](size_t c) {
+        for (const Corner& corner : chunks[c].corners) {
+            uint64_t expected = kNoAttributes;
+            const uint64_t packed = PackAttributes(corner);
+            if (!attributes[corner.v].compare_exchange_strong(expected, packed, std::memory_order_relaxed) && expected != packed) {
+                shared_positions = false;
+                return;
+            }
+        }
+    }, threads);
+    if (shared_positions) {
+        ParallelFor(chunk_count, [&](size_t c) {
+            for (size_t k = 0; k < chunks[c].corners.size(); k++)
+                indices[corner_base[c] + k] = static_cast<unsigned int>(chunks[c].corners[k].v);
+        }, threads);
+        if (has_texcoords)
+            uvs.assign(2 * v_count, 0.0f);
+        if (has_normals)
+            normals.assign(3 * v_count, 0.0f);
+        ParallelForBlocks(v_count, kBlockSize, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                const uint64_t packed = attributes[i].load(std::memory_order_relaxed);
+                if (packed == kNoAttributes)
+                    continue;
+                const int vt = static_cast<int32_t>(packed >> 32);
+                const int vn = static_cast<int32_t>(packed & 0xFFFFFFFFu);
+                if (has_texcoords && vt >= 0)
+                    std::copy_n(&texcoords[2 * vt], 2, &uvs[2 * i]);
+                if (has_normals && vn >= 0)
+                    std::copy_n(&vertex_normals[3 * vn], 3, &normals[3 * i]);
+            }
+        }, threads);
+        vertices.swap(positions);
+        return true;
+    }
+    attributes.reset();
+
+    // Otherwise distinct corners are found per chunk in parallel, only those are merged on one thread.
+    ParallelFor(chunk_count, [&](size_t c) {
+        ObjChunk& chunk = chunks[c];
+        CornerMap local;
+        local.reserve(chunk.corners.size() / 3);
+        chunk.local_indices.resize(chunk.corners.size());
+        for (size_t k = 0; k < chunk.corners.size(); k++) {
+            const auto entry = local.emplace(chunk.corners[k], static_cast<uint32_t>(chunk.unique.size()));
+            if (entry.second)
+                chunk.unique.push_back(chunk.corners[k]);
+            chunk.local_indices[k] = entry.first->second;
+        }
+        std::vector<Corner>().swap(chunk.corners);
+    }, threads);
+    CornerMap global;
+    std::vector<Corner> unique;
+    std::vector<std::vector<uint32_t>> remap(chunk_count);
+    for (size_t c = 0; c < chunk_count; c++) {
+        remap[c].resize(chunks[c].unique.size());
+        for (size_t j = 0; j < chunks[c].unique.size(); j++) {
+            const auto entry = global.emplace(chunks[c].unique[j], static_cast<uint32_t>(unique.size()));
+            if (entry.second)
+                unique.push_back(chunks[c].unique[j]);
+            remap[c][j] = entry.first->second;
+        }
+    }
+    ParallelFor(chunk_count, [&](size_t c) {
+        for (size_t k = 0; k < chunks[c].local_indices.size(); k++)
+            indices[corner_base[c] + k] = remap[c][chunks[c].local_indices[k]];
+    }, threads);
+
+    vertices.resize(3 * unique.size());
+    if (has_texcoords)
+        uvs.assign(2 * unique.size(), 0.0f);
+    if (has_normals)
+        normals.assign(3 * unique.size(), 0.0f);
+    ParallelForBlocks(unique.size(), kBlockSize, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            const Corner& corner = unique[i];
+            std::copy_n(&positions[3 * corner.v], 3, &vertices[3 * i]);
+            if (has_texcoords && corner.vt >= 0)
+                std::copy_n(&texcoords[2 * corner.vt], 2, &uvs[2 * i]);
+            if (has_normals && corner.vn >= 0)
+                std::copy_n(&vertex_normals[3 * corner.vn], 3, &normals[3 * i]);
+        }
+    }, threads);
+    return true;
+}
+
+};
@@ -0,0 +1,37 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_OBJ_LOADER_
+#define _H_OBJ_LOADER_
+
+#include <string>
+#include <vector>
+
+#include "mesh_processing.h"
+#include "parallel.h"
+
+namespace C3DV_graphics {
+
+// True for .obj files, which LoadObj reads without Assimp.
+bool IsObjFile(const std::string& path);
+
+// Reads a Wavefront OBJ like loadAssImp. The mapped file is split into line-aligned chunks
+// that are parsed on `threads` threads. Polygons are triangulated as fans and every distinct
+// v/vt/vn combination becomes one vertex; uvs and normals stay empty if the faces have none.
+// Every usemtl starts a new part, materials come from the mtllib files (read with tinyobj).
+// Groups and other statements are ignored.
+bool LoadObj(const std::string& path, Mesh& mesh, size_t threads = WorkerCount());
+
+// The diffuse textures of the materials in the mtllib files of an OBJ. The file is only scanned
+// for mtllib lines, so the textures can be read while LoadObj parses the same file.
+std::vector<std::string> ObjTextureFiles(const std::string& path);
+
+};
+
+#endif  // _H_OBJ_LOADER_
@@ -0,0 +1,54 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_PARALLEL_
+#define _H_PARALLEL_
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace C3DV_graphics {
+
+inline size_t WorkerCount() {
+    const unsigned int threads = std::thread::hardware_concurrency();
+    return (threads == 0) ? 1 : threads;
+}
+
+// Calls fn(i) for every i in [0, count) on up to `threads` threads (the caller is one of them).
+// Items are handed out one at a time, so uneven items (e.g. tiles of different size) balance out.
+// fn must not throw.
+template<typename F>
+void ParallelFor(size_t count, const F& fn, size_t threads = WorkerCount()) {
+    threads = std::min(threads, count);
+    std::atomic<size_t> next{0};
+    const auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++)
+            fn(i);
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+        thread.join();
+}
+
+// Calls fn(first, last) for consecutive blocks of `block_size` items of [0, count) in parallel.
+template<typename F>
+void ParallelForBlocks(size_t count, size_t block_size, const F& fn, size_t threads = WorkerCount()) {
+    ParallelFor((count + block_size - 1) / block_size, [&](size_t block) {
+        fn(block * block_size, std::min(count, (block + 1) * block_size));
+    }, threads);
+}
+
+};
+
+#endif  // _H_PARALLEL_
@@ -0,0 +1,210 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#include "scene_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#include <sys/stat.h>
+
+namespace C3DV_cache {
+
+namespace {
+
+constexpr uint64_t kAlignment = 64;
+
+bool StatSource(const std::string& source, uint64_t& size, int64_t& mtime) {
+    struct stat st;
+    if (stat(source.c_str(), &st) != 0)
+        return false;
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtime);
+    return true;
+}
+
+void CopyName(char (&dest)[32], const std::string& name) {
+    std::memset(dest, 0, sizeof(dest));
+    std::strncpy(dest, name.c_str(), sizeof(dest) - 1);
+}
+
+}  // namespace
+
+std::string CachePath(const std::string& source, const std::string& kind) {
+    return source + "." + kind + ".c3dv";
+}
+
+bool SceneCache::Open(const std::string& path, const std::string& source) {
+    uint64_t source_size = 0;
+    int64_t source_mtime = 0;
+    if (!StatSource(source, source_size, source_mtime) || !std::ifstream(path).good())
+        return false;
+    try {
+        mapping_ = std::make_shared<tinyply::MappedFile>(path);
+    } catch (const std::exception& e) {
+        return false;
+    }
+    const uint8_t* data = mapping_->data();
+    const uint64_t size = mapping_->size();
+    if (size < sizeof(CacheHeader))
+        return false;
+    std::memcpy(&header_, data, sizeof(CacheHeader));
+    if (std::memcmp(header_.magic, "C3DV", 4) != 0 || header_.version != kCacheVersion ||
+        header_.source_size != source_size || header_.source_mtime != source_mtime)
+        return false;
+
+    const uint64_t table_size = header_.buffer_count * sizeof(CacheBuffer) + header_.attrib_count * sizeof(CacheAttrib);
+    if (header_.table_offset > size || table_size > size - header_.table_offset)
+        return false;
+    buffers_.resize(header_.buffer_count);
+    attribs_.resize(header_.attrib_count);
+    std::memcpy(buffers_.data(), data + header_.table_offset, buffers_.size() * sizeof(CacheBuffer));
+    std::memcpy(attribs_.data(), data + header_.table_offset + buffers_.size() * sizeof(CacheBuffer), attribs_.size() * sizeof(CacheAttrib));
+    for (auto& buffer : buffers_) {
+        buffer.name[sizeof(buffer.name) - 1] = '\0';
+        if (buffer.offset > size || buffer.size > size - buffer.offset)
+            return false;
+    }
+    for (auto& attrib : attribs_) {
+        attrib.name[sizeof(attrib.name) - 1] = '\0';
+        if (attrib.buffer >= buffers_.size())
+            return false;
+    }
+    return true;
+}
+
+int SceneCache::FindBuffer(const std::string& name) const {
+    for (size_t i = 0; i < buffers_.size(); i++) {
+        if (name == buffers_[i].name)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+SceneCacheWriter::SceneCacheWriter(const std::string& path, const std::string& source):
+    path_(path), temp_path_(path + ".tmp") {
+    std::memset(&header_, 0, sizeof(header_));
+    std::memcpy(header_.magic, "C3DV", 4);
+    header_.version = kCacheVersion;
+    std::fill(header_.bounds_min, header_.bounds_min + 3, std::numeric_limits<float>::max());
+    std::fill(header_.bounds_max, header_.bounds_max + 3, std::numeric_limits<float>::lowest());
+    if (!StatSource(source, header_.source_size, header_.source_mtime))
+        return;
+    file_.open(temp_path_, std::ios::binary | std::ios::trunc);
+    if (!file_.good()) {
+        std::cout << "could not write cache " << temp_path_ << std::endl;
+        return;
+    }
+    file_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    end_ = sizeof(header_);
+}
+
+SceneCacheWriter::~SceneCacheWriter() {
+    if (file_.is_open())
+        file_.close();
+    if (!finished_)
+        std::remove(temp_path_.c_str());
+}
+
+int SceneCacheWriter::FindBuffer(const std::string& name) const {
+    for (size_t i = 0; i < buffers_.size(); i++) {
+        if (name == buffers_[i].name)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+void SceneCacheWriter::AddBuffer(const std::string& name, const void* data, size_t size) {
+    if (!good())
+        return;
+    // A buffer that is uploaded again gets a new region, the old one is left unused.
+    int index = FindBuffer(name);
+    if (index < 0) {
+        buffers_.emplace_back();
+        index = static_cast<int>(buffers_.size()) - 1;
+    }
+    CacheBuffer& buffer = buffers_[index];
+    CopyName(buffer.name, name);
+    buffer.offset = (end_ + kAlignment - 1) / kAlignment * kAlignment;
+    buffer.size = size;
+    end_ = buffer.offset + size;
+    if (data != nullptr)
+        WriteBuffer(name, 0, data, size);
+}
+
+void SceneCacheWriter::WriteBuffer(const std::string& name, size_t offset, const void* data, size_t size) {
+    const int index = FindBuffer(name);
+    if (!good() || index < 0 || offset + size > buffers_[index].size)
+        return;
+    file_.seekp(buffers_[index].offset + offset);
+    file_.write(static_cast<const char*>(data), size);
+}
+
+void SceneCacheWriter::AddAttrib(const std::string& name, const std::string& buffer, int dim, uint32_t type, bool normalized, size_t stride, size_t offset) {
+    const int index = FindBuffer(buffer);
+    if (!good() || index < 0)
+        return;
+    attribs_.erase(std::remove_if(attribs_.begin(), attribs_.end(), [&](const CacheAttrib& a) { return name == a.name; }), attribs_.end());
+    CacheAttrib attrib;
+    CopyName(attrib.name, name);
+    attrib.buffer = static_cast<uint32_t>(index);
+    attrib.dim = static_cast<uint32_t>(dim);
+    attrib.type = type;
+    attrib.normalized = normalized ? 1 : 0;
+    attrib.stride = stride;
+    attrib.offset = offset;
+    attribs_.push_back(attrib);
+}
+
+void SceneCacheWriter::ExtendBounds(const void* positions, size_t stride, size_t count) {
+    const uint8_t* p = static_cast<const uint8_t*>(positions);
+    for (size_t i = 0; i < count; i++, p += stride) {
+        float xyz[3];
+        std::memcpy(xyz, p, sizeof(xyz));
+        for (int k = 0; k < 3; k++) {
+            header_.bounds_min[k] = std::min(header_.bounds_min[k], xyz[k]);
+            header_.bounds_max[k] = std::max(header_.bounds_max[k], xyz[k]);
+        }
+    }
+}
+
+void SceneCacheWriter::SetCounts(uint64_t vertex_count, uint64_t index_count) {
+    header_.vertex_count = vertex_count;
+    header_.index_count = index_count;
+}
+
+bool SceneCacheWriter::Finish() {
+    if (!good() || finished_)
+        return false;
+    header_.buffer_count = static_cast<uint32_t>(buffers_.size());
+    header_.attrib_count = static_cast<uint32_t>(attribs_.size());
+    header_.table_offset = (end_ + kAlignment - 1) / kAlignment * kAlignment;
+    file_.seekp(header_.table_offset);
+    file_.write(reinterpret_cast<const char*>(buffers_.data()), buffers_.size() * sizeof(CacheBuffer));
+    file_.write(reinterpret_cast<const char*>(attribs_.data()), attribs_.size() * sizeof(CacheAttrib));
+    file_.seekp(0);
+    file_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    file_.close();
+    if (file_.fail()) {
+        std::cout << "could not write cache " << temp_path_ << std::endl;
+        return false;
+    }
+    std::remove(path_.c_str());
+    if (std::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+        std::cout << "could not write cache " << path_ << std::endl;
+        return false;
+    }
+    finished_ = true;
+    return true;
+}
+
+};
@@ -0,0 +1,109 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_SCENE_CACHE_
+#define _H_SCENE_CACHE_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tinyply.h"
+
+namespace C3DV_cache {
+
+// Bump whenever the buffers written by the renderers change.
+constexpr uint32_t kCacheVersion = 6;
+
+// A .c3dv file holds the final GPU buffers of one renderer: the header, the raw buffers
+// (64 byte aligned) and the buffer and attribute tables at the end.
+struct CacheHeader {
+    char magic[4];              // "C3DV"
+    uint32_t version;
+    uint64_t source_size;       // size and modification time of the file the cache was built from
+    int64_t source_mtime;
+    uint64_t vertex_count;
+    uint64_t index_count;
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t buffer_count;
+    uint32_t attrib_count;
+    uint64_t table_offset;
+};
+
+struct CacheBuffer {
+    char name[32];              // "indices" is uploaded as the element array
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct CacheAttrib {
+    char name[32];
+    uint32_t buffer;            // index into the buffer table
+    uint32_t dim;
+    uint32_t type;              // GL type of one component
+    uint32_t normalized;
+    uint64_t stride;
+    uint64_t offset;
+};
+
+// Cache file next to the source, one per renderer since a PLY can be shown as cloud and surfels.
+std::string CachePath(const std::string& source, const std::string& kind);
+
+// Read-only view of a cache file, the buffers point into the mapping.
+class SceneCache {
+public:
+    // Maps the cache, false if it is missing, broken or older than the source.
+    bool Open(const std::string& path, const std::string& source);
+    const CacheHeader& header() const { return header_; }
+    const std::vector<CacheBuffer>& buffers() const { return buffers_; }
+    const std::vector<CacheAttrib>& attribs() const { return attribs_; }
+    const uint8_t* BufferData(size_t i) const { return mapping_->data() + buffers_[i].offset; }
+    // Index of a buffer, -1 if there is none with that name.
+    int FindBuffer(const std::string& name) const;
+private:
+    std::shared_ptr<tinyply::MappedFile> mapping_;
+    CacheHeader header_;
+    std::vector<CacheBuffer> buffers_;
+    std::vector<CacheAttrib> attribs_;
+};
+
+// Writes a cache while a renderer uploads its buffers (see UploadStream). The file is written
+// to a temporary name and only moved into place by Finish().
+class SceneCacheWriter {
+public:
+    SceneCacheWriter(const std::string& path, const std::string& source);
+    ~SceneCacheWriter();
+    bool good() const { return file_.good(); }
+    // Reserves a buffer, data may be null and written later with WriteBuffer.
+    void AddBuffer(const std::string& name, const void* data, size_t size);
+    void WriteBuffer(const std::string& name, size_t offset, const void* data, size_t size);
+    void AddAttrib(const std::string& name, const std::string& buffer, int dim, uint32_t type, bool normalized, size_t stride, size_t offset);
+    // Grows the bounds by `count` float xyz positions that are `stride` bytes apart.
+    void ExtendBounds(const void* positions, size_t stride, size_t count);
+    void SetCounts(uint64_t vertex_count, uint64_t index_count);
+    // Writes the tables and the header and moves the file into place.
+    bool Finish();
+private:
+    std::string path_;
+    std::string temp_path_;
+    std::ofstream file_;
+    CacheHeader header_;
+    std::vector<CacheBuffer> buffers_;
+    std::vector<CacheAttrib> attribs_;
+    uint64_t end_{0};
+    bool finished_{false};
+    int FindBuffer(const std::string& name) const;
+};
+
+};
+
+#endif  // _H_SCENE_CACHE_
@@ -9,13 +9,150 @@
 
 #include "shader.h"
 
-void Shader::Init(const std::string& name, const std::string& vertex, const std::string fragment) {
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+size_t VertexAttrib::Size() const {
+    return dim * VertexLayout::TypeSize(type);
+}
+
+VertexLayout& VertexLayout::Add(const std::string& name, int dim, GLenum type, bool normalized) {
+    size_t end = 0;
+    for (const auto& attrib : attribs_)
+        end = std::max(end, attrib.offset + attrib.Size());
+    return AddAt(name, dim, type, normalized, (end + 3) & ~static_cast<size_t>(3));
+}
+
+VertexLayout& VertexLayout::AddAt(const std::string& name, int dim, GLenum type, bool normalized, size_t offset) {
+    attribs_.push_back(VertexAttrib{name, dim, type, normalized, offset});
+    // Vertices stay 4 byte aligned, as GL wants them.
+    stride_ = std::max(stride_, (offset + attribs_.back().Size() + 3) & ~static_cast<size_t>(3));
+    return *this;
+}
+
+VertexLayout& VertexLayout::SetStride(size_t stride) {
+    stride_ = stride;
+    return *this;
+}
+
+const VertexAttrib* VertexLayout::Find(const std::string& name) const {
+    for (const auto& attrib : attribs_) {
+        if (attrib.name == name)
+            return &attrib;
+    }
+    return nullptr;
+}
+
+void VertexLayout::Interleave(const std::string& name, const void* values, size_t count, void* vertices) const {
+    const VertexAttrib* attrib = Find(name);
+    if (!attrib)
+        return;
+    const size_t size = attrib->Size();
+    const uint8_t* source = static_cast<const uint8_t*>(values);
+    uint8_t* target = static_cast<uint8_t*>(vertices) + attrib->offset;
+    for (size_t i = 0; i < count; i++)
+        std::memcpy(target + i * stride_, source + i * size, size);
+}
+
+size_t VertexLayout::TypeSize(GLenum type) {
+    switch (type) {
+        case GL_BYTE:
+        case GL_UNSIGNED_BYTE:
+            return 1;
+        case GL_SHORT:
+        case GL_UNSIGNED_SHORT:
+        case GL_HALF_FLOAT:
+            return 2;
+        case GL_DOUBLE:
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+void Shader::Init(const std::string& name, const std::string& vertex, const std::string fragment, const std::string& geometry) {
     if (!initalized_) {
-        shader_.init(name, vertex, fragment);
+        shader_.init(name, vertex, fragment, geometry);
         initalized_ = true;
     }
 }
 
+GLuint Shader::UploadBuffer(const std::string& name, const void* data, size_t size) {
+    GLuint& buffer = buffers_[name];
+    if (buffer == 0)
+        glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+    return buffer;
+}
+
+GLuint Shader::UploadedBuffer(const std::string& name) const {
+    auto buffer = buffers_.find(name);
+    return (buffer == buffers_.end()) ? 0 : buffer->second;
+}
+
+void Shader::UpdateBuffer(const std::string& name, size_t offset, const void* data, size_t size) {
+    auto buffer = buffers_.find(name);
+    if (buffer == buffers_.end())
+        return;
+    glBindBuffer(GL_ARRAY_BUFFER, buffer->second);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+}
+
+void Shader::BindAttrib(const std::string& attrib, GLuint buffer, int dim, GLenum type, bool normalized, size_t stride, size_t offset) {
+    const GLint location = shader_.attrib(attrib);
+    if (location < 0)
+        return;
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableVertexAttribArray(location);
+    glVertexAttribPointer(location, dim, type, normalized ? GL_TRUE : GL_FALSE,
+                          static_cast<GLsizei>(stride), reinterpret_cast<const void*>(offset));
+}
+
+void Shader::BindLayout(GLuint buffer, const VertexLayout& layout) {
+    for (const auto& attrib : layout.attribs())
+        BindAttrib(attrib.name, buffer, attrib.dim, attrib.type, attrib.normalized, layout.stride(), attrib.offset);
+}
+
+GLuint Shader::UploadVertices(const std::string& name, const VertexLayout& layout, const void* vertices, size_t count) {
+    const GLuint buffer = UploadBuffer(name, vertices, count * layout.stride());
+    BindLayout(buffer, layout);
+    return buffer;
+}
+
+void* Shader::MapPixelBuffer(const std::string& name, size_t size) {
+    GLuint& buffer = buffers_[name];
+    if (buffer == 0)
+        glGenBuffers(1, &buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    // New storage every time, the driver may still be reading the previous upload.
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    void* data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return data;
+}
+
+bool Shader::UnmapPixelBuffer(const std::string& name) {
+    auto buffer = buffers_.find(name);
+    if (buffer == buffers_.end())
+        return false;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->second);
+    return glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+}
+
+void Shader::UploadIndices(const uint32_t* indices, size_t count) {
+    shader_.uploadAttrib("indices", count, 3, sizeof(uint32_t), GL_UNSIGNED_INT, true, indices);
+}
+
+void Shader::Free() {
+    for (auto& buffer : buffers_)
+        glDeleteBuffers(1, &buffer.second);
+    buffers_.clear();
+    shader_.free();
+    initalized_ = false;
+}
+
 void Shader2D::Init(const std::string& name) {
     if (!initalized_) {
         const std::string& vertex = "#version 330\n"
@@ -37,19 +174,18 @@ void Shader2D::Init(const std::string& name) {
         shader_.init(name, vertex, fragment);
         
         unsigned int indices[] = {0, 1, 2, 2, 3, 0};
-        float vertices[] = {-1, -1, 1, 1, -1, 1, 1,  1, 1, -1,  1, 1};
-        float uvs[] = {0, 1, 1, 1, 1, 0, 0, 0};
-        float uvs_flipped[] = {1, 0, 0, 0, 0, 1, 1, 1};
-        
-        Eigen::Map<nanogui::MatrixXf> v_vertices(vertices,3,4);
-        Eigen::Map<nanogui::MatrixXf> v_uvs(uvs,2,4);
-        Eigen::Map<nanogui::MatrixXf> v_uvs_flipped(uvs_flipped,2,4);
+        // Position and texture coordinate of every corner, interleaved.
+        float vertices[] = {-1, -1, 1, 0, 1,
+                             1, -1, 1, 1, 1,
+                             1,  1, 1, 1, 0,
+                            -1,  1, 1, 0, 0};
         Eigen::Map<nanogui::MatrixXu> v_indices(indices,3,2);
+        VertexLayout layout;
+        layout.Add("position", 3, GL_FLOAT).Add("vertexUV", 2, GL_FLOAT);
 
         shader_.bind();
         shader_.uploadIndices(v_indices);
-        shader_.uploadAttrib("position", v_vertices);
-        shader_.uploadAttrib("vertexUV", v_uvs);
+        UploadVertices("quad", layout, vertices, 4);
         initalized_ = true;
     }
 }
@@ -82,27 +218,121 @@ void Shader3DTextured::Init(const std::string& name) {
     if (!initalized_) {
         const std::string& vertex{"#version 330\n"
             "uniform mat4 model_view_projection;\n"
+            "uniform mat4 model_view;\n"
             "layout(location = 0) in vec3 position;\n"
             "layout(location = 1) in vec2 vertexUV;\n"
-            "layout(location = 2) in vec3 color;\n"
-            "out vec3 colorV;\n"
+            "layout(location = 2) in float material;\n"
+            "layout(location = 3) in vec3 normal;\n"
+            "flat out int materialV;\n"
             "out vec2 UV;\n"
+            "out vec3 normalV;\n"
             "void main() {\n"
             "    gl_Position = model_view_projection * vec4(position, 1.0);\n"
-            "    colorV = color;\n"
+            "    materialV = int(material);\n"
+            "    normalV = mat3(model_view) * normal;\n"
             "    UV = vec2(vertexUV.x, 1 - vertexUV.y);\n"
             "}"};
         
+        // One texel per material: the diffuse color and the texture layer, negative for none.
+        // Materials without a texture are lit from the camera (textures of scans have their
+        // lighting baked in), vertices without a normal are not.
+        // With virtual textures (virtual_texture 1) the second row of the material table has the
+        // size and the levels of each layer, the level comes from the UV derivatives and the page
+        // table points its tile at a slot of the physical cache (or at a coarser tile that is
+        // resident). The feedback pass (virtual_texture 2) writes the tile it would have wanted.
         const std::string& fragment{"#version 330\n"
             "in vec2 UV;\n"
-            "in vec3 colorV;\n"
-            "uniform sampler2D myTextureSampler;\n"
+            "in vec3 normalV;\n"
+            "flat in int materialV;\n"
+            "uniform sampler2DArray myTextureSampler;\n"
+            "uniform sampler2D materials;\n"
+            "uniform usampler2DArray page_table;\n"
+            "uniform sampler2D tile_cache;\n"
+            "uniform int virtual_texture;\n"
+            "uniform float lod_bias;\n"
             "out vec4 color;\n"
+            "const float kTileSize = 128.0;\n"
+            "const float kTileBorder = 4.0;\n"
+            "const float kSlotSize = 136.0;\n"
+            "const float kCacheSize = 136.0 * 32.0;\n"
             "void main() {\n"
-            "    color = vec4(texture(myTextureSampler, UV).rgb, 1.0);\n"
+            "    vec2 dx = dFdx(UV);\n"
+            "    vec2 dy = dFdy(UV);\n"
+            "    vec4 material = texelFetch(materials, ivec2(materialV, 0), 0);\n"
+            "    if (material.a < 0.0) {\n"
+            "        float light = (dot(normalV, normalV) > 0.0) ? 0.3 + 0.7 * abs(normalize(normalV).z) : 1.0;\n"
+            "        color = (virtual_texture == 2) ? vec4(0.0) : vec4(material.rgb * light, 1.0);\n"
+            "        return;\n"
+            "    }\n"
+            "    if (virtual_texture == 0) {\n"
+            "        color = vec4(texture(myTextureSampler, vec3(UV, material.a)).rgb, 1.0);\n"
+            "        return;\n"
+            "    }\n"
+            "    int layer = int(material.a);\n"
+            "    vec3 size = texelFetch(materials, ivec2(layer, 1), 0).xyz;\n"
+            "    dx *= size.xy;\n"
+            "    dy *= size.xy;\n"
+            "    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + lod_bias;\n"
+            "    int level = clamp(int(floor(lod)), 0, int(size.z) - 1);\n"
+            "    vec2 uv = fract(UV);\n"
+            "    ivec2 tile = ivec2(uv * vec2(max(ivec2(size.xy) >> level, ivec2(1)))) / int(kTileSize);\n"
+            "    if (virtual_texture == 2) {\n"
+            "        color = vec4(vec2(tile), float(level), float(layer + 1)) / 255.0;\n"
+            "        return;\n"
+            "    }\n"
+            "    uvec4 entry = texelFetch(page_table, ivec3(tile, layer), level);\n"
+            "    int resident = int(entry.b);\n"
+            "    vec2 resident_texel = uv * vec2(max(ivec2(size.xy) >> resident, ivec2(1)));\n"
+            "    vec2 in_tile = resident_texel - vec2(tile >> (resident - level)) * kTileSize;\n"
+            "    vec2 cache_uv = (vec2(entry.rg) * kSlotSize + kTileBorder + in_tile) / kCacheSize;\n"
+            "    color = vec4(textureLod(tile_cache, cache_uv, 0.0).rgb, 1.0);\n"
             "}"};
         
         shader_.init(name, vertex, fragment);
         initalized_ = true;
     }
 }
+
+bool GpuQuery::Begin() {
+    Collect();
+    running_ = (pending_ < kQueries);
+    if (running_)
+        glBeginQuery(target_, queries_[next_]);
+    return running_;
+}
+
+void GpuQuery::End() {
+    if (!running_)
+        return;
+    glEndQuery(target_);
+    next_ = (next_ + 1) % kQueries;
+    pending_++;
+    running_ = false;
+}
+
+void GpuQuery::Collect() {
+    if (queries_[0] == 0)
+        glGenQueries(kQueries, queries_);
+    // Oldest first.
+    while (pending_ > 0) {
+        const GLuint query = queries_[(next_ - pending_ + kQueries) % kQueries];
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+        GLuint64 result = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &result);
+        result_ = result;
+        pending_--;
+    }
+}
+
+void GpuQuery::Free() {
+    if (queries_[0] != 0)
+        glDeleteQueries(kQueries, queries_);
+    std::fill(queries_, queries_ + kQueries, 0);
+    next_ = 0;
+    pending_ = 0;
+    running_ = false;
+    result_ = 0;
+}
@@ -10,17 +10,80 @@
 #ifndef _H_SHADER_
 #define _H_SHADER_
 
+#include <cstddef>
+#include <cstdint>
+#include <map>
 #include <string>
+#include <vector>
 
 #include <nanogui/glutil.h>
 #include <nanogui/opengl.h>
 
+// One attribute of an interleaved vertex: `dim` components of `type` at `offset` bytes into the
+// vertex, read as floats (integers scaled to [0, 1] if `normalized`).
+struct VertexAttrib {
+    std::string name;
+    int dim;
+    GLenum type;
+    bool normalized;
+    size_t offset;
+    size_t Size() const;
+};
+
+// The attributes of one vertex buffer, interleaved so that a vertex is fetched from one place and
+// a dataset is uploaded in one transfer. Add() appends an attribute (aligned to 4 bytes), AddAt()
+// places one at a given offset, e.g. offsetof a vertex struct or into the records of a mapped
+// file, whose stride is then set with SetStride(). Attributes a shader does not use are skipped
+// when the layout is bound.
+class VertexLayout {
+public:
+    VertexLayout& Add(const std::string& name, int dim, GLenum type, bool normalized = false);
+    VertexLayout& AddAt(const std::string& name, int dim, GLenum type, bool normalized, size_t offset);
+    VertexLayout& SetStride(size_t stride);
+    size_t stride() const { return stride_; }
+    const std::vector<VertexAttrib>& attribs() const { return attribs_; }
+    // The attribute with that name or null.
+    const VertexAttrib* Find(const std::string& name) const;
+    // Copies `count` tightly packed values of an attribute into the interleaved `vertices`.
+    void Interleave(const std::string& name, const void* values, size_t count, void* vertices) const;
+    // Bytes of one component.
+    static size_t TypeSize(GLenum type);
+private:
+    std::vector<VertexAttrib> attribs_;
+    size_t stride_{0};
+};
+
 class Shader {
 protected:
     bool initalized_{false};
+    // Vertex buffers managed outside of nanogui (e.g. uploaded straight from a mapped file).
+    std::map<std::string, GLuint> buffers_;
 public:
     nanogui::GLShader shader_{};
-    void Init(const std::string& name, const std::string& vertex, const std::string fragment);
+    // The geometry shader is optional.
+    void Init(const std::string& name, const std::string& vertex, const std::string fragment, const std::string& geometry = "");
+    // Uploads raw bytes into the named vertex buffer (created on first use), shader must be bound.
+    GLuint UploadBuffer(const std::string& name, const void* data, size_t size);
+    // Returns a buffer created by UploadBuffer or 0.
+    GLuint UploadedBuffer(const std::string& name) const;
+    // Overwrites part of a buffer from UploadBuffer, e.g. one batch of a streamed file.
+    void UpdateBuffer(const std::string& name, size_t offset, const void* data, size_t size);
+    // Points an attribute at strided data inside a buffer, shader must be bound.
+    void BindAttrib(const std::string& attrib, GLuint buffer, int dim, GLenum type, bool normalized, size_t stride, size_t offset);
+    // Points every attribute of a layout at the buffer, shader must be bound.
+    void BindLayout(GLuint buffer, const VertexLayout& layout);
+    // Uploads `count` interleaved vertices into the named buffer and binds the layout to it.
+    GLuint UploadVertices(const std::string& name, const VertexLayout& layout, const void* vertices, size_t count);
+    // Orphans the named pixel unpack buffer (created on first use) and maps `size` bytes of it for
+    // writing, the pointer may be filled on any thread until UnmapPixelBuffer. Null on failure.
+    void* MapPixelBuffer(const std::string& name, size_t size);
+    // Unmaps a buffer from MapPixelBuffer and leaves it bound to GL_PIXEL_UNPACK_BUFFER, so that
+    // texture uploads read from it (with pixel pointers being offsets into the buffer).
+    bool UnmapPixelBuffer(const std::string& name);
+    // Uploads triangle indices for drawIndexed, shader must be bound.
+    void UploadIndices(const uint32_t* indices, size_t count);
+    // Frees the nanogui shader and all buffers, the next Init creates them again.
+    void Free();
 };
 
 class Shader2D: public Shader {
@@ -38,4 +101,44 @@ public:
     void Init(const std::string& name);
 };
 
+// A GL query around the draws between Begin() and End() (queries of one target do not nest).
+// Results are read a few frames later so that reading them never stalls; frames without a free
+// query are skipped.
+class GpuQuery {
+public:
+    explicit GpuQuery(GLenum target): target_(target) {}
+    // False if all queries are still in flight.
+    bool Begin();
+    void End();
+    // Reads the finished results, Begin() does too.
+    void Collect();
+    // The last finished result.
+    uint64_t Result() const { return result_; }
+    // Whether a result is still in flight.
+    bool Pending() const { return pending_ > 0; }
+    void Free();
+private:
+    static constexpr int kQueries = 4;
+    GLenum target_;
+    GLuint queries_[kQueries]{0, 0, 0, 0};
+    int next_{0};
+    int pending_{0};
+    bool running_{false};
+    uint64_t result_{0};
+};
+
+// GPU time between Begin() and End() (GL_TIME_ELAPSED).
+class GpuTimer: public GpuQuery {
+public:
+    GpuTimer(): GpuQuery(GL_TIME_ELAPSED) {}
+    double Milliseconds() const { return Result() * 1e-6; }
+};
+
+// Primitives that leave the geometry shader between Begin() and End() (GL_PRIMITIVES_GENERATED),
+// e.g. the points a culling pass keeps.
+class GpuCounter: public GpuQuery {
+public:
+    GpuCounter(): GpuQuery(GL_PRIMITIVES_GENERATED) {}
+};
+
 #endif
@@ -0,0 +1,186 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#include "surfel_processing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace C3DV_graphics {
+
+namespace {
+
+// Surfels per block, the columns of a block are gathered into arrays on the stack.
+constexpr size_t kSurfelBlockSize = 512;
+
+// Corners of the two triangles (p0, p1, p2) and (p0, p2, p3).
+constexpr int kDiscCorners[6] = {0, 1, 2, 0, 2, 3};
+
+// The half axes of the disc quads: u = r * normalize(n x X) if |n.x| > |n.y|, else
+// r * normalize(n x Y), and v = n x u. Four surfels at a time with SSE, n x X and n x Y are
+// (0, n.z, -n.y) and (-n.z, 0, n.x), so n = (0, 0, 1) gives u = (-r, 0, 0). Only a zero normal
+// has a zero cross product, its u and v are 0, as Eigen's normalized() returns for it.
+void DiscAxes(const float* nx, const float* ny, const float* nz, const float* r,
+              float* ux, float* uy, float* uz, float* vx, float* vy, float* vz, size_t count) {
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= count; i += 4) {
+        const __m128 x = _mm_loadu_ps(nx + i);
+        const __m128 y = _mm_loadu_ps(ny + i);
+        const __m128 z = _mm_loadu_ps(nz + i);
+        const __m128 along_x = _mm_cmpgt_ps(_mm_andnot_ps(sign, x), _mm_andnot_ps(sign, y));
+        const __m128 cx = _mm_andnot_ps(along_x, _mm_xor_ps(z, sign));
+        const __m128 cy = _mm_and_ps(along_x, z);
+        const __m128 cz = _mm_or_ps(_mm_and_ps(along_x, _mm_xor_ps(y, sign)), _mm_andnot_ps(along_x, x));
+        const __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz));
+        // r / sqrt(0) is infinite or NaN, the mask turns it into 0.
+        const __m128 scale = _mm_and_ps(_mm_cmpgt_ps(length2, zero), _mm_div_ps(_mm_loadu_ps(r + i), _mm_sqrt_ps(length2)));
+        const __m128 tx = _mm_mul_ps(cx, scale);
+        const __m128 ty = _mm_mul_ps(cy, scale);
+        const __m128 tz = _mm_mul_ps(cz, scale);
+        _mm_storeu_ps(ux + i, tx);
+        _mm_storeu_ps(uy + i, ty);
+        _mm_storeu_ps(uz + i, tz);
+        _mm_storeu_ps(vx + i, _mm_sub_ps(_mm_mul_ps(y, tz), _mm_mul_ps(z, ty)));
+        _mm_storeu_ps(vy + i, _mm_sub_ps(_mm_mul_ps(z, tx), _mm_mul_ps(x, tz)));
+        _mm_storeu_ps(vz + i, _mm_sub_ps(_mm_mul_ps(x, ty), _mm_mul_ps(y, tx)));
+    }
+#endif
+    for (; i < count; i++) {
+        const bool along_x = std::fabs(nx[i]) > std::fabs(ny[i]);
+        const float cx = along_x ? 0.0f : -nz[i];
+        const float cy = along_x ? nz[i] : 0.0f;
+        const float cz = along_x ? -ny[i] : nx[i];
+        const float length2 = cx * cx + cy * cy + cz * cz;
+        const float scale = (length2 > 0.0f) ? r[i] / std::sqrt(length2) : 0.0f;
+        ux[i] = cx * scale;
+        uy[i] = cy * scale;
+        uz[i] = cz * scale;
+        vx[i] = ny[i] * uz[i] - nz[i] * uy[i];
+        vy[i] = nz[i] * ux[i] - nx[i] * uz[i];
+        vz[i] = nx[i] * uy[i] - ny[i] * ux[i];
+    }
+}
+
+}  // namespace
+
+SurfelColumns SurfelColumns::Subset(size_t first, size_t count) const {
+    SurfelColumns subset;
+    subset.x = x.subview(first, count);
+    subset.y = y.subview(first, count);
+    subset.z = z.subview(first, count);
+    subset.nx = nx.subview(first, count);
+    subset.ny = ny.subview(first, count);
+    subset.nz = nz.subview(first, count);
+    subset.radius = radius.subview(first, count);
+    subset.quality = quality.subview(first, count);
+    subset.curvature = curvature.subview(first, count);
+    subset.red = red.subview(first, count);
+    subset.green = green.subview(first, count);
+    subset.blue = blue.subview(first, count);
+    return subset;
+}
+
+bool ViewSurfelColumns(tinyply::PlyFile& file, SurfelColumns& columns) {
+    try {
+        columns.x = file.request_view_from_element<float>("vertex", "x");
+        columns.y = file.request_view_from_element<float>("vertex", "y");
+        columns.z = file.request_view_from_element<float>("vertex", "z");
+        columns.nx = file.request_view_from_element<float>("vertex", "nx");
+        columns.ny = file.request_view_from_element<float>("vertex", "ny");
+        columns.nz = file.request_view_from_element<float>("vertex", "nz");
+        columns.radius = file.request_view_from_element<float>("vertex", "radius");
+        columns.quality = file.request_view_from_element<float>("vertex", "quality");
+        columns.curvature = file.request_view_from_element<float>("vertex", "curvature");
+        columns.red = file.request_view_from_element<uint8_t>("vertex", "red");
+        columns.green = file.request_view_from_element<uint8_t>("vertex", "green");
+        columns.blue = file.request_view_from_element<uint8_t>("vertex", "blue");
+    } catch (const std::exception& e) {
+        // Stored with different types, has to be decoded.
+        return false;
+    }
+    return !columns.x.empty() && !columns.y.empty() && !columns.z.empty() &&
+           !columns.nx.empty() && !columns.ny.empty() && !columns.nz.empty() && !columns.radius.empty() &&
+           !columns.red.empty() && !columns.green.empty() && !columns.blue.empty();
+}
+
+void ExpandSurfels(const SurfelColumns& columns, SurfelVertex* vertices, size_t threads) {
+    ParallelForBlocks(columns.x.size(), kSurfelBlockSize, [&](size_t first, size_t last) {
+        float nx[kSurfelBlockSize], ny[kSurfelBlockSize], nz[kSurfelBlockSize], r[kSurfelBlockSize];
+        float ux[kSurfelBlockSize], uy[kSurfelBlockSize], uz[kSurfelBlockSize];
+        float vx[kSurfelBlockSize], vy[kSurfelBlockSize], vz[kSurfelBlockSize];
+        const size_t count = last - first;
+        for (size_t i = 0; i < count; i++) {
+            nx[i] = columns.nx[first + i];
+            ny[i] = columns.ny[first + i];
+            nz[i] = columns.nz[first + i];
+            r[i] = kSurfelScale * columns.radius[first + i];
+        }
+        DiscAxes(nx, ny, nz, r, ux, uy, uz, vx, vy, vz, count);
+        for (size_t i = 0; i < count; i++) {
+            const float x = columns.x[first + i], y = columns.y[first + i], z = columns.z[first + i];
+            const float corners[4][3] = {{x - ux[i], y - uy[i], z - uz[i]},
+                                         {x - vx[i], y - vy[i], z - vz[i]},
+                                         {x + ux[i], y + uy[i], z + uz[i]},
+                                         {x + vx[i], y + vy[i], z + vz[i]}};
+            const uint8_t red = columns.red[first + i], green = columns.green[first + i], blue = columns.blue[first + i];
+            const float quality = columns.Quality(first + i), curvature = columns.Curvature(first + i);
+            SurfelVertex* disc = vertices + 6 * (first + i);
+            for (int s = 0; s < 6; s++) {
+                const float* corner = corners[kDiscCorners[s]];
+                disc[s] = SurfelVertex{{corner[0], corner[1], corner[2]},
+                                       {nx[i], ny[i], nz[i]},
+                                       {red, green, blue, 255},
+                                       r[i], quality, curvature};
+            }
+        }
+    }, threads);
+}
+
+void PackSurfels(const SurfelColumns& columns, std::vector<SurfelRecord>& records) {
+    const size_t count = columns.x.size();
+    records.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        SurfelRecord& record = records[i];
+        record.position[0] = columns.x[i];
+        record.position[1] = columns.y[i];
+        record.position[2] = columns.z[i];
+        record.normal[0] = columns.nx[i];
+        record.normal[1] = columns.ny[i];
+        record.normal[2] = columns.nz[i];
+        // The same scale ExpandSurfels applies.
+        record.radius = kSurfelScale * columns.radius[i];
+        record.quality = columns.Quality(i);
+        record.curvature = columns.Curvature(i);
+        record.color[0] = columns.red[i];
+        record.color[1] = columns.green[i];
+        record.color[2] = columns.blue[i];
+        record.color[3] = 255;
+    }
+}
+
+void SurfelRange::Extend(const SurfelColumns& columns) {
+    for (size_t i = 0; i < columns.x.size(); i++) {
+        const float values[3] = {kSurfelScale * columns.radius[i], columns.Quality(i), columns.Curvature(i)};
+        float* bounds[3] = {radius, quality, curvature};
+        for (int k = 0; k < 3; k++) {
+            bounds[k][0] = std::min(bounds[k][0], values[k]);
+            bounds[k][1] = std::max(bounds[k][1], values[k]);
+        }
+    }
+}
+
+};
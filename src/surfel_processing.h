@@ -0,0 +1,78 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_SURFEL_PROCESSING_
+#define _H_SURFEL_PROCESSING_
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include "parallel.h"
+#include "tinyply.h"
+
+namespace C3DV_graphics {
+
+// The disc quad spans the surfel radius (in millimeters) along its diagonal.
+constexpr float kSurfelScale = 1.414214f / 1000.0f;
+
+// Input columns of the surfel expansion, either views into a mapped file or into a decoded batch.
+// Quality and curvature are optional (empty views read as 0).
+struct SurfelColumns {
+    tinyply::StridedView<float> x, y, z;
+    tinyply::StridedView<float> nx, ny, nz;
+    tinyply::StridedView<float> radius;
+    tinyply::StridedView<float> quality, curvature;
+    tinyply::StridedView<uint8_t> red, green, blue;
+    SurfelColumns Subset(size_t first, size_t count) const;
+    float Quality(size_t i) const { return quality.empty() ? 0.0f : quality[i]; }
+    float Curvature(size_t i) const { return curvature.empty() ? 0.0f : curvature[i]; }
+};
+
+bool ViewSurfelColumns(tinyply::PlyFile& file, SurfelColumns& columns);
+
+// One corner of an expanded disc, the attributes interleaved in one buffer. The corner's texture
+// coordinate is the same for every disc, the vertex shader derives it from the vertex index.
+// Radius, quality and curvature are repeated for the filter in the shaders.
+struct SurfelVertex {
+    float position[3];
+    float normal[3];
+    uint8_t color[4];       // RGB and unused
+    float radius;           // as in SurfelRecord
+    float quality;
+    float curvature;
+};
+// Expands every surfel into a disc of two triangles, six vertices written to `vertices` (which
+// must hold 6 * columns.x.size()). Blocks of surfels are spread over `threads` threads, the
+// tangents of a block are computed four surfels at a time with SSE.
+void ExpandSurfels(const SurfelColumns& columns, SurfelVertex* vertices, size_t threads = WorkerCount());
+
+// One surfel as the GPU expands it into a disc (40 bytes instead of six vertices of 40 bytes).
+struct SurfelRecord {
+    float position[3];
+    float normal[3];
+    float radius;           // half the diagonal of the disc quad, in meters
+    float quality;
+    float curvature;
+    uint8_t color[4];       // RGB and unused
+};
+void PackSurfels(const SurfelColumns& columns, std::vector<SurfelRecord>& records);
+
+// Bounds of the attributes the surfel filter thresholds (the radius scaled like the records'),
+// the sliders of the filter span them.
+struct SurfelRange {
+    float radius[2]{FLT_MAX, -FLT_MAX};
+    float quality[2]{FLT_MAX, -FLT_MAX};
+    float curvature[2]{FLT_MAX, -FLT_MAX};
+    void Extend(const SurfelColumns& columns);
+};
+
+};
+
+#endif  // _H_SURFEL_PROCESSING_
@@ -0,0 +1,281 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#include "texture_compression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "scene_cache.h"
+
+namespace C3DV_graphics {
+
+namespace {
+
+uint16_t Pack565(const float color[3]) {
+    const int r = std::min(31, std::max(0, static_cast<int>(color[0] * 31.0f / 255.0f + 0.5f)));
+    const int g = std::min(63, std::max(0, static_cast<int>(color[1] * 63.0f / 255.0f + 0.5f)));
+    const int b = std::min(31, std::max(0, static_cast<int>(color[2] * 31.0f / 255.0f + 0.5f)));
+    return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+}
+
+void Unpack565(uint16_t packed, float color[3]) {
+    const int r = (packed >> 11) & 31;
+    const int g = (packed >> 5) & 63;
+    const int b = packed & 31;
+    color[0] = static_cast<float>((r << 3) | (r >> 2));
+    color[1] = static_cast<float>((g << 2) | (g >> 4));
+    color[2] = static_cast<float>((b << 3) | (b >> 2));
+}
+
+float Distance(const float a[3], const float b[3]) {
+    const float d0 = a[0] - b[0], d1 = a[1] - b[1], d2 = a[2] - b[2];
+    return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+// Palette of the endpoints in four color mode and the index of the closest entry per pixel.
+uint32_t PickIndices(const float pixels[16][3], uint16_t c0, uint16_t c1) {
+    float palette[4][3];
+    Unpack565(c0, palette[0]);
+    Unpack565(c1, palette[1]);
+    for (int k = 0; k < 3; k++) {
+        palette[2][k] = (2.0f * palette[0][k] + palette[1][k]) / 3.0f;
+        palette[3][k] = (palette[0][k] + 2.0f * palette[1][k]) / 3.0f;
+    }
+    uint32_t indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0;
+        float best_distance = Distance(pixels[i], palette[0]);
+        for (int p = 1; p < 4; p++) {
+            const float distance = Distance(pixels[i], palette[p]);
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = p;
+            }
+        }
+        indices |= static_cast<uint32_t>(best) << (2 * i);
+    }
+    return indices;
+}
+
+// Endpoints that fit the chosen indices best, false if the system is singular.
+bool RefineEndpoints(const float pixels[16][3], uint32_t indices, float e0[3], float e1[3]) {
+    static const float kWeights[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+    float aa = 0, ab = 0, bb = 0;
+    float ap[3] = {0, 0, 0}, bp[3] = {0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+        const float a = kWeights[(indices >> (2 * i)) & 3];
+        const float b = 1.0f - a;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int k = 0; k < 3; k++) {
+            ap[k] += a * pixels[i][k];
+            bp[k] += b * pixels[i][k];
+        }
+    }
+    const float determinant = aa * bb - ab * ab;
+    if (std::fabs(determinant) < 1e-6f)
+        return false;
+    for (int k = 0; k < 3; k++) {
+        e0[k] = std::min(255.0f, std::max(0.0f, (bb * ap[k] - ab * bp[k]) / determinant));
+        e1[k] = std::min(255.0f, std::max(0.0f, (aa * bp[k] - ab * ap[k]) / determinant));
+    }
+    return true;
+}
+
+// Squared error of a block encoded with the given endpoints and indices.
+float BlockError(const float pixels[16][3], uint16_t c0, uint16_t c1, uint32_t indices) {
+    float palette[4][3];
+    Unpack565(c0, palette[0]);
+    Unpack565(c1, palette[1]);
+    for (int k = 0; k < 3; k++) {
+        palette[2][k] = (2.0f * palette[0][k] + palette[1][k]) / 3.0f;
+        palette[3][k] = (palette[0][k] + 2.0f * palette[1][k]) / 3.0f;
+    }
+    float error = 0;
+    for (int i = 0; i < 16; i++)
+        error += Distance(pixels[i], palette[(indices >> (2 * i)) & 3]);
+    return error;
+}
+
+void EncodeBlock(const float pixels[16][3], uint8_t* block) {
+    float mean[3] = {0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+        for (int k = 0; k < 3; k++)
+            mean[k] += pixels[i][k] / 16.0f;
+    }
+    float covariance[6] = {0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+        const float d[3] = {pixels[i][0] - mean[0], pixels[i][1] - mean[1], pixels[i][2] - mean[2]};
+        covariance[0] += d[0] * d[0];
+        covariance[1] += d[0] * d[1];
+        covariance[2] += d[0] * d[2];
+        covariance[3] += d[1] * d[1];
+        covariance[4] += d[1] * d[2];
+        covariance[5] += d[2] * d[2];
+    }
+    // Principal axis by power iteration, the endpoints are the extreme pixels along it.
+    float axis[3] = {1.0f, 1.0f, 1.0f};
+    for (int iteration = 0; iteration < 8; iteration++) {
+        const float next[3] = {covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+                               covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+                               covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]};
+        const float scale = std::max(std::fabs(next[0]), std::max(std::fabs(next[1]), std::fabs(next[2])));
+        if (scale < 1e-6f)
+            break;
+        for (int k = 0; k < 3; k++)
+            axis[k] = next[k] / scale;
+    }
+    int lowest = 0, highest = 0;
+    float min_t = 1e30f, max_t = -1e30f;
+    for (int i = 0; i < 16; i++) {
+        const float t = (pixels[i][0] - mean[0]) * axis[0] + (pixels[i][1] - mean[1]) * axis[1] + (pixels[i][2] - mean[2]) * axis[2];
+        if (t < min_t) {
+            min_t = t;
+            lowest = i;
+        }
+        if (t > max_t) {
+            max_t = t;
+            highest = i;
+        }
+    }
+    uint16_t c0 = Pack565(pixels[highest]);
+    uint16_t c1 = Pack565(pixels[lowest]);
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        indices = PickIndices(pixels, c0, c1);
+        float e0[3], e1[3];
+        if (RefineEndpoints(pixels, indices, e0, e1)) {
+            const uint16_t r0 = Pack565(e0);
+            const uint16_t r1 = Pack565(e1);
+            if (r0 != r1) {
+                const uint32_t refined = PickIndices(pixels, r0, r1);
+                if (BlockError(pixels, r0, r1, refined) < BlockError(pixels, c0, c1, indices)) {
+                    c0 = r0;
+                    c1 = r1;
+                    indices = refined;
+                }
+            }
+        }
+        // Four color mode needs c0 > c1, swapping the endpoints swaps 0 with 1 and 2 with 3.
+        if (c0 < c1) {
+            std::swap(c0, c1);
+            indices ^= 0x55555555u;
+        }
+    }
+    block[0] = static_cast<uint8_t>(c0 & 0xff);
+    block[1] = static_cast<uint8_t>(c0 >> 8);
+    block[2] = static_cast<uint8_t>(c1 & 0xff);
+    block[3] = static_cast<uint8_t>(c1 >> 8);
+    for (int i = 0; i < 4; i++)
+        block[4 + i] = static_cast<uint8_t>(indices >> (8 * i));
+}
+
+}  // namespace
+
+size_t BC1Size(int width, int height) {
+    return static_cast<size_t>((width + 3) / 4) * static_cast<size_t>((height + 3) / 4) * 8;
+}
+
+void EncodeBC1(const uint8_t* bgr, int width, int height, size_t step, uint8_t* blocks, size_t threads) {
+    const int blocks_x = (width + 3) / 4;
+    const int blocks_y = (height + 3) / 4;
+    ParallelFor(static_cast<size_t>(blocks_y), [&](size_t by) {
+        float pixels[16][3];
+        for (int bx = 0; bx < blocks_x; bx++) {
+            // Blocks over the border repeat the last row and column.
+            for (int i = 0; i < 16; i++) {
+                const int x = std::min(width - 1, bx * 4 + i % 4);
+                const int y = std::min(height - 1, static_cast<int>(by) * 4 + i / 4);
+                const uint8_t* pixel = bgr + y * step + x * 3;
+                pixels[i][0] = pixel[2];
+                pixels[i][1] = pixel[1];
+                pixels[i][2] = pixel[0];
+            }
+            EncodeBlock(pixels, blocks + (by * blocks_x + bx) * 8);
+        }
+    }, threads);
+}
+
+int CompressedTexture::Levels() const {
+    int levels = 1;
+    while ((width >> levels) > 0 || (height >> levels) > 0)
+        levels++;
+    return levels;
+}
+
+size_t CompressedTexture::LevelOffset(int level) const {
+    size_t offset = 0;
+    for (int l = 0; l < level; l++)
+        offset += LevelSize(l);
+    return offset;
+}
+
+CompressedTexture CompressTexture(const cv::Mat& image, size_t threads) {
+    CompressedTexture texture;
+    texture.width = image.cols;
+    texture.height = image.rows;
+    texture.source_width = image.cols;
+    texture.source_height = image.rows;
+    const int levels = texture.Levels();
+    auto data = std::make_shared<std::vector<uint8_t>>(texture.LevelOffset(levels));
+    cv::Mat level = image;
+    for (int l = 0; l < levels; l++) {
+        if (l > 0)
+            cv::resize(level, level, cv::Size(texture.LevelWidth(l), texture.LevelHeight(l)), 0, 0, cv::INTER_AREA);
+        EncodeBC1(level.ptr(), level.cols, level.rows, static_cast<size_t>(level.step), data->data() + texture.LevelOffset(l), threads);
+    }
+    texture.blocks = data->data();
+    texture.size = data->size();
+    texture.owner = data;
+    return texture;
+}
+
+bool LoadCompressedTexture(const std::string& file, CompressedTexture& texture) {
+    auto cache = std::make_shared<C3DV_cache::SceneCache>();
+    if (!cache->Open(C3DV_cache::CachePath(file, "bc1"), file))
+        return false;
+    const int size = cache->FindBuffer("size");
+    const int blocks = cache->FindBuffer("blocks");
+    if (size < 0 || blocks < 0 || cache->buffers()[size].size != 2 * sizeof(uint32_t))
+        return false;
+    uint32_t dimensions[2];
+    std::memcpy(dimensions, cache->BufferData(size), sizeof(dimensions));
+    CompressedTexture cached;
+    cached.width = static_cast<int>(dimensions[0]);
+    cached.height = static_cast<int>(dimensions[1]);
+    // Caches without a source size hold the texture at its own size.
+    const int source = cache->FindBuffer("source");
+    if (source >= 0 && cache->buffers()[source].size == sizeof(dimensions))
+        std::memcpy(dimensions, cache->BufferData(source), sizeof(dimensions));
+    cached.source_width = static_cast<int>(dimensions[0]);
+    cached.source_height = static_cast<int>(dimensions[1]);
+    cached.size = cache->buffers()[blocks].size;
+    if (cached.width <= 0 || cached.height <= 0 || cached.size != cached.LevelOffset(cached.Levels()))
+        return false;
+    cached.blocks = cache->BufferData(blocks);
+    cached.owner = cache;
+    texture = cached;
+    return true;
+}
+
+bool SaveCompressedTexture(const std::string& file, const CompressedTexture& texture) {
+    C3DV_cache::SceneCacheWriter writer(C3DV_cache::CachePath(file, "bc1"), file);
+    const uint32_t dimensions[2] = {static_cast<uint32_t>(texture.width), static_cast<uint32_t>(texture.height)};
+    writer.AddBuffer("size", dimensions, sizeof(dimensions));
+    const uint32_t source[2] = {static_cast<uint32_t>(texture.source_width), static_cast<uint32_t>(texture.source_height)};
+    writer.AddBuffer("source", source, sizeof(source));
+    writer.AddBuffer("blocks", texture.blocks, texture.size);
+    return writer.Finish();
+}
+
+};
@@ -0,0 +1,57 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_TEXTURE_COMPRESSION_
+#define _H_TEXTURE_COMPRESSION_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "parallel.h"
+
+namespace C3DV_graphics {
+
+// Bytes of one BC1 (DXT1) image, 8 per block of 4x4 pixels.
+size_t BC1Size(int width, int height);
+
+// Compresses a BGR8 image whose rows are `step` bytes apart into BC1 blocks (RGB, no alpha).
+// Every block gets the endpoints along its principal color axis, refined by least squares;
+// the rows of blocks are spread over `threads` threads.
+void EncodeBC1(const uint8_t* bgr, int width, int height, size_t step, uint8_t* blocks, size_t threads = WorkerCount());
+
+// A BC1 texture with its full mip chain down to 1x1, the levels back to back. Pages of a texture
+// array are scaled up to the largest page, the source size is that of the texture file.
+struct CompressedTexture {
+    int width{0};
+    int height{0};
+    int source_width{0};
+    int source_height{0};
+    const uint8_t* blocks{nullptr};
+    size_t size{0};
+    std::shared_ptr<const void> owner;      // keeps `blocks` alive, e.g. the mapped cache
+    int Levels() const;
+    int LevelWidth(int level) const { return std::max(1, width >> level); }
+    int LevelHeight(int level) const { return std::max(1, height >> level); }
+    size_t LevelOffset(int level) const;
+    size_t LevelSize(int level) const { return BC1Size(LevelWidth(level), LevelHeight(level)); }
+};
+
+// Encodes a BGR8 image and its mip levels (box filtered).
+CompressedTexture CompressTexture(const cv::Mat& image, size_t threads = WorkerCount());
+// The blocks cached next to a texture file (e.g. `page.png.bc1.c3dv`), at the size they were
+// saved at, false if there are none or the texture changed since.
+bool LoadCompressedTexture(const std::string& file, CompressedTexture& texture);
+bool SaveCompressedTexture(const std::string& file, const CompressedTexture& texture);
+
+};
+
+#endif  // _H_TEXTURE_COMPRESSION_
@@ -6,9 +6,553 @@
 
 #include "tinyply.h"
 
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+// Without -mssse3 the SSSE3 swap is still compiled for the CPUs that have it and picked at runtime.
+#if !defined(__SSSE3__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TINYPLY_SSSE3_RUNTIME
+#define TINYPLY_SSSE3_TARGET __attribute__((target("ssse3")))
+#else
+#define TINYPLY_SSSE3_TARGET
+#endif
+#if defined(__SSSE3__) || defined(TINYPLY_SSSE3_RUNTIME)
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace tinyply;
 using namespace std;
 
+/////////////////
+// Mapped File //
+/////////////////
+
+MappedFile::MappedFile(const std::string & path)
+{
+#if !defined(_WIN32)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("could not open file: " + path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("could not stat file: " + path);
+    }
+    length = static_cast<size_t>(st.st_size);
+    if (length > 0)
+    {
+        void * ptr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error("could not map file: " + path);
+        }
+        // The body is consumed front to back, let the kernel read ahead aggressively.
+        ::madvise(ptr, length, MADV_SEQUENTIAL);
+        begin = static_cast<const uint8_t *>(ptr);
+    }
+    ::close(fd);
+#else
+    std::ifstream is(path, std::ios::binary | std::ios::ate);
+    if (!is.good()) throw std::runtime_error("could not open file: " + path);
+    fallback.resize(static_cast<size_t>(is.tellg()));
+    is.seekg(0);
+    is.read(reinterpret_cast<char *>(fallback.data()), fallback.size());
+    begin = fallback.data();
+    length = fallback.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#if !defined(_WIN32)
+    if (begin) ::munmap(const_cast<uint8_t *>(begin), length);
+#endif
+}
+
+MemoryBuffer::MemoryBuffer(const uint8_t * begin, size_t size)
+{
+    char * p = const_cast<char *>(reinterpret_cast<const char *>(begin));
+    setg(p, p, p + size);
+}
+
+MemoryBuffer::pos_type MemoryBuffer::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    char * target = nullptr;
+    if (dir == std::ios_base::beg) target = eback() + off;
+    else if (dir == std::ios_base::cur) target = gptr() + off;
+    else target = egptr() + off;
+
+    if (!(which & std::ios_base::in) || target < eback() || target > egptr()) return pos_type(off_type(-1));
+    setg(eback(), target, egptr());
+    return pos_type(target - eback());
+}
+
+MemoryBuffer::pos_type MemoryBuffer::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+/////////////////
+// Endian Swap //
+/////////////////
+
+void tinyply::endian_swap_buffer_scalar(void * data, size_t count, size_t valueSize)
+{
+    uint8_t * p = static_cast<uint8_t *>(data);
+    switch (valueSize)
+    {
+        case 2: for (size_t i = 0; i < count; ++i, p += 2) { uint16_t v; std::memcpy(&v, p, 2); v = endian_swap(v); std::memcpy(p, &v, 2); } break;
+        case 4: for (size_t i = 0; i < count; ++i, p += 4) { uint32_t v; std::memcpy(&v, p, 4); v = endian_swap(v); std::memcpy(p, &v, 4); } break;
+        case 8: for (size_t i = 0; i < count; ++i, p += 8) { uint64_t v; std::memcpy(&v, p, 8); v = endian_swap(v); std::memcpy(p, &v, 8); } break;
+        default: break;
+    }
+}
+
+#if defined(__SSSE3__) || defined(TINYPLY_SSSE3_RUNTIME)
+namespace
+{
+    // Swaps the whole 16 byte blocks of `bytes` with a byte shuffle, returns how many bytes that is.
+    TINYPLY_SSSE3_TARGET size_t endian_swap_ssse3(uint8_t * p, size_t bytes, size_t valueSize)
+    {
+        const __m128i mask2 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+        const __m128i mask4 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        const __m128i mask8 = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        const __m128i mask = (valueSize == 2) ? mask2 : (valueSize == 4) ? mask4 : mask8;
+        const size_t blocks = bytes / 16;
+        for (size_t i = 0; i < blocks; ++i)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(p + 16 * i), _mm_shuffle_epi8(v, mask));
+        }
+        return 16 * blocks;
+    }
+}
+#endif
+
+void tinyply::endian_swap_buffer(void * data, size_t count, size_t valueSize)
+{
+    if (valueSize != 2 && valueSize != 4 && valueSize != 8) return;
+    uint8_t * p = static_cast<uint8_t *>(data);
+    size_t bytes = count * valueSize;
+
+#if defined(__AVX2__)
+    {
+        const __m256i mask2 = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+        const __m256i mask4 = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        const __m256i mask8 = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        const __m256i mask = (valueSize == 2) ? mask2 : (valueSize == 4) ? mask4 : mask8;
+        for (; bytes >= 32; bytes -= 32, p += 32)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), _mm256_shuffle_epi8(v, mask));
+        }
+    }
+#endif
+#if defined(__SSSE3__)
+    const size_t shuffled = endian_swap_ssse3(p, bytes, valueSize);
+    p += shuffled;
+    bytes -= shuffled;
+#else
+#if defined(TINYPLY_SSSE3_RUNTIME)
+    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+    if (ssse3)
+    {
+        const size_t shuffled = endian_swap_ssse3(p, bytes, valueSize);
+        p += shuffled;
+        bytes -= shuffled;
+    }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    // No byte shuffle: swap 16-bit words with shuffles, then bytes with shifts. 8 byte values
+    // stay on the scalar loop, the three shuffles they need make SSE2 slower than bswap.
+    for (; valueSize != 8 && bytes >= 16; bytes -= 16, p += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        if (valueSize == 4)
+        {
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        }
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+    }
+#endif
+#endif
+    endian_swap_buffer_scalar(p, bytes / valueSize, valueSize);
+}
+
+////////////////////
+// Record Decoder //
+////////////////////
+
+namespace
+{
+    // Copies `count` values of N bytes from strided records into a strided destination. N is
+    // a compile time constant so the copy becomes plain loads and stores.
+    template<size_t N>
+    void copy_column(uint8_t * dest, size_t destStride, const uint8_t * src, size_t srcStride, size_t count, size_t)
+    {
+        for (size_t i = 0; i < count; ++i, dest += destStride, src += srcStride)
+            std::memcpy(dest, src, N);
+    }
+
+    void copy_column_any(uint8_t * dest, size_t destStride, const uint8_t * src, size_t srcStride, size_t count, size_t size)
+    {
+        for (size_t i = 0; i < count; ++i, dest += destStride, src += srcStride)
+            std::memcpy(dest, src, size);
+    }
+
+    typedef void (*ColumnKernel)(uint8_t *, size_t, const uint8_t *, size_t, size_t, size_t);
+
+    ColumnKernel select_column_kernel(size_t size)
+    {
+        switch (size)
+        {
+            case 1:  return copy_column<1>;
+            case 2:  return copy_column<2>;
+            case 3:  return copy_column<3>;
+            case 4:  return copy_column<4>;
+            case 6:  return copy_column<6>;
+            case 8:  return copy_column<8>;
+            case 12: return copy_column<12>;
+            case 16: return copy_column<16>;
+            case 24: return copy_column<24>;
+            default: return copy_column_any;
+        }
+    }
+
+    /////////////////////
+    // Type Conversion //
+    /////////////////////
+
+    template<typename S>
+    inline S load_value(const uint8_t * src, bool swap)
+    {
+        uint8_t bytes[sizeof(S)];
+        if (swap) std::reverse_copy(src, src + sizeof(S), bytes);
+        else std::memcpy(bytes, src, sizeof(S));
+        S v;
+        std::memcpy(&v, bytes, sizeof(S));
+        return v;
+    }
+
+    // Normalized integers follow the OpenGL convention: unsigned maps to [0, 1], signed to [-1, 1].
+    template<typename S>
+    inline double normalized_value(S v)
+    {
+        const double unit = static_cast<double>(v) / static_cast<double>(std::numeric_limits<S>::max());
+        return std::is_signed<S>::value ? std::max(unit, -1.0) : unit;
+    }
+
+    template<typename D>
+    inline D denormalized_value(double v)
+    {
+        v = std::min(std::max(v, std::is_signed<D>::value ? -1.0 : 0.0), 1.0);
+        return static_cast<D>(std::llround(v * static_cast<double>(std::numeric_limits<D>::max())));
+    }
+
+    template<typename S, typename D>
+    inline D convert_value(S v, bool normalize)
+    {
+        if (!normalize || std::is_same<S, D>::value) return static_cast<D>(v);
+        const bool integralSource = std::is_integral<S>::value;
+        const bool integralDest = std::is_integral<D>::value;
+        if (integralSource && !integralDest)
+        {
+            const D unit = static_cast<D>(v) / static_cast<D>(std::numeric_limits<S>::max());
+            return std::is_signed<S>::value ? std::max(unit, D(-1)) : unit;
+        }
+        if (!integralSource && integralDest) return denormalized_value<D>(static_cast<double>(v));
+        if (integralSource && integralDest) return denormalized_value<D>(normalized_value(v));
+        return static_cast<D>(v);
+    }
+
+    // Converts `count` values from strided file records into a strided destination of another
+    // type, byte swapping the source values first if the file is big-endian.
+    template<typename S, typename D>
+    void convert_column(uint8_t * dest, size_t destStride, const uint8_t * src, size_t srcStride, size_t count, bool swap, bool normalize)
+    {
+        for (size_t i = 0; i < count; ++i, dest += destStride, src += srcStride)
+        {
+            const D v = convert_value<S, D>(load_value<S>(src, swap), normalize);
+            std::memcpy(dest, &v, sizeof(D));
+        }
+    }
+
+    typedef void (*ConvertKernel)(uint8_t *, size_t, const uint8_t *, size_t, size_t, bool, bool);
+
+    template<typename S>
+    ConvertKernel select_convert_kernel_to(PlyProperty::Type dest)
+    {
+        switch (dest)
+        {
+            case PlyProperty::Type::INT8:       return convert_column<S, int8_t>;
+            case PlyProperty::Type::UINT8:      return convert_column<S, uint8_t>;
+            case PlyProperty::Type::INT16:      return convert_column<S, int16_t>;
+            case PlyProperty::Type::UINT16:     return convert_column<S, uint16_t>;
+            case PlyProperty::Type::INT32:      return convert_column<S, int32_t>;
+            case PlyProperty::Type::UINT32:     return convert_column<S, uint32_t>;
+            case PlyProperty::Type::FLOAT32:    return convert_column<S, float>;
+            case PlyProperty::Type::FLOAT64:    return convert_column<S, double>;
+            default:                            throw std::invalid_argument("invalid ply property");
+        }
+    }
+
+    ConvertKernel select_convert_kernel(PlyProperty::Type src, PlyProperty::Type dest)
+    {
+        switch (src)
+        {
+            case PlyProperty::Type::INT8:       return select_convert_kernel_to<int8_t>(dest);
+            case PlyProperty::Type::UINT8:      return select_convert_kernel_to<uint8_t>(dest);
+            case PlyProperty::Type::INT16:      return select_convert_kernel_to<int16_t>(dest);
+            case PlyProperty::Type::UINT16:     return select_convert_kernel_to<uint16_t>(dest);
+            case PlyProperty::Type::INT32:      return select_convert_kernel_to<int32_t>(dest);
+            case PlyProperty::Type::UINT32:     return select_convert_kernel_to<uint32_t>(dest);
+            case PlyProperty::Type::FLOAT32:    return select_convert_kernel_to<float>(dest);
+            case PlyProperty::Type::FLOAT64:    return select_convert_kernel_to<double>(dest);
+            default:                            throw std::invalid_argument("invalid ply property");
+        }
+    }
+
+    // Normalizing only changes values that change type (see convert_value), so properties that
+    // are stored as requested keep the direct copy, e.g. uchar colors requested as normalized uchar.
+    inline bool needs_conversion(PlyProperty::Type fileType, const DataCursor & cursor)
+    {
+        return fileType != cursor.type;
+    }
+
+    // Adjacent properties of one cursor that are copied together, e.g. x/y/z as 12 bytes.
+    // Properties that are converted are never merged and use `convert` instead.
+    struct ColumnRun
+    {
+        size_t srcOffset;
+        size_t destOffset;
+        size_t size;
+        ColumnKernel kernel;
+        ConvertKernel convert;
+    };
+
+    // Everything needed to decode the requested properties of an element, computed once per read.
+    struct CursorPlan
+    {
+        std::shared_ptr<DataCursor> cursor;
+        size_t recordBytes = 0;
+        size_t valueSize = 0;
+        bool convert = false;
+        std::vector<ColumnRun> runs;
+    };
+
+    // Runs task(i) for i in [0, count) on separate threads and rethrows the first failure.
+    template<typename Task>
+    void parallel_for(size_t count, const Task & task)
+    {
+        if (count == 1)
+        {
+            task(0);
+            return;
+        }
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> errors(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            threads.emplace_back([&, i]()
+            {
+                try { task(i); }
+                catch (...) { errors[i] = std::current_exception(); }
+            });
+        }
+        for (auto & t : threads) t.join();
+        for (auto & e : errors) if (e) std::rethrow_exception(e);
+    }
+
+    ///////////////////
+    // ASCII Parsing //
+    ///////////////////
+
+    // Locale independent number parsing on a [p, end) range, advancing p past the token.
+
+    inline const char * skip_blanks(const char * p, const char * end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+        return p;
+    }
+
+    inline const char * token_end(const char * p, const char * end)
+    {
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') ++p;
+        return p;
+    }
+
+    inline const char * next_line(const char * p, const char * end)
+    {
+        const char * newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        return newline ? newline + 1 : end;
+    }
+
+    // Correctly rounded parsing through the C locale for everything the fast path rejects.
+    template<typename T>
+    T parse_slow(const char * begin, const char * end)
+    {
+        static thread_local std::istringstream ss = []() { std::istringstream s; s.imbue(std::locale::classic()); return s; }();
+        ss.clear();
+        ss.str(std::string(begin, end));
+        T value = T();
+        ss >> value;
+        return value;
+    }
+
+    const double kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    // Decimal mantissa and exponent of a plain number, false for anything unusual (inf, nan, hex).
+    bool split_decimal(const char * p, const char * end, bool & negative, uint64_t & mantissa, int & exponent)
+    {
+        negative = false;
+        mantissa = 0;
+        exponent = 0;
+        if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+        int digits = 0;
+        bool any = false;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true)
+        {
+            if (mantissa == 0 && *p == '0') continue;
+            if (++digits > 19) return false;
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+        if (p < end && *p == '.')
+        {
+            for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true)
+            {
+                --exponent;
+                if (mantissa == 0 && *p == '0') continue;
+                if (++digits > 19) return false;
+                mantissa = mantissa * 10 + (*p - '0');
+            }
+        }
+        if (!any) return false;
+        if (p < end && (*p == 'e' || *p == 'E'))
+        {
+            ++p;
+            bool negativeExponent = false;
+            if (p < end && (*p == '-' || *p == '+')) negativeExponent = (*p++ == '-');
+            if (p == end || *p < '0' || *p > '9') return false;
+            int e = 0;
+            for (; p < end && *p >= '0' && *p <= '9'; ++p) if (e < 10000) e = e * 10 + (*p - '0');
+            exponent += negativeExponent ? -e : e;
+        }
+        return p == end;
+    }
+
+    // Clinger's fast path: exact whenever mantissa and power of ten are exactly representable.
+    bool fast_double(const char * begin, const char * end, double & value)
+    {
+        bool negative;
+        uint64_t mantissa;
+        int exponent;
+        if (!split_decimal(begin, end, negative, mantissa, exponent)) return false;
+        if (mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22) return mantissa == 0 ? (value = negative ? -0.0 : 0.0, true) : false;
+        value = static_cast<double>(mantissa);
+        value = (exponent < 0) ? value / kPow10[-exponent] : value * kPow10[exponent];
+        if (negative) value = -value;
+        return true;
+    }
+
+    template<typename T> T parse_real(const char * begin, const char * end);
+
+    template<> double parse_real<double>(const char * begin, const char * end)
+    {
+        double value;
+        return fast_double(begin, end, value) ? value : parse_slow<double>(begin, end);
+    }
+
+    template<> float parse_real<float>(const char * begin, const char * end)
+    {
+        // Rounding through double is exact unless the double lands exactly halfway between two floats.
+        double value;
+        if (fast_double(begin, end, value))
+        {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            if ((bits & 0x1fffffff) != 0x10000000 || value == 0.0) return static_cast<float>(value);
+        }
+        return parse_slow<float>(begin, end);
+    }
+
+    template<typename T>
+    T parse_integer(const char * begin, const char * end)
+    {
+        const char * p = begin;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+        if (p == end || end - p > 18) return parse_slow<T>(begin, end);
+        int64_t value = 0;
+        for (; p < end; ++p)
+        {
+            if (*p < '0' || *p > '9') return parse_slow<T>(begin, end);
+            value = value * 10 + (*p - '0');
+        }
+        return static_cast<T>(negative ? -value : value);
+    }
+
+    // Parses the token at p into dest as type t and returns the position after it.
+    const char * parse_ascii_value(PlyProperty::Type t, const char * p, const char * end, uint8_t * dest)
+    {
+        p = skip_blanks(p, end);
+        const char * e = token_end(p, end);
+        if (e == p) throw std::runtime_error("unexpected end of line in ascii ply");
+        switch (t)
+        {
+            case PlyProperty::Type::INT8:       { int8_t v = static_cast<int8_t>(parse_integer<int32_t>(p, e));     std::memcpy(dest, &v, 1); break; }
+            case PlyProperty::Type::UINT8:      { uint8_t v = static_cast<uint8_t>(parse_integer<uint32_t>(p, e));  std::memcpy(dest, &v, 1); break; }
+            case PlyProperty::Type::INT16:      { int16_t v = parse_integer<int16_t>(p, e);     std::memcpy(dest, &v, 2); break; }
+            case PlyProperty::Type::UINT16:     { uint16_t v = parse_integer<uint16_t>(p, e);   std::memcpy(dest, &v, 2); break; }
+            case PlyProperty::Type::INT32:      { int32_t v = parse_integer<int32_t>(p, e);     std::memcpy(dest, &v, 4); break; }
+            case PlyProperty::Type::UINT32:     { uint32_t v = parse_integer<uint32_t>(p, e);   std::memcpy(dest, &v, 4); break; }
+            case PlyProperty::Type::FLOAT32:    { float v = parse_real<float>(p, e);            std::memcpy(dest, &v, 4); break; }
+            case PlyProperty::Type::FLOAT64:    { double v = parse_real<double>(p, e);          std::memcpy(dest, &v, 8); break; }
+            case PlyProperty::Type::INVALID:    throw std::invalid_argument("invalid ply property");
+        }
+        return e;
+    }
+
+    // Parses the token at p into the cursor and advances it, converting to the cursor's type if needed.
+    const char * parse_ascii_value(PlyProperty::Type t, const char * p, const char * end, DataCursor & cursor)
+    {
+        uint8_t * dest = cursor.data + cursor.offset;
+        cursor.offset += PropertyTable[cursor.type].stride;
+        if (!needs_conversion(t, cursor)) return parse_ascii_value(t, p, end, dest);
+        alignas(8) uint8_t value[8];
+        p = parse_ascii_value(t, p, end, value);
+        select_convert_kernel(t, cursor.type)(dest, 0, value, 0, 1, false, cursor.normalize);
+        return p;
+    }
+
+    const char * skip_ascii_value(const char * p, const char * end)
+    {
+        p = skip_blanks(p, end);
+        const char * e = token_end(p, end);
+        if (e == p) throw std::runtime_error("unexpected end of line in ascii ply");
+        return e;
+    }
+}
+
 //////////////////
 // PLY Property //
 //////////////////
@@ -59,6 +603,18 @@ PlyFile::PlyFile(std::istream & is)
     }
 }
 
+PlyFile::PlyFile(std::shared_ptr<MappedFile> file) : mapping(file)
+{
+    MemoryBuffer buffer(mapping->data(), mapping->size());
+    std::istream is(&buffer);
+    if (!parse_header(is))
+    {
+        throw std::runtime_error("file is not ply or encounted junk in header");
+    }
+    const std::streampos position = is.tellg();
+    dataOffset = (position == std::streampos(-1)) ? mapping->size() : static_cast<size_t>(position);
+}
+
 bool PlyFile::parse_header(std::istream & is)
 {
     std::string line;
@@ -109,69 +665,53 @@ void PlyFile::read_header_property(std::istream & is)
 
 size_t PlyFile::skip_property_binary(const PlyProperty & property, std::istream & is)
 {
-    static std::vector<char> skip(PropertyTable[property.propertyType].stride);
     if (property.isList)
     {
 		size_t listSize = 0;
 		size_t dummyCount = 0;
         read_property_binary(property.listType, &listSize, dummyCount, is);
-        for (size_t i = 0; i < listSize; ++i) is.read(skip.data(), PropertyTable[property.propertyType].stride);
+        is.ignore(listSize * PropertyTable[property.propertyType].stride);
         return listSize;
     }
     else
     {
-        is.read(skip.data(), PropertyTable[property.propertyType].stride);
+        is.ignore(PropertyTable[property.propertyType].stride);
         return 0;
     }
 }
 
-void PlyFile::skip_property_ascii(const PlyProperty & property, std::istream & is)
-{
-    std::string skip;
-    if (property.isList)
-    {
-        int listSize;
-        is >> listSize;
-        for (int i = 0; i < listSize; ++i) is >> skip;
-    }
-    else is >> skip;
-}
-
 void PlyFile::read_property_binary(PlyProperty::Type t, void * dest, size_t & destOffset, std::istream & is)
 {
-    static std::vector<char> src(PropertyTable[t].stride);
-    is.read(src.data(), PropertyTable[t].stride);
+    char src[8];
+    is.read(src, PropertyTable[t].stride);
 
     switch (t)
     {
-        case PlyProperty::Type::INT8:       ply_cast<int8_t>(dest, src.data(), isBigEndian);        break;
-        case PlyProperty::Type::UINT8:      ply_cast<uint8_t>(dest, src.data(), isBigEndian);       break;
-        case PlyProperty::Type::INT16:      ply_cast<int16_t>(dest, src.data(), isBigEndian);       break;
-        case PlyProperty::Type::UINT16:     ply_cast<uint16_t>(dest, src.data(), isBigEndian);      break;
-        case PlyProperty::Type::INT32:      ply_cast<int32_t>(dest, src.data(), isBigEndian);       break;
-        case PlyProperty::Type::UINT32:     ply_cast<uint32_t>(dest, src.data(), isBigEndian);      break;
-        case PlyProperty::Type::FLOAT32:    ply_cast_float<float>(dest, src.data(), isBigEndian);   break;
-        case PlyProperty::Type::FLOAT64:    ply_cast_double<double>(dest, src.data(), isBigEndian); break;
+        case PlyProperty::Type::INT8:       ply_cast<int8_t>(dest, src, isBigEndian);        break;
+        case PlyProperty::Type::UINT8:      ply_cast<uint8_t>(dest, src, isBigEndian);       break;
+        case PlyProperty::Type::INT16:      ply_cast<int16_t>(dest, src, isBigEndian);       break;
+        case PlyProperty::Type::UINT16:     ply_cast<uint16_t>(dest, src, isBigEndian);      break;
+        case PlyProperty::Type::INT32:      ply_cast<int32_t>(dest, src, isBigEndian);       break;
+        case PlyProperty::Type::UINT32:     ply_cast<uint32_t>(dest, src, isBigEndian);      break;
+        case PlyProperty::Type::FLOAT32:    ply_cast_float<float>(dest, src, isBigEndian);   break;
+        case PlyProperty::Type::FLOAT64:    ply_cast_double<double>(dest, src, isBigEndian); break;
         case PlyProperty::Type::INVALID:    throw std::invalid_argument("invalid ply property");
     }
     destOffset += PropertyTable[t].stride;
 }
 
-void PlyFile::read_property_ascii(PlyProperty::Type t, void * dest, size_t & destOffset, std::istream & is)
+void PlyFile::read_property_binary(PlyProperty::Type t, DataCursor & cursor, std::istream & is)
 {
-    switch (t)
+    if (!needs_conversion(t, cursor))
     {
-        case PlyProperty::Type::INT8:       *((int8_t *)dest) = ply_read_ascii<int32_t>(is);        break;
-        case PlyProperty::Type::UINT8:      *((uint8_t *)dest) = ply_read_ascii<uint32_t>(is);      break;
-        case PlyProperty::Type::INT16:      ply_cast_ascii<int16_t>(dest, is);                      break;
-        case PlyProperty::Type::UINT16:     ply_cast_ascii<uint16_t>(dest, is);                     break;
-        case PlyProperty::Type::INT32:      ply_cast_ascii<int32_t>(dest, is);                      break;
-        case PlyProperty::Type::UINT32:     ply_cast_ascii<uint32_t>(dest, is);                     break;
-        case PlyProperty::Type::FLOAT32:    ply_cast_ascii<float>(dest, is);                        break;
-        case PlyProperty::Type::FLOAT64:    ply_cast_ascii<double>(dest, is);                       break;
-        case PlyProperty::Type::INVALID:    throw std::invalid_argument("invalid ply property");
+        read_property_binary(t, cursor.data + cursor.offset, cursor.offset, is);
+        return;
     }
-    destOffset += PropertyTable[t].stride;
+    alignas(8) uint8_t value[8];
+    size_t dummyCount = 0;
+    read_property_binary(t, value, dummyCount, is);
+    select_convert_kernel(t, cursor.type)(cursor.data + cursor.offset, 0, value, 0, 1, false, cursor.normalize);
+    cursor.offset += PropertyTable[cursor.type].stride;
 }
 
 void PlyFile::write_property_ascii(PlyProperty::Type t, std::ostream & os, uint8_t * src, size_t & srcOffset)
@@ -203,6 +743,248 @@ void PlyFile::read(std::istream & is)
     read_internal(is);
 }
 
+void PlyFile::read()
+{
+    if (!mapping) throw std::runtime_error("file was not opened from a mapping");
+    MemoryBuffer buffer(mapping->data() + dataOffset, mapping->size() - dataOffset);
+    std::istream is(&buffer);
+    read_internal(is);
+}
+
+void PlyFile::read_batches(std::istream & is, const std::string & elementKey, size_t batchSize, const BatchCallback & callback)
+{
+    read_internal(is, elementKey, batchSize, callback);
+}
+
+void PlyFile::read_batches(const std::string & elementKey, size_t batchSize, const BatchCallback & callback)
+{
+    if (!mapping) throw std::runtime_error("file was not opened from a mapping");
+    MemoryBuffer buffer(mapping->data() + dataOffset, mapping->size() - dataOffset);
+    std::istream is(&buffer);
+    read_internal(is, elementKey, batchSize, callback);
+}
+
+size_t PlyFile::element_stride(const PlyElement & element) const
+{
+    size_t stride = 0;
+    for (const auto & p : element.properties)
+    {
+        if (p.isList) return 0;
+        stride += PropertyTable[p.propertyType].stride;
+    }
+    return stride;
+}
+
+const uint64_t PlyIndex::unknown;
+
+void PlyFile::reset_index()
+{
+    // Everything that follows only fixed-size elements is known from the header.
+    index.elementOffsets.assign(elements.size() + 1, PlyIndex::unknown);
+    index.recordOffsets.clear();
+    uint64_t offset = 0;
+    for (size_t i = 0; i < elements.size(); ++i)
+    {
+        index.elementOffsets[i] = offset;
+        const size_t stride = element_stride(elements[i]);
+        if (stride == 0 && elements[i].size > 0) return;
+        offset += uint64_t(stride) * elements[i].size;
+    }
+    index.elementOffsets.back() = offset;
+}
+
+size_t PlyFile::element_offset(size_t elementIndex)
+{
+    if (index.elementOffsets.size() != elements.size() + 1) reset_index();
+    if (index.elementOffsets[elementIndex] == PlyIndex::unknown && mapping && isBinary)
+    {
+        // Walking the preceding list elements in memory is cheap, remember where they end.
+        MemoryBuffer buffer(mapping->data() + dataOffset, mapping->size() - dataOffset);
+        std::istream is(&buffer);
+        uint64_t position = 0;
+        for (size_t i = 0; i < elementIndex; ++i)
+        {
+            skip_element_binary(i, is, position, nullptr);
+            if (!is.good()) return std::string::npos;
+            position = index.elementOffsets[i + 1];
+        }
+    }
+    const uint64_t offset = index.elementOffsets[elementIndex];
+    return (offset == PlyIndex::unknown) ? std::string::npos : static_cast<size_t>(dataOffset + offset);
+}
+
+void PlyFile::skip_bytes(std::istream & is, size_t bytes)
+{
+    // Seeking an ifstream drops its buffer, so short gaps are consumed instead. Streams that
+    // can not seek (pipes) are read through.
+    if (bytes >= (1 << 16))
+    {
+        is.seekg(bytes, std::ios_base::cur);
+        if (!is.fail()) return;
+        is.clear();
+    }
+    if (bytes > 0) is.ignore(bytes);
+}
+
+void PlyFile::skip_element_binary(size_t elementIndex, std::istream & is, uint64_t position, std::vector<uint64_t> * recordOffsets)
+{
+    // Without a known position (a stream that can not tell) the element is read through and
+    // nothing is added to the index.
+    const PlyElement & element = elements[elementIndex];
+    uint64_t & end = index.elementOffsets[elementIndex + 1];
+    const bool known = (position != PlyIndex::unknown);
+    const size_t stride = element_stride(element);
+    if (stride > 0 || (known && end != PlyIndex::unknown && !recordOffsets))
+    {
+        const uint64_t bytes = (stride > 0) ? uint64_t(stride) * element.size : end - position;
+        skip_bytes(is, bytes);
+        if (known) end = position + bytes;
+        return;
+    }
+
+    // One pass over the list records: read the list sizes, skip everything else.
+    if (recordOffsets) recordOffsets->resize(element.size);
+    for (size_t count = 0; count < element.size; ++count)
+    {
+        if (recordOffsets) (*recordOffsets)[count] = position;
+        size_t pending = 0;
+        for (const auto & property : element.properties)
+        {
+            const size_t valueSize = PropertyTable[property.propertyType].stride;
+            if (!property.isList)
+            {
+                pending += valueSize;
+                continue;
+            }
+            skip_bytes(is, pending);
+            position += pending;
+            pending = 0;
+
+            size_t listSize = 0;
+            size_t dummyCount = 0;
+            read_property_binary(property.listType, &listSize, dummyCount, is);
+            position += PropertyTable[property.listType].stride;
+            pending = listSize * valueSize;
+        }
+        skip_bytes(is, pending);
+        position += pending;
+    }
+    if (is.good() && known) end = position;
+}
+
+const PlyIndex & PlyFile::build_index(std::istream & is)
+{
+    if (!isBinary) throw std::runtime_error("offset index requires a binary body");
+    const std::streampos start = is.tellg();
+    reset_index();
+    uint64_t position = 0;
+    for (size_t i = 0; i < elements.size(); ++i)
+    {
+        std::vector<uint64_t> * records = (element_stride(elements[i]) == 0) ? &index.recordOffsets[elements[i].name] : nullptr;
+        skip_element_binary(i, is, position, records);
+        if (!is.good()) throw std::runtime_error("unexpected end of file");
+        index.elementOffsets[i] = position;
+        position = index.elementOffsets[i + 1];
+    }
+    is.seekg(start);
+    return index;
+}
+
+const PlyIndex & PlyFile::build_index()
+{
+    if (!mapping) throw std::runtime_error("file was not opened from a mapping");
+    MemoryBuffer buffer(mapping->data() + dataOffset, mapping->size() - dataOffset);
+    std::istream is(&buffer);
+    return build_index(is);
+}
+
+bool PlyFile::set_index(const PlyIndex & cached)
+{
+    if (cached.elementOffsets.size() != elements.size() + 1) return false;
+    // Offsets implied by the header have to agree.
+    for (size_t i = 0; i < elements.size(); ++i)
+    {
+        const size_t stride = element_stride(elements[i]);
+        if (stride > 0 && cached.elementOffsets[i] != PlyIndex::unknown && cached.elementOffsets[i + 1] != PlyIndex::unknown &&
+            cached.elementOffsets[i + 1] - cached.elementOffsets[i] != uint64_t(stride) * elements[i].size) return false;
+        auto records = cached.recordOffsets.find(elements[i].name);
+        if (records != cached.recordOffsets.end() && records->second.size() != elements[i].size) return false;
+    }
+    if (mapping && cached.elementOffsets.back() != PlyIndex::unknown && cached.elementOffsets.back() > mapping->size() - dataOffset) return false;
+    index = cached;
+    return true;
+}
+
+void PlyIndex::save(std::ostream & os) const
+{
+    const uint64_t magic = 0x7864692d796c70ULL; // "ply-idx"
+    const uint64_t elementCount = elementOffsets.size();
+    const uint64_t listCount = recordOffsets.size();
+    os.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+    os.write(reinterpret_cast<const char *>(&elementCount), sizeof(elementCount));
+    os.write(reinterpret_cast<const char *>(elementOffsets.data()), elementCount * sizeof(uint64_t));
+    os.write(reinterpret_cast<const char *>(&listCount), sizeof(listCount));
+    for (const auto & records : recordOffsets)
+    {
+        const uint64_t nameSize = records.first.size();
+        const uint64_t recordCount = records.second.size();
+        os.write(reinterpret_cast<const char *>(&nameSize), sizeof(nameSize));
+        os.write(records.first.data(), nameSize);
+        os.write(reinterpret_cast<const char *>(&recordCount), sizeof(recordCount));
+        os.write(reinterpret_cast<const char *>(records.second.data()), recordCount * sizeof(uint64_t));
+    }
+}
+
+bool PlyIndex::load(std::istream & is)
+{
+    uint64_t magic = 0, elementCount = 0, listCount = 0;
+    is.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    is.read(reinterpret_cast<char *>(&elementCount), sizeof(elementCount));
+    if (!is.good() || magic != 0x7864692d796c70ULL || elementCount > (1 << 20)) return false;
+    elementOffsets.resize(elementCount);
+    is.read(reinterpret_cast<char *>(elementOffsets.data()), elementCount * sizeof(uint64_t));
+    is.read(reinterpret_cast<char *>(&listCount), sizeof(listCount));
+    recordOffsets.clear();
+    for (uint64_t i = 0; i < listCount && is.good(); ++i)
+    {
+        uint64_t nameSize = 0, recordCount = 0;
+        is.read(reinterpret_cast<char *>(&nameSize), sizeof(nameSize));
+        if (!is.good() || nameSize > 4096) return false;
+        std::string name(nameSize, ' ');
+        is.read(&name[0], nameSize);
+        is.read(reinterpret_cast<char *>(&recordCount), sizeof(recordCount));
+        if (!is.good()) return false;
+        std::vector<uint64_t> & records = recordOffsets[name];
+        records.resize(recordCount);
+        is.read(reinterpret_cast<char *>(records.data()), recordCount * sizeof(uint64_t));
+    }
+    return is.good();
+}
+
+bool PlyFile::has_fixed_layout(const std::string & elementKey)
+{
+    return !get_element_view(elementKey).empty();
+}
+
+ElementView PlyFile::get_element_view(const std::string & elementKey)
+{
+    ElementView view;
+    if (!mapping || !isBinary || isBigEndian) return view;
+
+    const int idx = find_element(elementKey, elements);
+    if (idx < 0) return view;
+
+    const PlyElement & e = elements[idx];
+    const size_t stride = element_stride(e);
+    const size_t offset = element_offset(idx);
+    if (stride == 0 || offset == std::string::npos || offset + stride * e.size > mapping->size()) return view;
+
+    view.data = mapping->data() + offset;
+    view.stride = stride;
+    view.count = e.size;
+    return view;
+}
+
 void PlyFile::write(std::ostream & os, bool isBinary)
 {
     if (isBinary) write_binary_internal(os);
@@ -303,58 +1085,393 @@ void PlyFile::write_header(std::ostream & os)
     os << "end_header" << std::endl;
 }
 
-void PlyFile::read_internal(std::istream & is)
+void PlyFile::read_records_binary(const PlyElement & element, std::istream & is, size_t recordCount)
 {
-    std::function<void(PlyProperty::Type t, void * dest, size_t & destOffset, std::istream & is)> read;
-    std::function<void(const PlyProperty & property, std::istream & is)> skip;
-    if (isBinary)
+    const size_t stride = element_stride(element);
+
+    // Build the per-layout plan: which bytes of a record go where in which destination.
+    std::vector<CursorPlan> plans;
+    size_t srcOffset = 0;
+    for (const auto & property : element.properties)
+    {
+        const size_t size = PropertyTable[property.propertyType].stride;
+        auto it = userDataTable.find(make_key(element.name, property.name));
+        if (it != userDataTable.end() && it->second)
+        {
+            auto plan = std::find_if(plans.begin(), plans.end(), [&](const CursorPlan & p) { return p.cursor == it->second; });
+            if (plan == plans.end())
+            {
+                plans.emplace_back();
+                plan = plans.end() - 1;
+                plan->cursor = it->second;
+                plan->valueSize = PropertyTable[plan->cursor->type].stride;
+            }
+            plan->convert = plan->convert || needs_conversion(property.propertyType, *plan->cursor);
+            plan->runs.push_back({ srcOffset, plan->recordBytes, size, nullptr, select_convert_kernel(property.propertyType, plan->cursor->type) });
+            plan->recordBytes += plan->valueSize;
+        }
+        srcOffset += size;
+    }
+
+    // Without conversion source and destination layouts match: adjacent properties are copied
+    // together and byte swapped in bulk afterwards.
+    for (auto & plan : plans)
+    {
+        if (plan.convert) continue;
+        std::vector<ColumnRun> merged;
+        for (const auto & run : plan.runs)
+        {
+            if (!merged.empty() && merged.back().srcOffset + merged.back().size == run.srcOffset) merged.back().size += run.size;
+            else merged.push_back(run);
+        }
+        for (auto & run : merged) run.kernel = select_column_kernel(run.size);
+        plan.runs.swap(merged);
+    }
+
+    // Decode in blocks, straight from memory if the stream is backed by a mapping.
+    MemoryBuffer * memory = dynamic_cast<MemoryBuffer *>(is.rdbuf());
+    const size_t blockRecords = std::max<size_t>(1, (1 << 16) / stride);
+    std::vector<uint8_t> scratch(memory ? 0 : blockRecords * stride);
+
+    for (size_t first = 0; first < recordCount; first += blockRecords)
+    {
+        const size_t count = std::min(blockRecords, recordCount - first);
+        const size_t bytes = count * stride;
+        const uint8_t * block = nullptr;
+        if (memory)
+        {
+            if (memory->remaining() < bytes) throw std::runtime_error("unexpected end of file");
+            block = memory->current();
+        }
+        else
+        {
+            is.read(reinterpret_cast<char *>(scratch.data()), bytes);
+            if (static_cast<size_t>(is.gcount()) != bytes) throw std::runtime_error("unexpected end of file");
+            block = scratch.data();
+        }
+
+        for (auto & plan : plans)
+        {
+            uint8_t * dest = plan.cursor->data + plan.cursor->offset;
+            for (const auto & run : plan.runs)
+            {
+                if (plan.convert) run.convert(dest + run.destOffset, plan.recordBytes, block + run.srcOffset, stride, count, isBigEndian, plan.cursor->normalize);
+                else run.kernel(dest + run.destOffset, plan.recordBytes, block + run.srcOffset, stride, count, run.size);
+            }
+            if (isBigEndian && !plan.convert) endian_swap_buffer(dest, count * plan.recordBytes / plan.valueSize, plan.valueSize);
+            plan.cursor->offset += count * plan.recordBytes;
+        }
+
+        if (memory) is.seekg(bytes, std::ios_base::cur);
+    }
+}
+
+const char * PlyFile::read_records_ascii(const PlyElement & element, const char * p, const char * end, size_t recordCount)
+{
+    const bool requested = std::find(requestedElements.begin(), requestedElements.end(), element.name) != requestedElements.end();
+    const bool fixed = element_stride(element) > 0;
+    const size_t threadCount = std::max<size_t>(1, std::thread::hardware_concurrency());
+    const size_t minLinesPerChunk = 4096;
+
+    if (requested && fixed)
+    {
+        // One record per line: split the records into line aligned chunks while finding their end,
+        // then parse the chunks in parallel. Each chunk knows its first record, so it writes
+        // straight to its final offset in the destination vectors.
+        const size_t linesPerChunk = std::max(minLinesPerChunk, (recordCount + threadCount - 1) / threadCount);
+        std::vector<const char *> chunkBegin;
+        std::vector<size_t> chunkFirst;
+        for (size_t line = 0; line < recordCount; ++line)
+        {
+            if (p >= end) throw std::runtime_error("unexpected end of file");
+            if (line % linesPerChunk == 0)
+            {
+                chunkBegin.push_back(p);
+                chunkFirst.push_back(line);
+            }
+            p = next_line(p, end);
+        }
+        chunkBegin.push_back(p);
+        chunkFirst.push_back(recordCount);
+
+        struct Target { uint8_t * data; size_t recordBytes; size_t destOffset; ConvertKernel convert; bool normalize; };
+        std::vector<Target> targets;
+        std::map<DataCursor *, size_t> recordBytes;
+        for (const auto & property : element.properties)
+        {
+            auto it = userDataTable.find(make_key(element.name, property.name));
+            DataCursor * cursor = (it != userDataTable.end()) ? it->second.get() : nullptr;
+            if (!cursor)
+            {
+                targets.push_back({ nullptr, 0, 0, nullptr, false });
+                continue;
+            }
+            size_t & bytes = recordBytes[cursor];
+            const ConvertKernel convert = needs_conversion(property.propertyType, *cursor) ? select_convert_kernel(property.propertyType, cursor->type) : nullptr;
+            targets.push_back({ cursor->data + cursor->offset, 0, bytes, convert, cursor->normalize });
+            bytes += PropertyTable[cursor->type].stride;
+        }
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            auto it = userDataTable.find(make_key(element.name, element.properties[i].name));
+            if (targets[i].data) targets[i].recordBytes = recordBytes[it->second.get()];
+        }
+
+        parallel_for(chunkBegin.size() - 1, [&](size_t chunk)
+        {
+            const char * q = chunkBegin[chunk];
+            for (size_t record = chunkFirst[chunk]; record < chunkFirst[chunk + 1]; ++record)
+            {
+                const char * lineEnd = next_line(q, end);
+                for (size_t i = 0; i < targets.size(); ++i)
+                {
+                    const Target & target = targets[i];
+                    if (!target.data)
+                    {
+                        q = skip_ascii_value(q, lineEnd);
+                        continue;
+                    }
+                    uint8_t * dest = target.data + record * target.recordBytes + target.destOffset;
+                    if (target.convert)
+                    {
+                        alignas(8) uint8_t value[8];
+                        q = parse_ascii_value(element.properties[i].propertyType, q, lineEnd, value);
+                        target.convert(dest, 0, value, 0, 1, false, target.normalize);
+                    }
+                    else q = parse_ascii_value(element.properties[i].propertyType, q, lineEnd, dest);
+                }
+                q = lineEnd;
+            }
+        });
+
+        for (auto & bytes : recordBytes) bytes.first->offset += bytes.second * recordCount;
+    }
+    else if (requested)
     {
-        read = [&](PlyProperty::Type t, void * dest, size_t & destOffset, std::istream & is) { read_property_binary(t, dest, destOffset, is); };
-        skip = [&](const PlyProperty & property, std::istream & is) { skip_property_binary(property, is); };
+        // Variable length records are parsed serially.
+        for (size_t count = 0; count < recordCount; ++count)
+        {
+            if (p >= end) throw std::runtime_error("unexpected end of file");
+            const char * lineEnd = next_line(p, end);
+            for (auto & property : element.properties)
+            {
+                auto it = userDataTable.find(make_key(element.name, property.name));
+                DataCursor * cursor = (it != userDataTable.end()) ? it->second.get() : nullptr;
+                if (property.isList)
+                {
+                    uint32_t listSize = 0;
+                    p = parse_ascii_value(PlyProperty::Type::UINT32, p, lineEnd, reinterpret_cast<uint8_t *>(&listSize));
+                    if (cursor && cursor->realloc == false)
+                    {
+                        cursor->realloc = true;
+                        resize_vector(cursor->type, cursor->vector, listSize * element.size, cursor->data);
+                    }
+                    for (size_t i = 0; i < listSize; ++i)
+                    {
+                        if (cursor) p = parse_ascii_value(property.propertyType, p, lineEnd, *cursor);
+                        else p = skip_ascii_value(p, lineEnd);
+                    }
+                }
+                else if (cursor)
+                {
+                    p = parse_ascii_value(property.propertyType, p, lineEnd, *cursor);
+                }
+                else p = skip_ascii_value(p, lineEnd);
+            }
+            p = lineEnd;
+        }
     }
     else
     {
-        read = [&](PlyProperty::Type t, void * dest, size_t & destOffset, std::istream & is) { read_property_ascii(t, dest, destOffset, is); };
-        skip = [&](const PlyProperty & property, std::istream & is) { skip_property_ascii(property, is); };
+        for (size_t line = 0; line < recordCount && p < end; ++line) p = next_line(p, end);
     }
-    
-    for (auto & element : get_elements())
+    return p;
+}
+
+void PlyFile::read_element_binary(const PlyElement & element, std::istream & is)
+{
+    const bool requested = std::find(requestedElements.begin(), requestedElements.end(), element.name) != requestedElements.end();
+
+    // Fixed-size records skip the per-scalar dispatch below.
+    if (requested && element_stride(element) > 0)
+    {
+        read_records_binary(element, is, element.size);
+        return;
+    }
+
+    for (size_t count = 0; count < element.size; ++count)
     {
-        if (std::find(requestedElements.begin(), requestedElements.end(), element.name) != requestedElements.end())
+        for (auto & property : element.properties)
         {
-            for (size_t count = 0; count < element.size; ++count)
+            auto it = requested ? userDataTable.find(make_key(element.name, property.name)) : userDataTable.end();
+            if (it != userDataTable.end() && it->second)
             {
-                for (auto & property : element.properties)
+                auto & cursor = it->second;
+                if (property.isList)
                 {
-                    if (auto & cursor = userDataTable[make_key(element.name, property.name)])
+                    size_t listSize = 0;
+                    size_t dummyCount = 0;
+                    read_property_binary(property.listType, &listSize, dummyCount, is);
+                    if (cursor->realloc == false)
                     {
-                        if (property.isList)
-                        {
-							size_t listSize = 0;
-							size_t dummyCount = 0;
-                            read(property.listType, &listSize, dummyCount, is);
-                            if (cursor->realloc == false)
-                            {
-                                cursor->realloc = true;
-                                resize_vector(property.propertyType, cursor->vector, listSize * element.size, cursor->data);
-                            }
-                            for (size_t i = 0; i < listSize; ++i)
-                            {
-                                read(property.propertyType, (cursor->data + cursor->offset), cursor->offset, is);
-                            }
-                        }
-                        else
-                        {
-                            read(property.propertyType, (cursor->data + cursor->offset), cursor->offset, is);
-                        }
+                        cursor->realloc = true;
+                        resize_vector(cursor->type, cursor->vector, listSize * element.size, cursor->data);
                     }
-                    else
+                    for (size_t i = 0; i < listSize; ++i)
                     {
-                        skip(property, is);
+                        read_property_binary(property.propertyType, *cursor, is);
                     }
                 }
+                else
+                {
+                    read_property_binary(property.propertyType, *cursor, is);
+                }
+            }
+            else
+            {
+                skip_property_binary(property, is);
+            }
+        }
+    }
+}
+
+void PlyFile::allocate_cursors(const std::string & streamedElement, size_t batchSize)
+{
+    // Cursors are shared by the properties of one request, allocate each once.
+    std::vector<DataCursor *> done;
+    for (auto & entry : userDataTable)
+    {
+        DataCursor * cursor = entry.second.get();
+        if (!cursor || std::find(done.begin(), done.end(), cursor) != done.end()) continue;
+        done.push_back(cursor);
+
+        size_t size = cursor->size;
+        const bool streamed = !streamedElement.empty() && entry.first.compare(0, streamedElement.size() + 1, streamedElement + "-") == 0;
+        if (streamed)
+        {
+            const PlyElement & e = elements[find_element(streamedElement, elements)];
+            size = (e.size > 0) ? std::min(e.size, batchSize) * (cursor->size / e.size) : 0;
+        }
+        resize_vector(cursor->type, cursor->vector, size, cursor->data, streamed);
+        cursor->offset = 0;
+    }
+}
+
+void PlyFile::reset_cursors(const PlyElement & element)
+{
+    for (const auto & property : element.properties)
+    {
+        auto it = userDataTable.find(make_key(element.name, property.name));
+        if (it != userDataTable.end() && it->second) it->second->offset = 0;
+    }
+}
+
+void PlyFile::read_internal(std::istream & is, const std::string & streamedElement, size_t batchSize, const BatchCallback & callback)
+{
+    if (!streamedElement.empty())
+    {
+        const int idx = find_element(streamedElement, elements);
+        if (idx < 0) throw std::invalid_argument("element not found: " + streamedElement);
+        if (element_stride(elements[idx]) == 0) throw std::invalid_argument("streamed elements can not have list properties");
+        if (batchSize == 0) throw std::invalid_argument("batch size must be positive");
+        if (std::find(requestedElements.begin(), requestedElements.end(), streamedElement) == requestedElements.end())
+            requestedElements.push_back(streamedElement);
+    }
+    allocate_cursors(streamedElement, batchSize);
+
+    if (!isBinary)
+    {
+        // The whole ASCII body is parsed from memory: the mapping itself or one bulk read of the stream.
+        std::vector<char> storage;
+        const char * begin = nullptr;
+        const char * end = nullptr;
+        if (MemoryBuffer * memory = dynamic_cast<MemoryBuffer *>(is.rdbuf()))
+        {
+            begin = reinterpret_cast<const char *>(memory->current());
+            end = begin + memory->remaining();
+        }
+        else
+        {
+            const std::streampos start = is.tellg();
+            is.seekg(0, std::ios_base::end);
+            const std::streampos stop = is.tellg();
+            if (start != std::streampos(-1) && stop != std::streampos(-1))
+            {
+                is.seekg(start);
+                storage.resize(static_cast<size_t>(stop - start));
+                is.read(storage.data(), storage.size());
+                storage.resize(static_cast<size_t>(is.gcount()));
             }
+            else
+            {
+                is.clear();
+                storage.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+            }
+            begin = storage.data();
+            end = begin + storage.size();
+        }
+
+        const char * p = begin;
+        for (auto & element : get_elements())
+        {
+            if (std::find_if(&element, &elements.back() + 1, [&](const PlyElement & e)
+                { return std::find(requestedElements.begin(), requestedElements.end(), e.name) != requestedElements.end(); }) == &elements.back() + 1) break;
+            if (element.name != streamedElement)
+            {
+                p = read_records_ascii(element, p, end, element.size);
+                continue;
+            }
+            for (size_t first = 0; first < element.size; first += batchSize)
+            {
+                const size_t count = std::min(batchSize, element.size - first);
+                reset_cursors(element);
+                p = read_records_ascii(element, p, end, count);
+                if (!callback(first, count)) return;
+            }
+        }
+        return;
+    }
+
+    // Elements after the last requested one are never touched. Unrequested elements in between
+    // are skipped by seeking, list elements are walked once and their end remembered in the index.
+    // Where the stream can not tell its position, the ends stay unknown and every element after
+    // is walked or read in order.
+    if (index.elementOffsets.size() != elements.size() + 1) reset_index();
+    const std::streampos bodyStart = is.tellg();
+    uint64_t position = 0;
+    for (size_t i = 0; i < elements.size(); ++i)
+    {
+        if (std::find_if(elements.begin() + i, elements.end(), [&](const PlyElement & e)
+            { return std::find(requestedElements.begin(), requestedElements.end(), e.name) != requestedElements.end(); }) == elements.end()) break;
+
+        const PlyElement & element = elements[i];
+        const bool requested = std::find(requestedElements.begin(), requestedElements.end(), element.name) != requestedElements.end();
+        if (!requested)
+        {
+            skip_element_binary(i, is, position, nullptr);
+        }
+        else if (element.name != streamedElement)
+        {
+            read_element_binary(element, is);
+        }
+        else
+        {
+            for (size_t first = 0; first < element.size; first += batchSize)
+            {
+                const size_t count = std::min(batchSize, element.size - first);
+                reset_cursors(element);
+                read_records_binary(element, is, count);
+                if (!callback(first, count)) return;
+            }
+        }
+
+        if (!is.good()) throw std::runtime_error("unexpected end of file");
+        uint64_t & end = index.elementOffsets[i + 1];
+        if (end == PlyIndex::unknown && bodyStart != std::streampos(-1))
+        {
+            const std::streampos current = is.tellg();
+            if (current != std::streampos(-1)) end = static_cast<uint64_t>(current - bodyStart);
         }
-        else continue;
+        position = end;
     }
 }
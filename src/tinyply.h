@@ -42,12 +42,69 @@ namespace tinyply
 	inline float endian_swap_float(const uint32_t & v) { uint32_t r = endian_swap(v); return *(float*)&r; }
 	inline double endian_swap_double(const uint64_t & v) { uint64_t r = endian_swap(v); return *(double*)&r; }
 
-	struct DataCursor
+	// Bulk in-place byte swap of `count` consecutive values of `valueSize` (2, 4 or 8) bytes.
+	// Uses AVX2/SSSE3/SSE2 when the compiler targets them, SSSE3 if the CPU has it (GCC and
+	// Clang on x86), and a scalar loop otherwise.
+	void endian_swap_buffer(void * data, size_t count, size_t valueSize);
+	void endian_swap_buffer_scalar(void * data, size_t count, size_t valueSize);
+
+	// Read-only memory mapping of a whole file. The mapping lives as long as any PlyFile
+	// or view that shares it, so property views can point straight into the file.
+	class MappedFile
 	{
-		void * vector;
-		uint8_t * data;
-		size_t offset;
-		bool realloc = false;
+	public:
+		MappedFile(const std::string & path);
+		~MappedFile();
+		MappedFile(const MappedFile &) = delete;
+		MappedFile & operator=(const MappedFile &) = delete;
+
+		const uint8_t * data() const { return begin; }
+		size_t size() const { return length; }
+
+	private:
+		const uint8_t * begin = nullptr;
+		size_t length = 0;
+		std::vector<uint8_t> fallback; // used where mmap is not available
+	};
+
+	// Read-only std::streambuf over a memory range (used to parse from a mapping).
+	class MemoryBuffer : public std::streambuf
+	{
+	public:
+		MemoryBuffer(const uint8_t * begin, size_t size);
+		const uint8_t * current() const { return reinterpret_cast<const uint8_t *>(gptr()); }
+		size_t remaining() const { return static_cast<size_t>(egptr() - gptr()); }
+	protected:
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+		pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+	};
+
+	// Strided, typed view onto one property column of a mapped element.
+	template<typename T>
+	struct StridedView
+	{
+		const uint8_t * data = nullptr;
+		size_t stride = 0;
+		size_t count = 0;
+
+		StridedView() {}
+		StridedView(const void * data, size_t stride, size_t count) : data(static_cast<const uint8_t *>(data)), stride(stride), count(count) {}
+
+		T operator[](size_t i) const { T v; std::memcpy(&v, data + i * stride, sizeof(T)); return v; }
+		StridedView subview(size_t first, size_t n) const { return StridedView(data + first * stride, stride, n); }
+		size_t size() const { return count; }
+		bool empty() const { return data == nullptr || count == 0; }
+	};
+
+	// Raw byte range of a fixed-size element inside a mapping.
+	struct ElementView
+	{
+		const uint8_t * data = nullptr;
+		size_t stride = 0;
+		size_t count = 0;
+
+		size_t size_bytes() const { return stride * count; }
+		bool empty() const { return data == nullptr || count == 0; }
 	};
 
 	class PlyProperty
@@ -78,6 +135,34 @@ namespace tinyply
 		std::string name;
 	};
 
+	struct DataCursor
+	{
+		void * vector;
+		uint8_t * data;
+		size_t offset;
+		bool realloc = false;
+		PlyProperty::Type type = PlyProperty::Type::INVALID; // element type of *vector
+		size_t size = 0; // values allocated when reading starts
+		bool normalize = false; // integers map to [0, 1] / [-1, 1] when converted to or from floats
+	};
+
+	// Byte offsets inside a binary body (relative to its first byte). Element offsets are known up
+	// front for fixed-size elements; list elements need one pass, after which the index can be
+	// saved and loaded again to seek straight to any element or list record.
+	struct PlyIndex
+	{
+		static const uint64_t unknown = ~uint64_t(0);
+		std::vector<uint64_t> elementOffsets; // one per element plus the end of the body
+		std::map<std::string, std::vector<uint64_t>> recordOffsets; // list elements, filled by build_index()
+
+		void save(std::ostream & os) const;
+		bool load(std::istream & is);
+	};
+
+	// Called after each batch of a streamed element with the index of its first record and its size.
+	// Returning false stops reading.
+	typedef std::function<bool(size_t first, size_t count)> BatchCallback;
+
 	inline std::string make_key(const std::string & a, const std::string & b)
 	{
 		return (a + "-" + b);
@@ -143,31 +228,32 @@ namespace tinyply
 	}
 
 	template<typename T>
-	inline uint8_t * resize(void * v, size_t newSize)
+	inline uint8_t * resize(void * v, size_t newSize, bool exact)
 	{
 		auto vec = static_cast<std::vector<T> *>(v);
-		vec->resize(newSize);
+		if (exact) std::vector<T>(newSize).swap(*vec); // also releases a larger allocation
+		else vec->resize(newSize);
 		return reinterpret_cast<uint8_t *>(vec->data());
 	}
 
-	inline void resize_vector(const PlyProperty::Type t, void * v, size_t newSize, uint8_t *& ptr)
+	inline void resize_vector(const PlyProperty::Type t, void * v, size_t newSize, uint8_t *& ptr, bool exact = false)
 	{
 		switch (t)
 		{
-		case PlyProperty::Type::INT8:       ptr = resize<int8_t>(v, newSize);   break;
-		case PlyProperty::Type::UINT8:      ptr = resize<uint8_t>(v, newSize);  break;
-		case PlyProperty::Type::INT16:      ptr = resize<int16_t>(v, newSize);  break;
-		case PlyProperty::Type::UINT16:     ptr = resize<uint16_t>(v, newSize); break;
-		case PlyProperty::Type::INT32:      ptr = resize<int32_t>(v, newSize);  break;
-		case PlyProperty::Type::UINT32:     ptr = resize<uint32_t>(v, newSize); break;
-		case PlyProperty::Type::FLOAT32:    ptr = resize<float>(v, newSize);    break;
-		case PlyProperty::Type::FLOAT64:    ptr = resize<double>(v, newSize);   break;
+		case PlyProperty::Type::INT8:       ptr = resize<int8_t>(v, newSize, exact);   break;
+		case PlyProperty::Type::UINT8:      ptr = resize<uint8_t>(v, newSize, exact);  break;
+		case PlyProperty::Type::INT16:      ptr = resize<int16_t>(v, newSize, exact);  break;
+		case PlyProperty::Type::UINT16:     ptr = resize<uint16_t>(v, newSize, exact); break;
+		case PlyProperty::Type::INT32:      ptr = resize<int32_t>(v, newSize, exact);  break;
+		case PlyProperty::Type::UINT32:     ptr = resize<uint32_t>(v, newSize, exact); break;
+		case PlyProperty::Type::FLOAT32:    ptr = resize<float>(v, newSize, exact);    break;
+		case PlyProperty::Type::FLOAT64:    ptr = resize<double>(v, newSize, exact);   break;
 		case PlyProperty::Type::INVALID:    throw std::invalid_argument("invalid ply property");
 		}
 	}
 
 	template <typename T>
-	inline PlyProperty::Type property_type_for_type(std::vector<T> & theType)
+	inline PlyProperty::Type property_type_for_type(const std::vector<T> & theType)
 	{
 		if (std::is_same<T, int8_t>::value)          return PlyProperty::Type::INT8;
 		else if (std::is_same<T, uint8_t>::value)    return PlyProperty::Type::UINT8;
@@ -210,8 +296,16 @@ namespace tinyply
 
 		PlyFile() {}
 		PlyFile(std::istream & is);
+		PlyFile(std::shared_ptr<MappedFile> file);
 
 		void read(std::istream & is);
+		void read(); // only for files opened from a MappedFile
+
+		// Like read(), but the requested properties of `elementKey` are decoded in batches of at
+		// most `batchSize` records. Their vectors hold only the current batch while `callback` runs,
+		// so memory is bounded by the batch size. The element must not have list properties.
+		void read_batches(std::istream & is, const std::string & elementKey, size_t batchSize, const BatchCallback & callback);
+		void read_batches(const std::string & elementKey, size_t batchSize, const BatchCallback & callback);
 		void write(std::ostream & os, bool isBinary);
 
 		std::vector<PlyElement> & get_elements() { return elements; }
@@ -219,12 +313,19 @@ namespace tinyply
 		std::vector<std::string> comments;
 		std::vector<std::string> objInfo;
 
+		// The properties are converted to T while decoding if the file stores another type. With
+		// `normalize`, integers are scaled to [0, 1] (unsigned) or [-1, 1] (signed) when converted
+		// to floating point and back, e.g. uchar colors to float. Components that are not
+		// requested are not decoded, so { "red", "green", "blue" } drops the alpha of RGBA.
 		template<typename T>
-		size_t request_properties_from_element(const std::string & elementKey, std::vector<std::string> propertyKeys, std::vector<T> & source, const int listCount = 1)
+		size_t request_properties_from_element(const std::string & elementKey, std::vector<std::string> propertyKeys, std::vector<T> & source, const int listCount = 1, const bool normalize = false)
 		{
 			if (get_elements().size() == 0)
 				return 0;
 
+			if (property_type_for_type(source) == PlyProperty::Type::INVALID)
+				throw std::invalid_argument("destination vector is not of a ply property type");
+
 			if (find_element(elementKey, get_elements()) >= 0)
 			{
 				if (std::find(requestedElements.begin(), requestedElements.end(), elementKey) == requestedElements.end())
@@ -242,10 +343,7 @@ namespace tinyply
 					{
 						if (p.name == propertyKey)
 						{
-							if (PropertyTable[property_type_for_type(source)].stride != PropertyTable[p.propertyType].stride)
-								throw std::runtime_error("destination vector is wrongly typed to hold this property");
 							return e.size;
-
 						}
 					}
 				}
@@ -298,10 +396,14 @@ namespace tinyply
 			}
 
 			size_t totalInstanceSize = [&]() { size_t t = 0; for (auto c : instanceCounts) { t += c; } return t; }() * listCount;
-			source.resize(totalInstanceSize); // this satisfies regular properties; `cursor->realloc` is for list types since tinyply uses single-pass parsing
+			// The vector is resized when reading starts, streamed elements only get one batch.
+			// This satisfies regular properties; `cursor->realloc` is for list types since tinyply uses single-pass parsing
 			cursor->offset = 0;
 			cursor->vector = &source;
-			cursor->data = reinterpret_cast<uint8_t *>(source.data());
+			cursor->data = nullptr;
+			cursor->type = property_type_for_type(source);
+			cursor->size = totalInstanceSize;
+			cursor->normalize = normalize;
 
 			if (listCount > 1)
 			{
@@ -312,6 +414,42 @@ namespace tinyply
 			return totalInstanceSize / propertyKeys.size();
 		}
 
+		// One pass over the body that records where every element and every list record starts.
+		// The stream must be positioned at the start of the body and is returned there.
+		const PlyIndex & build_index(std::istream & is);
+		const PlyIndex & build_index(); // only for files opened from a MappedFile
+		const PlyIndex & get_index() const { return index; }
+		// Uses a previously saved index, false if it does not match the header.
+		bool set_index(const PlyIndex & cached);
+
+		// True if the element can be viewed in place: binary little-endian, mapped, no list
+		// properties and located at a known offset in the file.
+		bool has_fixed_layout(const std::string & elementKey);
+
+		ElementView get_element_view(const std::string & elementKey);
+
+		// Zero-copy view onto one property of a fixed layout element, see has_fixed_layout().
+		template<typename T>
+		StridedView<T> request_view_from_element(const std::string & elementKey, const std::string & propertyKey)
+		{
+			const ElementView element = get_element_view(elementKey);
+			if (element.empty()) return StridedView<T>();
+
+			const PlyElement & e = elements[find_element(elementKey, elements)];
+			size_t offset = 0;
+			for (const auto & p : e.properties)
+			{
+				if (p.name == propertyKey)
+				{
+					if (p.propertyType != property_type_for_type(std::vector<T>()))
+						throw std::runtime_error("view is wrongly typed to hold this property");
+					return StridedView<T>(element.data + offset, element.stride, element.count);
+				}
+				offset += PropertyTable[p.propertyType].stride;
+			}
+			return StridedView<T>();
+		}
+
 		template<typename T>
 		void add_properties_to_element(const std::string & elementKey, const std::vector<std::string> & propertyKeys, std::vector<T> & source, const int listCount = 1, const PlyProperty::Type listType = PlyProperty::Type::INVALID)
 		{
@@ -348,10 +486,9 @@ namespace tinyply
 	private:
 
 		size_t skip_property_binary(const PlyProperty & property, std::istream & is);
-		void skip_property_ascii(const PlyProperty & property, std::istream & is);
 
 		void read_property_binary(PlyProperty::Type t, void * dest, size_t & destOffset, std::istream & is);
-		void read_property_ascii(PlyProperty::Type t, void * dest, size_t & destOffset, std::istream & is);
+		void read_property_binary(PlyProperty::Type t, DataCursor & cursor, std::istream & is);
 		void write_property_ascii(PlyProperty::Type t, std::ostream & os, uint8_t * src, size_t & srcOffset);
 		void write_property_binary(PlyProperty::Type t, std::ostream & os, uint8_t * src, size_t & srcOffset);
 
@@ -363,7 +500,18 @@ namespace tinyply
 		void read_header_property(std::istream & is);
 		void read_header_text(std::string line, std::istream & is, std::vector<std::string> & place, int erase = 0);
 
-		void read_internal(std::istream & is);
+		void read_internal(std::istream & is, const std::string & streamedElement = "", size_t batchSize = 0, const BatchCallback & callback = BatchCallback());
+		void allocate_cursors(const std::string & streamedElement, size_t batchSize);
+		void reset_cursors(const PlyElement & element);
+		void read_element_binary(const PlyElement & element, std::istream & is);
+		void read_records_binary(const PlyElement & element, std::istream & is, size_t count);
+		const char * read_records_ascii(const PlyElement & element, const char * p, const char * end, size_t count);
+
+		size_t element_stride(const PlyElement & element) const;
+		size_t element_offset(size_t elementIndex);
+		void reset_index();
+		void skip_bytes(std::istream & is, size_t bytes);
+		void skip_element_binary(size_t elementIndex, std::istream & is, uint64_t position, std::vector<uint64_t> * recordOffsets);
 
 		void write_ascii_internal(std::ostream & os);
 		void write_binary_internal(std::ostream & os);
@@ -375,6 +523,11 @@ namespace tinyply
 
 		std::vector<PlyElement> elements;
 		std::vector<std::string> requestedElements;
+
+		std::shared_ptr<MappedFile> mapping;
+		size_t dataOffset = 0;
+
+		PlyIndex index;
 	};
 
 } // namesapce tinyply
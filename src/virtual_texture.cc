@@ -0,0 +1,468 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#include "virtual_texture.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <unordered_set>
+
+#include <opencv2/opencv.hpp>
+
+#include "parallel.h"
+#include "scene_cache.h"
+
+namespace C3DV_graphics {
+
+namespace {
+
+// A tile of a layer, also the key of the slot it is resident in.
+uint64_t TileKey(int layer, int level, int x, int y) {
+    return (static_cast<uint64_t>(layer) << 48) | (static_cast<uint64_t>(level) << 32) |
+           (static_cast<uint64_t>(x) << 16) | static_cast<uint64_t>(y);
+}
+
+int KeyLayer(uint64_t key) { return static_cast<int>(key >> 48); }
+int KeyLevel(uint64_t key) { return static_cast<int>((key >> 32) & 0xffff); }
+int KeyX(uint64_t key) { return static_cast<int>((key >> 16) & 0xffff); }
+int KeyY(uint64_t key) { return static_cast<int>(key & 0xffff); }
+
+// Page table entry (slot x, slot y, level, 255) as it is laid out in a GL_RGBA8UI texel.
+uint32_t PageEntry(int slot, int level) {
+    return static_cast<uint32_t>(slot % kVirtualCacheSlots) |
+           (static_cast<uint32_t>(slot / kVirtualCacheSlots) << 8) |
+           (static_cast<uint32_t>(level) << 16) | (255u << 24);
+}
+
+}  // namespace
+
+int TilePyramid::Levels(int width, int height) {
+    const int tiles_x = (width + kVirtualTileSize - 1) / kVirtualTileSize;
+    const int tiles_y = (height + kVirtualTileSize - 1) / kVirtualTileSize;
+    int levels = 1;
+    while (tiles_x > (1 << (levels - 1)) || tiles_y > (1 << (levels - 1)))
+        levels++;
+    return levels;
+}
+
+int TilePyramid::TilesX(int level) const {
+    return (std::max(1, width_ >> level) + kVirtualTileSize - 1) / kVirtualTileSize;
+}
+
+int TilePyramid::TilesY(int level) const {
+    return (std::max(1, height_ >> level) + kVirtualTileSize - 1) / kVirtualTileSize;
+}
+
+const uint8_t* TilePyramid::Tile(int level, int x, int y) const {
+    return tiles_ + level_offsets_[level] + (static_cast<size_t>(y) * TilesX(level) + x) * kVirtualTileBytes;
+}
+
+bool TilePyramid::Map(const std::string& path, const std::string& file) {
+    auto cache = std::make_shared<C3DV_cache::SceneCache>();
+    if (!cache->Open(path, file))
+        return false;
+    const int size = cache->FindBuffer("size");
+    const int tiles = cache->FindBuffer("tiles");
+    if (size < 0 || tiles < 0 || cache->buffers()[size].size != 3 * sizeof(uint32_t))
+        return false;
+    uint32_t dimensions[3];
+    std::memcpy(dimensions, cache->BufferData(size), sizeof(dimensions));
+    width_ = static_cast<int>(dimensions[0]);
+    height_ = static_cast<int>(dimensions[1]);
+    levels_ = static_cast<int>(dimensions[2]);
+    if (width_ <= 0 || height_ <= 0 || levels_ != Levels(width_, height_))
+        return false;
+    level_offsets_.assign(levels_ + 1, 0);
+    for (int l = 0; l < levels_; l++)
+        level_offsets_[l + 1] = level_offsets_[l] + static_cast<size_t>(TilesX(l)) * TilesY(l) * kVirtualTileBytes;
+    if (cache->buffers()[tiles].size != level_offsets_[levels_])
+        return false;
+    tiles_ = cache->BufferData(tiles);
+    cache_ = cache;
+    return true;
+}
+
+bool TilePyramid::Open(const std::string& file) {
+    const std::string path = C3DV_cache::CachePath(file, "vt");
+    if (Map(path, file))
+        return true;
+    cv::Mat level = cv::imread(file, cv::IMREAD_COLOR);
+    if (level.empty()) {
+        std::cout << "Could not read texture " << file << std::endl;
+        return false;
+    }
+    width_ = level.cols;
+    height_ = level.rows;
+    levels_ = Levels(width_, height_);
+    size_t total = 0;
+    for (int l = 0; l < levels_; l++)
+        total += static_cast<size_t>(TilesX(l)) * TilesY(l) * kVirtualTileBytes;
+
+    C3DV_cache::SceneCacheWriter writer(path, file);
+    const uint32_t dimensions[3] = {static_cast<uint32_t>(width_), static_cast<uint32_t>(height_), static_cast<uint32_t>(levels_)};
+    writer.AddBuffer("size", dimensions, sizeof(dimensions));
+    writer.AddBuffer("tiles", nullptr, total);
+    // One level at a time, so that only a level and its tiles are in memory besides the source.
+    std::vector<uint8_t> texels;
+    size_t offset = 0;
+    for (int l = 0; l < levels_; l++) {
+        if (l > 0)
+            cv::resize(level, level, cv::Size(std::max(1, width_ >> l), std::max(1, height_ >> l)), 0, 0, cv::INTER_AREA);
+        const int tiles_x = TilesX(l);
+        const int tiles_y = TilesY(l);
+        // The texture repeats, so the borders and the padding up to whole tiles wrap around.
+        cv::Mat padded;
+        cv::copyMakeBorder(level, padded, kVirtualTileBorder, tiles_y * kVirtualTileSize - level.rows + kVirtualTileBorder,
+                           kVirtualTileBorder, tiles_x * kVirtualTileSize - level.cols + kVirtualTileBorder, cv::BORDER_WRAP);
+        texels.resize(static_cast<size_t>(tiles_x) * tiles_y * kVirtualTileBytes);
+        ParallelFor(static_cast<size_t>(tiles_y), [&](size_t y) {
+            for (int x = 0; x < tiles_x; x++) {
+                uint8_t* tile = texels.data() + (y * tiles_x + x) * kVirtualTileBytes;
+                for (int row = 0; row < kVirtualSlotSize; row++)
+                    std::memcpy(tile + static_cast<size_t>(row) * kVirtualSlotSize * 3,
+                                padded.ptr(static_cast<int>(y) * kVirtualTileSize + row) + x * kVirtualTileSize * 3,
+                                kVirtualSlotSize * 3);
+            }
+        });
+        writer.WriteBuffer("tiles", offset, texels.data(), texels.size());
+        offset += texels.size();
+    }
+    if (!writer.Finish()) {
+        std::cout << "Could not write tile pyramid " << path << std::endl;
+        return false;
+    }
+    return Map(path, file);
+}
+
+VirtualTexture::~VirtualTexture() {
+    Free();
+}
+
+void VirtualTexture::Init(const std::vector<std::shared_ptr<const TilePyramid>>& pyramids) {
+    Free();
+    if (pyramids.empty())
+        return;
+    pyramids_ = pyramids;
+    page_table_levels_ = 1;
+    for (const auto& pyramid : pyramids_)
+        page_table_levels_ = std::max(page_table_levels_, pyramid->levels());
+    const int table_size = 1 << (page_table_levels_ - 1);
+    const int layers = static_cast<int>(pyramids_.size());
+
+    const int cache_size = kVirtualCacheSlots * kVirtualSlotSize;
+    glGenTextures(1, &cache_texture_);
+    glBindTexture(GL_TEXTURE_2D, cache_texture_);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, cache_size, cache_size, 0, GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenTextures(1, &page_table_);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, page_table_);
+    for (int l = 0; l < page_table_levels_; l++) {
+        const int size = std::max(1, table_size >> l);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, l, GL_RGBA8UI, size, size, layers, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, page_table_levels_ - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    page_entries_.resize(layers);
+    for (auto& levels : page_entries_) {
+        levels.resize(page_table_levels_);
+        for (int l = 0; l < page_table_levels_; l++) {
+            const size_t size = static_cast<size_t>(std::max(1, table_size >> l));
+            levels[l].assign(size * size, 0);
+        }
+    }
+    dirty_layers_.assign(layers, true);
+    slots_.assign(static_cast<size_t>(kVirtualCacheSlots) * kVirtualCacheSlots, Slot());
+
+    // The single tile of the last level is the fallback for everything else of a layer.
+    for (int layer = 0; layer < layers; layer++) {
+        const int top = pyramids_[layer]->levels() - 1;
+        const uint64_t key = TileKey(layer, top, 0, 0);
+        Upload(key, pyramids_[layer]->Tile(top, 0, 0));
+        slots_[resident_[key]].pinned = true;
+    }
+    for (int layer = 0; layer < layers; layer++)
+        UpdatePageTable(layer);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    stop_ = false;
+    stream_thread_ = std::thread(&VirtualTexture::Stream, this);
+}
+
+void VirtualTexture::Free() {
+    if (stream_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        stream_thread_.join();
+    }
+    requests_.clear();
+    streamed_.clear();
+    resident_.clear();
+    slots_.clear();
+    page_entries_.clear();
+    dirty_layers_.clear();
+    pyramids_.clear();
+    if (cache_texture_)
+        glDeleteTextures(1, &cache_texture_);
+    if (page_table_)
+        glDeleteTextures(1, &page_table_);
+    if (feedback_color_)
+        glDeleteTextures(1, &feedback_color_);
+    if (feedback_depth_)
+        glDeleteRenderbuffers(1, &feedback_depth_);
+    if (feedback_framebuffer_)
+        glDeleteFramebuffers(1, &feedback_framebuffer_);
+    if (feedback_buffers_[0])
+        glDeleteBuffers(2, feedback_buffers_);
+    cache_texture_ = page_table_ = 0;
+    feedback_color_ = feedback_depth_ = feedback_framebuffer_ = 0;
+    feedback_buffers_[0] = feedback_buffers_[1] = 0;
+    feedback_size_[0] = feedback_size_[1] = 0;
+    feedback_written_[0] = feedback_written_[1] = false;
+    page_table_levels_ = 0;
+    frame_ = 0;
+    uploads_ = 0;
+}
+
+void VirtualTexture::Stream() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        // Streams ahead by at most two frames of uploads, requests change every frame.
+        wake_.wait(lock, [this]() {
+            return stop_ || (!requests_.empty() && streamed_.size() < 2 * kVirtualTileUploads);
+        });
+        if (stop_)
+            return;
+        const uint64_t key = requests_.front();
+        requests_.pop_front();
+        lock.unlock();
+        // Copying the tile out of the mapping is what reads it from disk.
+        const uint8_t* texels = pyramids_[KeyLayer(key)]->Tile(KeyLevel(key), KeyX(key), KeyY(key));
+        StreamedTile tile{key, std::vector<uint8_t>(texels, texels + kVirtualTileBytes)};
+        lock.lock();
+        streamed_.push_back(std::move(tile));
+    }
+}
+
+bool VirtualTexture::ReadFeedback(std::vector<uint64_t>& wanted) {
+    const int buffer = static_cast<int>((frame_ + 1) % 2);
+    if (!feedback_written_[buffer])
+        return false;
+    const size_t pixels = static_cast<size_t>(feedback_size_[0]) * feedback_size_[1];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, feedback_buffers_[buffer]);
+    const uint8_t* feedback = static_cast<const uint8_t*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pixels * 4, GL_MAP_READ_BIT));
+    if (feedback) {
+        std::unordered_set<uint64_t> seen;
+        for (size_t i = 0; i < pixels; i++) {
+            const uint8_t* texel = feedback + 4 * i;
+            const int layer = texel[3] - 1;
+            if (layer < 0 || layer >= static_cast<int>(pyramids_.size()))
+                continue;
+            const TilePyramid& pyramid = *pyramids_[layer];
+            int level = texel[2], x = texel[0], y = texel[1];
+            if (level >= pyramid.levels() || x >= pyramid.TilesX(level) || y >= pyramid.TilesY(level))
+                continue;
+            // The tile and the coarser ones it falls back to, up to where another pixel got before.
+            for (; level < pyramid.levels(); level++, x /= 2, y /= 2) {
+                const uint64_t key = TileKey(layer, level, x, y);
+                if (!seen.insert(key).second)
+                    break;
+                const auto resident = resident_.find(key);
+                if (resident != resident_.end())
+                    slots_[resident->second].last_used = frame_;
+                else
+                    wanted.push_back(key);
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    feedback_written_[buffer] = false;
+    return feedback != nullptr;
+}
+
+void VirtualTexture::Update() {
+    if (!Active())
+        return;
+    frame_++;
+    uploads_ = 0;
+    std::vector<uint64_t> wanted;
+    const bool feedback = ReadFeedback(wanted);
+    // Coarse tiles first, they cover the most and the finer ones fall back to them.
+    std::stable_sort(wanted.begin(), wanted.end(), [](uint64_t a, uint64_t b) {
+        return KeyLevel(a) > KeyLevel(b);
+    });
+    std::deque<StreamedTile> streamed;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // What the last frames asked for and was not streamed yet is out of date.
+        if (feedback)
+            requests_.assign(wanted.begin(), wanted.end());
+        const size_t count = std::min(streamed_.size(), kVirtualTileUploads);
+        std::move(streamed_.begin(), streamed_.begin() + count, std::back_inserter(streamed));
+        streamed_.erase(streamed_.begin(), streamed_.begin() + count);
+    }
+    wake_.notify_one();
+
+    for (const StreamedTile& tile : streamed)
+        Upload(tile.key, tile.texels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    for (size_t layer = 0; layer < dirty_layers_.size(); layer++) {
+        if (dirty_layers_[layer])
+            UpdatePageTable(static_cast<int>(layer));
+    }
+}
+
+void VirtualTexture::Upload(uint64_t key, const uint8_t* texels) {
+    if (resident_.count(key))
+        return;
+    // A free slot, otherwise the least recently seen one that was not seen in this frame.
+    int victim = -1;
+    for (size_t i = 0; i < slots_.size(); i++) {
+        const Slot& slot = slots_[i];
+        if (slot.pinned)
+            continue;
+        if (!slot.used) {
+            victim = static_cast<int>(i);
+            break;
+        }
+        if (slot.last_used < frame_ && (victim < 0 || slot.last_used < slots_[victim].last_used))
+            victim = static_cast<int>(i);
+    }
+    if (victim < 0)
+        return;
+    Slot& slot = slots_[victim];
+    if (slot.used) {
+        resident_.erase(slot.key);
+        dirty_layers_[KeyLayer(slot.key)] = true;
+    }
+    slot.key = key;
+    slot.last_used = frame_;
+    slot.used = true;
+    resident_[key] = victim;
+    dirty_layers_[KeyLayer(key)] = true;
+
+    glBindTexture(GL_TEXTURE_2D, cache_texture_);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, (victim % kVirtualCacheSlots) * kVirtualSlotSize, (victim / kVirtualCacheSlots) * kVirtualSlotSize,
+                    kVirtualSlotSize, kVirtualSlotSize, GL_BGR, GL_UNSIGNED_BYTE, texels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    uploads_++;
+}
+
+void VirtualTexture::UpdatePageTable(int layer) {
+    const TilePyramid& pyramid = *pyramids_[layer];
+    const int top = pyramid.levels() - 1;
+    const int table_size = 1 << (page_table_levels_ - 1);
+    const uint32_t top_entry = PageEntry(resident_.at(TileKey(layer, top, 0, 0)), top);
+    auto& levels = page_entries_[layer];
+    // Coarse to fine, a tile that is not resident points where its parent points.
+    for (int l = page_table_levels_ - 1; l >= 0; l--) {
+        const int size = std::max(1, table_size >> l);
+        if (l >= top) {
+            std::fill(levels[l].begin(), levels[l].end(), top_entry);
+            continue;
+        }
+        const int parent_size = std::max(1, table_size >> (l + 1));
+        const int tiles_x = pyramid.TilesX(l);
+        const int tiles_y = pyramid.TilesY(l);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                uint32_t entry = levels[l + 1][(y / 2) * parent_size + x / 2];
+                if (x < tiles_x && y < tiles_y) {
+                    const auto resident = resident_.find(TileKey(layer, l, x, y));
+                    if (resident != resident_.end())
+                        entry = PageEntry(resident->second, l);
+                }
+                levels[l][static_cast<size_t>(y) * size + x] = entry;
+            }
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, page_table_);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for (int l = 0; l < page_table_levels_; l++) {
+        const int size = std::max(1, table_size >> l);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, layer, size, size, 1, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, levels[l].data());
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    dirty_layers_[layer] = false;
+}
+
+void VirtualTexture::BeginFeedback() {
+    glGetIntegerv(GL_VIEWPORT, viewport_);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer_);
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color_);
+    const int width = std::max(1, viewport_[2] / kVirtualFeedbackScale);
+    const int height = std::max(1, viewport_[3] / kVirtualFeedbackScale);
+    if (feedback_framebuffer_ == 0 || width != feedback_size_[0] || height != feedback_size_[1]) {
+        if (feedback_framebuffer_ == 0) {
+            glGenFramebuffers(1, &feedback_framebuffer_);
+            glGenTextures(1, &feedback_color_);
+            glGenRenderbuffers(1, &feedback_depth_);
+            glGenBuffers(2, feedback_buffers_);
+        }
+        glBindTexture(GL_TEXTURE_2D, feedback_color_);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindRenderbuffer(GL_RENDERBUFFER, feedback_depth_);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, feedback_framebuffer_);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, feedback_color_, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedback_depth_);
+        for (GLuint buffer : feedback_buffers_) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(width) * height * 4, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        feedback_size_[0] = width;
+        feedback_size_[1] = height;
+        feedback_written_[0] = feedback_written_[1] = false;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, feedback_framebuffer_);
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void VirtualTexture::EndFeedback() {
+    // Read back without waiting, the buffer is mapped by the Update() of the next frame.
+    const int buffer = static_cast<int>(frame_ % 2);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, feedback_buffers_[buffer]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, feedback_size_[0], feedback_size_[1], GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    feedback_written_[buffer] = true;
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+    glViewport(viewport_[0], viewport_[1], viewport_[2], viewport_[3]);
+    glClearColor(clear_color_[0], clear_color_[1], clear_color_[2], clear_color_[3]);
+}
+
+void VirtualTexture::Bind(int page_table_unit, int cache_unit) const {
+    glActiveTexture(GL_TEXTURE0 + page_table_unit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, page_table_);
+    glActiveTexture(GL_TEXTURE0 + cache_unit);
+    glBindTexture(GL_TEXTURE_2D, cache_texture_);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+};
@@ -0,0 +1,146 @@
+/*******************************************************
+ * Copyright (c) 2018, Johanna Wald
+ * All rights reserved.
+ *
+ * This file is distributed under the GNU Lesser General Public License v3.0.
+ * The complete license agreement can be obtained at:
+ * http://www.gnu.org/licenses/lgpl-3.0.html
+ ********************************************************/
+
+#ifndef _H_VIRTUAL_TEXTURE_
+#define _H_VIRTUAL_TEXTURE_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <nanogui/opengl.h>
+
+namespace C3DV_cache {
+class SceneCache;
+};
+
+namespace C3DV_graphics {
+
+// Texels of a tile, and the border around it that repeats the neighbouring texels so that
+// bilinear filtering does not bleed into other tiles of the physical cache.
+constexpr int kVirtualTileSize = 128;
+constexpr int kVirtualTileBorder = 4;
+constexpr int kVirtualSlotSize = kVirtualTileSize + 2 * kVirtualTileBorder;
+constexpr size_t kVirtualTileBytes = static_cast<size_t>(kVirtualSlotSize) * kVirtualSlotSize * 3;
+// The physical cache holds kVirtualCacheSlots^2 tiles (4352^2 RGB8 texels, about 57 MB).
+constexpr int kVirtualCacheSlots = 32;
+// Tiles uploaded per frame, the rest waits for the next frames.
+constexpr size_t kVirtualTileUploads = 32;
+// The feedback pass renders at 1/kVirtualFeedbackScale of the viewport.
+constexpr int kVirtualFeedbackScale = 8;
+
+// The mip pyramid of one texture cut into tiles (with their borders, RGB8, level 0 first), kept
+// on disk next to the texture (e.g. `page.png.vt.c3dv`) and mapped, so that tiles are only read
+// from disk when they are streamed. Level l is the texture scaled to max(1, width >> l) and the
+// last level is a single tile.
+class TilePyramid {
+public:
+    // Maps the pyramid of a texture file, which is built first if there is none or it is outdated.
+    bool Open(const std::string& file);
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int levels() const { return levels_; }
+    int TilesX(int level) const;
+    int TilesY(int level) const;
+    // kVirtualTileBytes of the tile, pointing into the mapping.
+    const uint8_t* Tile(int level, int x, int y) const;
+    // Levels for a texture size, enough for the last one to be a single tile.
+    static int Levels(int width, int height);
+private:
+    std::shared_ptr<C3DV_cache::SceneCache> cache_;
+    const uint8_t* tiles_{nullptr};
+    std::vector<size_t> level_offsets_;
+    int width_{0};
+    int height_{0};
+    int levels_{0};
+    bool Map(const std::string& path, const std::string& file);
+};
+
+// Tile based virtual texturing of several textures (the layers of a mesh): a fixed size physical
+// cache texture, a page table per texture (a 2D array with one layer per texture and one mip level
+// per pyramid level) that points every tile at its slot in the cache or at the closest coarser
+// tile that is, and a feedback pass that renders the wanted tiles into a small framebuffer, read
+// back one frame later through a pixel buffer. Missing tiles are read from the pyramids on a
+// streaming thread and uploaded by Update(), the least recently seen tiles are evicted.
+// Everything but the streaming thread runs on the render thread.
+class VirtualTexture {
+public:
+    ~VirtualTexture();
+    // Creates the textures and loads the last level of every pyramid, which stays resident.
+    void Init(const std::vector<std::shared_ptr<const TilePyramid>>& pyramids);
+    void Free();
+    bool Active() const { return !pyramids_.empty(); }
+    // Reads the feedback of the last frame, requests what is missing and uploads streamed tiles.
+    void Update();
+    // Redirects drawing into the feedback framebuffer (and back), the shader has to write
+    // (tile x, tile y, level, layer + 1) / 255 per fragment.
+    void BeginFeedback();
+    void EndFeedback();
+    // Binds the page table and the physical cache to two texture units.
+    void Bind(int page_table_unit, int cache_unit) const;
+    size_t ResidentTiles() const { return resident_.size(); }
+    size_t Uploads() const { return uploads_; }
+private:
+    struct Slot {
+        uint64_t key{0};
+        uint64_t last_used{0};
+        bool used{false};
+        bool pinned{false};
+    };
+    struct StreamedTile {
+        uint64_t key;
+        std::vector<uint8_t> texels;
+    };
+
+    std::vector<std::shared_ptr<const TilePyramid>> pyramids_;
+    GLuint cache_texture_{0};
+    GLuint page_table_{0};
+    int page_table_levels_{0};
+    // Entries of every layer and level, (slot x, slot y, level, 255) each.
+    std::vector<std::vector<std::vector<uint32_t>>> page_entries_;
+    std::vector<bool> dirty_layers_;
+    std::vector<Slot> slots_;
+    std::unordered_map<uint64_t, int> resident_;
+    uint64_t frame_{0};
+    size_t uploads_{0};
+
+    GLuint feedback_framebuffer_{0};
+    GLuint feedback_color_{0};
+    GLuint feedback_depth_{0};
+    GLuint feedback_buffers_[2]{0, 0};
+    int feedback_size_[2]{0, 0};
+    // Whether the buffer holds a frame's feedback, the buffers alternate between frames.
+    bool feedback_written_[2]{false, false};
+    GLint viewport_[4]{0, 0, 0, 0};
+    GLint framebuffer_{0};
+    GLfloat clear_color_[4]{0, 0, 0, 0};
+
+    std::thread stream_thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<uint64_t> requests_;
+    std::deque<StreamedTile> streamed_;
+    bool stop_{false};
+
+    void Stream();
+    // Marks the seen tiles as used and adds the missing ones, false without new feedback.
+    bool ReadFeedback(std::vector<uint64_t>& wanted);
+    void Upload(uint64_t key, const uint8_t* texels);
+    void UpdatePageTable(int layer);
+};
+
+};
+
+#endif  // _H_VIRTUAL_TEXTURE_